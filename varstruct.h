@@ -31,7 +31,8 @@
 //
 // (Modification is performed via std::memcpy() to avoid memory alignment
 // problems that would otherwise occur accessing misaligned fields -- Varstruct
-// doesn't add any padding of its own).
+// doesn't add any padding of its own, unless DEFINE_VARSTRUCT_ALIGNED() is
+// used).
 //
 // Varstruct definitions look like struct or class definitions:
 //
@@ -54,11 +55,19 @@
 // static Create() -- Creates a varstruct given an optional pointer and a brace
 //                    list of array sizes.
 //
-// num_members() -- Returns the number of VARSTRUCT_SCALAR() declarations plus
-//                  the number of VARSTRUCT_ARRAY() declarations.
+// static num_members() -- Returns the number of VARSTRUCT_SCALAR() declarations
+//                         plus the number of VARSTRUCT_ARRAY() declarations.
+//                         This is known at compile time.
+//
+// static schema() -- Returns the name, declared type, kind, size, byte order
+//                    and count field of each member, known at compile time.
+//                    See below.
 //
 // size_bytes() -- Returns the size of the entire varstruct, in bytes.
 //
+// ForEachField(visitor) -- Calls visitor(field) for each member, in
+//                          declaration order. See below.
+//
 // These methods get generated by VARSTRUCT_SCALAR() and VARSTRUCT_ARRAY()
 // declarations:
 //
@@ -70,6 +79,9 @@
 // std::size_t bar_size() -- Returns the size of all cells of bar in bytes.
 // std::size_t bar_offset() -- Returns the offset of bar in SimpleStruct.
 //
+// static std::size_t foo_index() -- Returns the index of foo in declaration
+//                                   order, for slice().
+//
 // A base pointer may also be provided to Create() in addition to the brace-list
 // of array sizes:
 //
@@ -81,6 +93,30 @@
 // char bar(size_t index) -- Returns the 0-indexed element of bar given by
 //                           index.
 //
+// Span<char> bar_bytes() -- Returns a view of the bytes of all cells of bar,
+//                           without copying. The view has data() and size()
+//                           methods, and may be iterated over.
+// Span<char> bar_span() -- Returns a view of all cells of bar, typed as
+//                          decl_type, without copying. Since Varstruct adds no
+//                          padding, this is only available for element types
+//                          with an alignment of 1 unless the caller asserts
+//                          that the array is aligned, with
+//                          bar_span</*assume_aligned=*/true>(), or the
+//                          varstruct is defined by
+//                          DEFINE_VARSTRUCT_ALIGNED().
+//
+// Span<char> slice<First, Last>() -- Returns a view of the bytes from the
+//     start of the field with index First through the end of the field with
+//     index Last, as in slice<SimpleStruct::bar_index(),
+//     SimpleStruct::baz_index()>(), without copying.
+//
+// For const pointers, these views are of const elements. Views are two words,
+// and subspan(offset, count) returns a view of some of their elements.
+//
+// void bar_copy_to(char* dst, size_t first, size_t count) -- Copies count
+//     elements of bar, starting at the 0-indexed element given by first, into
+//     dst with a single std::memcpy(). The whole range is checked at once.
+//
 // Bounds checks are performed by default. To disable this, use the bounds_check
 // template parameter:
 //
@@ -93,6 +129,10 @@
 // void set_bar(size_t index, char value) -- Sets the 0-indexed element of bar
 //                                           given by index to value.
 //
+// void set_bar_from(const char* src, size_t first, size_t count) -- Copies
+//     count elements from src into bar, starting at the 0-indexed element
+//     given by first, with a single std::memcpy().
+//
 // Again, bounds checks may be disabled for modifier methods:
 //
 // set_bar</*bounds_check=*/false>(100, 'a');
@@ -100,6 +140,196 @@
 // Attempting to use pointer accessor without passing the appropriate pointer to
 // Create() will result in a compilation error.
 //
+// If the length of the buffer is known, pass it to Create() too:
+//
+// auto simple_struct = SimpleStruct::Create(my_ptr, my_len, {5, 8});
+// if (!simple_struct) return kTruncated;
+// x = simple_struct->bar</*bounds_check=*/false>(i);  // Any i < 5 is safe.
+//
+// This overload returns an optional-like object instead of the varstruct. It
+// converts to false if size_bytes() would exceed the buffer length (or an
+// array size exceeds its VARSTRUCT_MAX_COUNT(), or the offsets would overflow),
+// and otherwise dereferences (with * or ->) to the varstruct. As the buffer is
+// validated once, up front, accessors may then skip their bounds checks. Unlike
+// those bounds checks, this validation is not compiled out by NDEBUG.
+//
+// Create() does not allocate: the number of members is known at compile time,
+// so the computed offsets are stored inline in the returned varstruct. Array
+// sizes that are only known at runtime may be passed as a pointer and count, or
+// as any contiguous container of std::size_t, instead of a brace list:
+//
+// std::array<std::size_t, 2> sizes = {{5, n}};
+// auto simple_struct = SimpleStruct::Create(my_ptr, sizes);
+// auto simple_struct = SimpleStruct::Create(my_ptr, {sizes.data(), 2});
+//
+// When many buffers share the same array sizes, the offsets may be computed
+// once and then bound to each buffer:
+//
+// const auto layout = SimpleStruct::Create({5, 8});
+// auto first = layout.bind(first_ptr);
+// auto second = layout.bind(second_ptr);
+//
+// bind() accepts a void* or const void* pointer just like Create(), but the
+// returned varstruct refers to the offsets of layout instead of copying them,
+// so binding costs no more than storing a pointer. The layout must outlive the
+// varstructs bound with it. VarstructLayoutCache, in varstruct_layout_cache.h,
+// keeps such layouts for many combinations of array sizes, and may be shared
+// between threads.
+//
+// Varstructs are trivially copyable values that own nothing. A bound one is
+// the size of two pointers (its pointer and that of the shared offsets), and
+// one returned by CreateStatic(ptr) the size of one, so passing them by value,
+// as through a queue, copies no more than that and never allocates.
+//
+// When only the first few members of a varstruct with many are read, as when
+// routing on a header, CreateLazy() computes offsets on demand instead:
+//
+// auto header = SimpleStruct::CreateLazy(my_ptr, {5, 8});
+// Route(header.foo());  // Computes no array offsets.
+//
+// Each access computes the offsets of the members up to the one accessed, if
+// not already computed, and keeps them for later accesses; size_bytes()
+// computes them all. CreateLazy() accepts a void* or const void* pointer, like
+// Create(), but does not validate a buffer length. The returned varstruct
+// updates its offsets even when only read, so it must not be shared between
+// threads; bind() it to share the (then fully computed) offsets instead.
+//
+// If every array size is known at compile time, CreateStatic() takes them as
+// template arguments instead:
+//
+// constexpr auto simple_struct = SimpleStruct::CreateStatic<5, 8>();
+// static_assert(simple_struct.baz_offset() == 9, "");
+//
+// Every foo_offset(), bar_size() and size_bytes() method of the result is a
+// constant expression, so accessors of CreateStatic<5, 8>(my_ptr) compile down
+// to loads at fixed displacements from my_ptr, just like a hand-written packed
+// struct.
+//
+// Buffers holding many varstructs back to back, as in capture files, may be
+// iterated over with CreateRange():
+//
+// for (const auto& record : SimpleStruct::CreateRange(ptr, len, {5, 8})) {
+//   Process(record.foo());
+// }
+//
+// Each record is a varstruct with a pointer into the buffer, and iteration
+// stops before the first record that would not fit in the rest of the buffer.
+// The offset() of an iterator is that of its record in the buffer; after the
+// last record, it is the number of bytes covered by records. Sizes of
+// VARSTRUCT_ARRAY_SIZED_BY() arrays are read from each record. Otherwise, all
+// records have the same layout, which is computed once. An optional fourth
+// argument gives the number of bytes past each record to prefetch.
+// MappedVarstructFile, in varstruct_mapped_file.h, provides such ranges over
+// a memory-mapped file, and varstruct_parallel_scan.h splits them into chunks
+// that are scanned on several threads.
+//
+// To check a batch of untrusted records up front, as a server would its
+// incoming traffic, ValidateVarstructs() in varstruct_validate.h reports which
+// of them the length-validated Create() would accept, comparing every length
+// against the fixed part of the layout in one vectorized loop first.
+//
+// Readers in other languages can be generated from the schema() of a
+// varstruct rather than written by hand: VarstructSchemaJson() in
+// varstruct_schema.h writes it as JSON, and the varstruct_schema_json() rule
+// of varstruct_schema.bzl does so at build time. The schema holds everything
+// needed to compute the offsets the way Create() does, but not the offsets
+// themselves, which depend on the array sizes.
+//
+// For records that arrive a chunk at a time, VarstructParser, in
+// varstruct_parser.h, computes the offsets as the bytes arrive, without
+// starting over for each chunk, and reports how many more bytes are needed.
+//
+// To write a whole varstruct at once, pass the value of every field to Build()
+// in declaration order:
+//
+// auto simple_struct = SimpleStruct::Build(my_ptr, my_len, 3, bar, baz);
+// if (!simple_struct) return kBufferTooSmall;
+//
+// Values of arrays may be any contiguous container of their element type (like
+// std::vector, std::string, or a bar_span()), and give the array sizes. The
+// layout is computed once and each field is then written with one
+// std::memcpy(), converting byte order as needed. Like the length-validated
+// Create(), Build() returns an optional-like object, which is empty (and
+// nothing is written) if the varstruct would not fit in my_len bytes, an
+// array exceeds its VARSTRUCT_MAX_COUNT(), or the value of the count field of
+// a VARSTRUCT_ARRAY_SIZED_BY() array, once stored in that field, is not the
+// size of the array.
+//
+// To send a varstruct without copying its large arrays into it, VarstructIovec,
+// in varstruct_iovec.h, builds it as a list of iovecs for writev() instead,
+// referring to the values of those arrays in place.
+//
+// To allocate the storage of a varstruct along with creating it, pass an arena
+// to AllocateAndCreate():
+//
+// VarstructArena arena;  // From varstruct_arena.h.
+// auto simple_struct = SimpleStruct::AllocateAndCreate(&arena, {5, 8});
+//
+// The returned varstruct has size_bytes() bytes of uninitialized memory from
+// the arena, which stays valid until the arena is reset or destroyed. The
+// count fields of VARSTRUCT_ARRAY_SIZED_BY() arrays must then be set to the
+// sizes passed in.
+//
+// Generic code, like hex dumpers or comparators, may enumerate the members of
+// any varstruct with ForEachField(). The visitor is called once for each
+// member with a description of it, whose type differs between members, so it
+// should have a templated call operator (or be a generic lambda, in C++14):
+//
+// struct Dumper {
+//   template <typename Field>
+//   void operator()(const Field& field) {
+//     Dump(field.name(), field.data, field.size);
+//   }
+// };
+// simple_struct.ForEachField(Dumper());
+//
+// Each description has:
+//
+// type -- The declared type of the member: the element type of an array, or
+//         the varstruct type of a VARSTRUCT_NESTED() member.
+// static name(), index(), is_array(), is_nested() -- Known at compile time.
+// offset, size -- The values of foo_offset() and foo_size().
+// data -- A void* or const void* to the member, if the varstruct has a
+//         pointer (and an empty NoPtr otherwise).
+//
+// The calls are expanded inline, so for CreateStatic() varstructs the visitor
+// sees constant offsets and sizes.
+//
+// Records may be hashed and compared as a whole, as to deduplicate them:
+//
+// std::uint64_t Hash(std::uint64_t seed = 0) -- Hashes the bytes of every
+//     member not excluded by VARSTRUCT_EXCLUDE_FROM_HASH().
+// bool Equals(other) -- Whether every member not excluded has the same size
+//     and bytes in other, a varstruct of the same type with any pointer or
+//     layout (so a bound view may be compared with any other).
+//
+// Both require a pointer. They do not call each accessor: the layout gives the
+// byte ranges of the members up front, and each run of adjacent members with
+// no padding between them (every run, unless the varstruct is defined by
+// DEFINE_VARSTRUCT_ALIGNED()) is hashed in one pass of a wyhash-style hash, or
+// compared by one std::memcmp(). Members of a nested varstruct are included
+// as a whole, padding included. Varstructs that are Equals() have the same
+// Hash(), but hashes may differ between hosts and versions of this library,
+// so they should not be stored.
+//
+// To read one scalar out of many records with the same layout into a
+// contiguous column, each VARSTRUCT_SCALAR() also generates:
+//
+// void foo_gather(const void* records, size_t count, int* out) -- Reads foo
+//     from each of count varstructs stored back to back at records into out.
+// void foo_gather(const void* records, size_t stride, size_t count, int* out)
+//     -- As above, for varstructs stored stride bytes apart.
+//
+// These only use the offsets, so they may be called on a varstruct created
+// without a pointer. With CreateStatic(), the offset and stride are constants,
+// which lets the compiler vectorize the loop.
+//
+// Building with VARSTRUCT_STATS defined counts, for each varstruct type, its
+// Create() calls and their sizes, the bytes accessed through each field,
+// VarstructLayoutCache hits and misses, and failed bounds checks, which
+// VarstructStatsSnapshot() in varstruct_stats.h reports. Without it, no
+// counting code is compiled in.
+//
 // As each Create() overload returns a different template instantiation of
 // SimpleStruct, you should use "auto" declarations with the Create()
 // method so that you don't have to reference Varstruct internals, which may
@@ -121,13 +351,30 @@
 // Consider DEFINE_VARSTRUCT(Foo) like writing "struct Foo"; it generates a new
 // type "Foo", and it must be followed by a body containing VARSTRUCT_SCALAR()
 // and VARSTRUCT_ARRAY() declarations. The final brace should be closed by a
-// semicolon. Do not place anything in the body other than VARSTRUCT_SCALAR()
-// and VARSTRUCT_ARRAY() declarations.
+// semicolon. Do not place anything in the body other than VARSTRUCT_*()
+// declarations.
 //
 // Varstructs may not be defined inside of classes or methods as they use
 // template definitions internally. They may be used inside namespaces, however.
 #define DEFINE_VARSTRUCT(name) DEFINE_VARSTRUCT_INTERNAL(name)
 
+// Opens a Varstruct definition whose fields are aligned, for formats that are
+// not bound by a wire protocol, such as records in shared memory.
+//
+// Like a C struct, each field of the resulting type begins at a multiple of the
+// alignment of its declared type, and size_bytes() is padded to a multiple of
+// the largest such alignment, which alignment() returns. Pointers passed to
+// Create() must be aligned to alignment(). In return, bar_span() needs no
+// assume_aligned argument, and the compiler may use aligned vector loads.
+//
+// DEFINE_VARSTRUCT_ALIGNED_TO() also aligns every field to at least
+// min_alignment, which must be a power of two; for example, 64 places each
+// field in its own cache line.
+#define DEFINE_VARSTRUCT_ALIGNED(name) \
+  DEFINE_VARSTRUCT_ALIGNED_INTERNAL(name, 1)
+#define DEFINE_VARSTRUCT_ALIGNED_TO(name, min_alignment) \
+  DEFINE_VARSTRUCT_ALIGNED_INTERNAL(name, min_alignment)
+
 // Declare a scalar field inside the Varstruct.
 //
 // Scalars are like typical struct members in that their size is determined by
@@ -144,4 +391,166 @@
 #define VARSTRUCT_ARRAY(decl_type, name) \
   VARSTRUCT_ARRAY_INTERNAL(decl_type, name)
 
+// Declare scalar and array fields stored in big-endian (network) or
+// little-endian byte order.
+//
+// These behave like VARSTRUCT_SCALAR() and VARSTRUCT_ARRAY(), but their
+// accessors convert values between the given byte order and the byte order of
+// the host, so foo() returns a host-order value and set_foo() stores a value in
+// the declared byte order. Whole-array copies made by bar_copy_to() and
+// set_bar_from() are converted in a loop that the compiler can vectorize.
+// bar_span() is unavailable for these arrays (unless their elements are single
+// bytes), as it exposes elements without conversion; use bar_bytes() for raw
+// access instead.
+//
+// decl_type must be an arithmetic or enum type of size 1, 2, 4 or 8.
+#define VARSTRUCT_SCALAR_BE(decl_type, name) \
+  VARSTRUCT_SCALAR_BE_INTERNAL(decl_type, name)
+#define VARSTRUCT_SCALAR_LE(decl_type, name) \
+  VARSTRUCT_SCALAR_LE_INTERNAL(decl_type, name)
+#define VARSTRUCT_ARRAY_BE(decl_type, name) \
+  VARSTRUCT_ARRAY_BE_INTERNAL(decl_type, name)
+#define VARSTRUCT_ARRAY_LE(decl_type, name) \
+  VARSTRUCT_ARRAY_LE_INTERNAL(decl_type, name)
+
+// Declare an array field in the Varstruct whose number of elements is stored in
+// the earlier VARSTRUCT_SCALAR() (or VARSTRUCT_SCALAR_BE() or
+// VARSTRUCT_SCALAR_LE()) named size_name, which must be of integral type, or
+// the earlier VARSTRUCT_BITS() named size_name:
+//
+// DEFINE_VARSTRUCT(Tlv) {
+//   VARSTRUCT_SCALAR(uint16_t, name_len);
+//   VARSTRUCT_ARRAY_SIZED_BY(char, name, name_len);
+// };
+//
+// When a pointer is passed to Create(), the size of the array is read from the
+// buffer while the offsets are computed, in the same forward pass, and no size
+// is passed for it in the brace list (so auto tlv = Tlv::Create(ptr) suffices
+// here). Without a pointer, or with CreateStatic(), its size is passed in the
+// brace list or template arguments like that of a VARSTRUCT_ARRAY().
+//
+// The size is read once, by Create(); later modifications of size_name do not
+// change the offsets of an existing Varstruct.
+#define VARSTRUCT_ARRAY_SIZED_BY(decl_type, name, size_name) \
+  VARSTRUCT_ARRAY_SIZED_BY_INTERNAL(decl_type, name, size_name)
+
+// Declare an array field that runs to the end of the buffer, such as the
+// payload of a frame. It must be the last member:
+//
+// DEFINE_VARSTRUCT(Frame) {
+//   VARSTRUCT_SCALAR(uint16_t, type);
+//   VARSTRUCT_TRAILING_ARRAY(char, payload);
+// };
+//
+// auto frame = Frame::Create(ptr, frame_len, {});
+//
+// When the length of the buffer is passed to Create(), the size of the array
+// is the number of whole elements between its offset and the end of the
+// buffer (less any padding a DEFINE_VARSTRUCT_ALIGNED() varstruct would need
+// at its end), computed in the same pass as the offsets, and no size is passed
+// for it. Otherwise, as for Create(ptr, {payload_len}), CreateStatic() and
+// CreateRange() (which only supports trailing arrays in records without
+// VARSTRUCT_ARRAY_SIZED_BY() arrays), its size is passed in like that of a
+// VARSTRUCT_ARRAY(). Nested varstructs cannot have a trailing array.
+#define VARSTRUCT_TRAILING_ARRAY(decl_type, name) \
+  VARSTRUCT_TRAILING_ARRAY_INTERNAL(decl_type, name)
+
+// Declare a field of width bits, packed with the fields declared right before
+// and after it into words of the unsigned integral type decl_type, as for the
+// flags and short lengths of protocol headers:
+//
+// DEFINE_VARSTRUCT(Ipv4Header) {
+//   VARSTRUCT_BITS(uint8_t, version, 4);
+//   VARSTRUCT_BITS(uint8_t, ihl, 4);
+//   VARSTRUCT_SCALAR_BE(uint16_t, total_length);
+//   VARSTRUCT_SCALAR_BE(uint16_t, id);
+//   VARSTRUCT_BITS_BE(uint16_t, flags, 3);
+//   VARSTRUCT_BITS_BE(uint16_t, fragment_offset, 13);
+// };
+//
+// Bits are assigned from the most significant bit of each word down. A field
+// starts a new word if the previous declaration is not a VARSTRUCT_BITS() of a
+// type of the same size, or if the field does not fit in the rest of its word;
+// bits of the word left over are unused. The word of each field is known at
+// compile time, so foo() is one load, shift and mask (and loads of fields in
+// the same word may be combined by the compiler), and set_foo(value), which
+// requires value to fit in width bits, updates the field in place. The _BE()
+// and _LE() variants store the words in that byte order, like
+// VARSTRUCT_SCALAR_BE() and VARSTRUCT_SCALAR_LE().
+//
+// foo_offset() and foo_size() are those of the word holding foo, and
+// foo_width() returns width. ForEachField() describes each field as its word,
+// Hash() and Equals() include or skip each word as a whole (so
+// VARSTRUCT_EXCLUDE_FROM_HASH() must name every field of a word or none), and
+// Build() zeroes unused bits. A VARSTRUCT_BITS() field may give the size of a
+// VARSTRUCT_ARRAY_SIZED_BY() array.
+#define VARSTRUCT_BITS(decl_type, name, width) \
+  VARSTRUCT_BITS_INTERNAL(decl_type, name, width)
+#define VARSTRUCT_BITS_BE(decl_type, name, width) \
+  VARSTRUCT_BITS_BE_INTERNAL(decl_type, name, width)
+#define VARSTRUCT_BITS_LE(decl_type, name, width) \
+  VARSTRUCT_BITS_LE_INTERNAL(decl_type, name, width)
+
+// Declare a field holding a varstruct of type nested_type (defined earlier with
+// DEFINE_VARSTRUCT()), or an array of them:
+//
+// DEFINE_VARSTRUCT(Envelope) {
+//   VARSTRUCT_SCALAR(uint32_t, id);
+//   VARSTRUCT_NESTED(SimpleStruct, header);
+//   VARSTRUCT_NESTED_ARRAY(SimpleStruct, entries);
+// };
+//
+// auto envelope = Envelope::Create(ptr, {5, 8, 3, 2, 1});
+//
+// The array sizes of the nested varstructs are passed to Create() in order
+// along with those of the outer one: here 5 and 8 for header, then the number
+// of entries (3), then 2 and 1 for the arrays of every entry. Sizes of
+// VARSTRUCT_ARRAY_SIZED_BY() arrays are read from the buffer for
+// VARSTRUCT_NESTED() fields, but all elements of a VARSTRUCT_NESTED_ARRAY()
+// have the same layout, so their sizes are passed in instead.
+//
+// One Create() computes the offsets of every nested field as well, in the same
+// pass, and stores them in the returned varstruct. The generated accessors
+// envelope.header() and envelope.entries(i) return views of the nested
+// varstructs that point into the same buffer and share those offsets, like
+// bind(), so envelope must outlive them. header_size() and entries_size() are
+// generated as usual.
+//
+// Varstructs with nested fields are not supported by CreateStatic() or
+// Build().
+#define VARSTRUCT_NESTED(nested_type, name) \
+  VARSTRUCT_NESTED_INTERNAL(nested_type, name)
+#define VARSTRUCT_NESTED_ARRAY(nested_type, name) \
+  VARSTRUCT_NESTED_ARRAY_INTERNAL(nested_type, name)
+
+// Exclude the earlier member name from Hash() and Equals(), as for sequence
+// numbers or timestamps that differ between otherwise identical records:
+//
+// DEFINE_VARSTRUCT(Record) {
+//   VARSTRUCT_SCALAR(uint64_t, timestamp);
+//   VARSTRUCT_EXCLUDE_FROM_HASH(timestamp);
+//   VARSTRUCT_ARRAY(char, key);
+// };
+#define VARSTRUCT_EXCLUDE_FROM_HASH(name) \
+  VARSTRUCT_EXCLUDE_FROM_HASH_INTERNAL(name)
+
+// Limit the earlier array member name to at most max_count elements, as for
+// the lengths of untrusted records:
+//
+// DEFINE_VARSTRUCT(Tlv) {
+//   VARSTRUCT_SCALAR(uint16_t, name_len);
+//   VARSTRUCT_ARRAY_SIZED_BY(char, name, name_len);
+//   VARSTRUCT_MAX_COUNT(name, 255);
+// };
+//
+// The length-validated Create() and ValidateVarstructs() reject records whose
+// array sizes exceed the limit, CreateRange() stops before them, and Build()
+// rejects longer values. CreateStatic() fails to compile with a larger size.
+// The Create() and CreateLazy() overloads without a buffer length have no way
+// to report failure, so they abort the program, even with NDEBUG, on a larger
+// size or on offsets that would overflow; use the length-validated Create(),
+// or VarstructLayoutCache::Lookup(), which returns null, for untrusted sizes.
+#define VARSTRUCT_MAX_COUNT(name, max_count) \
+  VARSTRUCT_MAX_COUNT_INTERNAL(name, max_count)
+
 #endif  // VARSTRUCT_VARSTRUCT_H_
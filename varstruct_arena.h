@@ -0,0 +1,129 @@
+// Copyright 2017 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// VarstructArena is a bump allocator for the storage of many varstructs.
+//
+// Memory is allocated from the heap in chunks of at least kChunkSize bytes, and
+// handed out by advancing a position in the current chunk. Nothing is freed
+// individually; instead, Reset() makes all of the memory available again at
+// once, without returning the chunks to the heap. This suits handlers that
+// build a batch of messages, send them, and then start over:
+//
+// VarstructArena arena;
+// for (const auto& batch : batches) {
+//   for (const auto& request : batch) {
+//     auto message = SimpleStruct::AllocateAndCreate(&arena, {5, 8});
+//     message.set_foo(request.foo());
+//     ...
+//   }
+//   Send(batch);
+//   arena.Reset();
+// }
+//
+// AllocateAndCreate() accepts any arena type with an Allocate() method like
+// that of VarstructArena, so this header is only needed to use this one.
+//
+// VarstructArena is not thread-safe.
+
+#ifndef VARSTRUCT_VARSTRUCT_ARENA_H_
+#define VARSTRUCT_VARSTRUCT_ARENA_H_
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class VarstructArena {
+ public:
+  // The minimum size of each chunk allocated from the heap -- a typical page.
+  static constexpr std::size_t kChunkSize = 4096;
+
+  VarstructArena() : current_(0), position_(0) {}
+
+  VarstructArena(const VarstructArena&) = delete;
+  VarstructArena& operator=(const VarstructArena&) = delete;
+
+  // Returns size bytes of uninitialized memory, aligned to alignment (which
+  // must be a power of two). The memory stays valid until Reset() is called or
+  // the arena is destroyed.
+  void* Allocate(std::size_t size, std::size_t alignment = 1) {
+    assert(alignment != 0 && (alignment & (alignment - 1)) == 0);
+    if (current_ < chunks_.size()) {
+      const std::size_t start = AlignedPosition(chunks_[current_], alignment);
+      if (start <= chunks_[current_].size &&
+          size <= chunks_[current_].size - start) {
+        position_ = start + size;
+        return chunks_[current_].data.get() + start;
+      }
+      // Move on to the next chunk, leaving the rest of this one unused.
+      current_++;
+    }
+    // A chunk kept by Reset() is reused if the allocation fits at its start,
+    // and a new chunk is inserted before it otherwise.
+    const std::size_t needed = size + alignment - 1;
+    if (current_ == chunks_.size() || chunks_[current_].size < needed) {
+      std::size_t chunk_size = kChunkSize;
+      if (needed > chunk_size) {
+        chunk_size = needed;
+      }
+      chunks_.insert(chunks_.begin() + current_,
+                     Chunk{std::unique_ptr<char[]>(new char[chunk_size]),
+                           chunk_size});
+    }
+    position_ = 0;
+    const std::size_t start = AlignedPosition(chunks_[current_], alignment);
+    position_ = start + size;
+    return chunks_[current_].data.get() + start;
+  }
+
+  // Makes all memory allocated from the arena available again. Pointers
+  // returned by Allocate() before the call must no longer be used. The chunks
+  // are kept for reuse rather than freed.
+  void Reset() {
+    current_ = 0;
+    position_ = 0;
+  }
+
+  // The total size of the chunks held by the arena, in bytes.
+  std::size_t capacity() const {
+    std::size_t capacity = 0;
+    for (const Chunk& chunk : chunks_) {
+      capacity += chunk.size;
+    }
+    return capacity;
+  }
+
+ private:
+  struct Chunk {
+    std::unique_ptr<char[]> data;
+    std::size_t size;
+  };
+
+  // The first position in chunk at or after position_ that is aligned to
+  // alignment.
+  std::size_t AlignedPosition(const Chunk& chunk, std::size_t alignment) const {
+    const std::uintptr_t address =
+        reinterpret_cast<std::uintptr_t>(chunk.data.get()) + position_;
+    return position_ + ((alignment - address % alignment) % alignment);
+  }
+
+  std::vector<Chunk> chunks_;
+  // The index in chunks_ of the chunk being allocated from, and the position
+  // of the first free byte in it.
+  std::size_t current_;
+  std::size_t position_;
+};
+
+#endif  // VARSTRUCT_VARSTRUCT_ARENA_H_
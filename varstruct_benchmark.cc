@@ -0,0 +1,559 @@
+// Copyright 2017 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmarks for Varstruct. Run with:
+//
+// bazel run -c opt :varstruct_benchmark
+//
+// Each accessor benchmark has a "Baseline" counterpart that performs the same
+// std::memcpy() at the same offsets by hand, which is the cost of a
+// hand-written packed struct.
+
+#include "varstruct.h"
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "varstruct_iovec.h"
+#include "varstruct_layout_cache.h"
+#include "varstruct_validate.h"
+
+namespace {
+
+DEFINE_VARSTRUCT(OneMember) { VARSTRUCT_ARRAY(char, a0); };
+
+DEFINE_VARSTRUCT(EightMembers) {
+  VARSTRUCT_SCALAR(uint32_t, s0);
+  VARSTRUCT_ARRAY(char, a0);
+  VARSTRUCT_SCALAR(uint16_t, s1);
+  VARSTRUCT_ARRAY(uint32_t, a1);
+  VARSTRUCT_SCALAR(uint64_t, s2);
+  VARSTRUCT_ARRAY(char, a2);
+  VARSTRUCT_SCALAR(uint8_t, s3);
+  VARSTRUCT_ARRAY(uint16_t, a3);
+};
+
+#define BENCHMARK_EIGHT_MEMBERS(suffix)   \
+  VARSTRUCT_SCALAR(uint32_t, s0##suffix); \
+  VARSTRUCT_ARRAY(char, a0##suffix);      \
+  VARSTRUCT_SCALAR(uint16_t, s1##suffix); \
+  VARSTRUCT_ARRAY(uint32_t, a1##suffix);  \
+  VARSTRUCT_SCALAR(uint64_t, s2##suffix); \
+  VARSTRUCT_ARRAY(char, a2##suffix);      \
+  VARSTRUCT_SCALAR(uint8_t, s3##suffix);  \
+  VARSTRUCT_ARRAY(uint16_t, a3##suffix)
+
+DEFINE_VARSTRUCT(ThirtyTwoMembers) {
+  BENCHMARK_EIGHT_MEMBERS(_0);
+  BENCHMARK_EIGHT_MEMBERS(_1);
+  BENCHMARK_EIGHT_MEMBERS(_2);
+  BENCHMARK_EIGHT_MEMBERS(_3);
+};
+
+// Large enough for every varstruct created below.
+constexpr std::size_t kBufferSize = 1 << 16;
+
+// The size of the payload array in the accessor benchmarks, like that of a
+// typical Ethernet frame.
+constexpr std::size_t kPayloadSize = 1500;
+
+DEFINE_VARSTRUCT(Packet) {
+  VARSTRUCT_SCALAR(uint16_t, type);
+  VARSTRUCT_SCALAR(uint32_t, sequence);
+  VARSTRUCT_ARRAY(char, payload);
+};
+
+// Packet, with a payload that runs to the end of the buffer.
+DEFINE_VARSTRUCT(TrailingPacket) {
+  VARSTRUCT_SCALAR(uint16_t, type);
+  VARSTRUCT_SCALAR(uint32_t, sequence);
+  VARSTRUCT_TRAILING_ARRAY(char, payload);
+};
+
+// A header with flags packed into a shared word.
+DEFINE_VARSTRUCT(FlagsHeader) {
+  VARSTRUCT_SCALAR(uint16_t, type);
+  VARSTRUCT_BITS(uint16_t, urgent, 1);
+  VARSTRUCT_BITS(uint16_t, ack, 1);
+  VARSTRUCT_BITS(uint16_t, window, 14);
+};
+
+// The offsets of Packet, computed by hand.
+constexpr std::size_t kSequenceOffset = sizeof(uint16_t);
+constexpr std::size_t kPayloadOffset = kSequenceOffset + sizeof(uint32_t);
+
+void BM_CreateOneMember(benchmark::State& state) {
+  std::vector<char> buf(kBufferSize);
+  for (auto _ : state) {
+    auto varstruct = OneMember::Create(buf.data(), {16});
+    benchmark::DoNotOptimize(varstruct);
+  }
+}
+BENCHMARK(BM_CreateOneMember);
+
+void BM_CreateEightMembers(benchmark::State& state) {
+  std::vector<char> buf(kBufferSize);
+  for (auto _ : state) {
+    auto varstruct = EightMembers::Create(buf.data(), {16, 4, 16, 8});
+    benchmark::DoNotOptimize(varstruct);
+  }
+}
+BENCHMARK(BM_CreateEightMembers);
+
+void BM_CreateThirtyTwoMembers(benchmark::State& state) {
+  std::vector<char> buf(kBufferSize);
+  for (auto _ : state) {
+    auto varstruct = ThirtyTwoMembers::Create(
+        buf.data(), {16, 4, 16, 8, 16, 4, 16, 8, 16, 4, 16, 8, 16, 4, 16, 8});
+    benchmark::DoNotOptimize(varstruct);
+  }
+}
+BENCHMARK(BM_CreateThirtyTwoMembers);
+
+void BM_CreateStaticThirtyTwoMembers(benchmark::State& state) {
+  std::vector<char> buf(kBufferSize);
+  for (auto _ : state) {
+    auto varstruct = ThirtyTwoMembers::CreateStatic<16, 4, 16, 8, 16, 4, 16, 8,
+                                                    16, 4, 16, 8, 16, 4, 16, 8>(
+        buf.data());
+    benchmark::DoNotOptimize(varstruct);
+  }
+}
+BENCHMARK(BM_CreateStaticThirtyTwoMembers);
+
+void BM_BindThirtyTwoMembers(benchmark::State& state) {
+  std::vector<char> buf(kBufferSize);
+  const auto layout = ThirtyTwoMembers::Create(
+      {16, 4, 16, 8, 16, 4, 16, 8, 16, 4, 16, 8, 16, 4, 16, 8});
+  for (auto _ : state) {
+    auto varstruct = layout.bind(buf.data());
+    benchmark::DoNotOptimize(varstruct);
+  }
+}
+BENCHMARK(BM_BindThirtyTwoMembers);
+
+void BM_CachedLayoutThirtyTwoMembers(benchmark::State& state) {
+  std::vector<char> buf(kBufferSize);
+  VarstructLayoutCache<ThirtyTwoMembers> cache;
+  for (auto _ : state) {
+    auto varstruct =
+        cache
+            .Lookup({16, 4, 16, 8, 16, 4, 16, 8, 16, 4, 16, 8, 16, 4, 16, 8})
+            ->bind(buf.data());
+    benchmark::DoNotOptimize(varstruct);
+  }
+}
+BENCHMARK(BM_CachedLayoutThirtyTwoMembers);
+
+// Reads a scalar near the start of a varstruct with many members, as when
+// routing on a header, computing every offset first.
+void BM_PrefixReadThirtyTwoMembers(benchmark::State& state) {
+  std::vector<char> buf(kBufferSize);
+  for (auto _ : state) {
+    auto varstruct = ThirtyTwoMembers::Create(
+        buf.data(), {16, 4, 16, 8, 16, 4, 16, 8, 16, 4, 16, 8, 16, 4, 16, 8});
+    benchmark::DoNotOptimize(varstruct.s1_0());
+  }
+}
+BENCHMARK(BM_PrefixReadThirtyTwoMembers);
+
+// As above, computing only the offsets up to the scalar read.
+void BM_PrefixReadThirtyTwoMembersLazy(benchmark::State& state) {
+  std::vector<char> buf(kBufferSize);
+  for (auto _ : state) {
+    auto varstruct = ThirtyTwoMembers::CreateLazy(
+        buf.data(), {16, 4, 16, 8, 16, 4, 16, 8, 16, 4, 16, 8, 16, 4, 16, 8});
+    benchmark::DoNotOptimize(varstruct.s1_0());
+  }
+}
+BENCHMARK(BM_PrefixReadThirtyTwoMembersLazy);
+
+void BM_CreateTrailingArray(benchmark::State& state) {
+  std::vector<char> buf(kBufferSize);
+  std::size_t len = kPayloadOffset + kPayloadSize;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(len);
+    auto packet = TrailingPacket::Create(buf.data(), len, {});
+    benchmark::DoNotOptimize(packet);
+  }
+}
+BENCHMARK(BM_CreateTrailingArray);
+
+// Computes the size of the payload from a layout with an empty payload first.
+void BM_CreateTrailingArrayBaseline(benchmark::State& state) {
+  std::vector<char> buf(kBufferSize);
+  std::size_t len = kPayloadOffset + kPayloadSize;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(len);
+    const std::size_t payload_offset = Packet::Create({0}).payload_offset();
+    auto packet = Packet::Create(buf.data(), len, {len - payload_offset});
+    benchmark::DoNotOptimize(packet);
+  }
+}
+BENCHMARK(BM_CreateTrailingArrayBaseline);
+
+void BM_ScalarRead(benchmark::State& state) {
+  std::vector<char> buf(kBufferSize);
+  auto packet = Packet::Create(buf.data(), {kPayloadSize});
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(packet);
+    benchmark::DoNotOptimize(packet.sequence());
+  }
+}
+BENCHMARK(BM_ScalarRead);
+
+void BM_HashPacket(benchmark::State& state) {
+  std::vector<char> buf(kBufferSize);
+  auto packet = Packet::Create(buf.data(), {kPayloadSize});
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(packet);
+    benchmark::DoNotOptimize(packet.Hash());
+  }
+  state.SetBytesProcessed(state.iterations() * packet.size_bytes());
+}
+BENCHMARK(BM_HashPacket);
+
+void BM_EqualsPacket(benchmark::State& state) {
+  std::vector<char> first_buf(kBufferSize);
+  std::vector<char> second_buf(kBufferSize);
+  const auto layout = Packet::Create({kPayloadSize});
+  auto first = layout.bind(first_buf.data());
+  auto second = layout.bind(second_buf.data());
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(first);
+    benchmark::DoNotOptimize(first.Equals(second));
+  }
+  state.SetBytesProcessed(state.iterations() * layout.size_bytes());
+}
+BENCHMARK(BM_EqualsPacket);
+
+void BM_ScalarReadBaseline(benchmark::State& state) {
+  std::vector<char> buf(kBufferSize);
+  char* ptr = buf.data();
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(ptr);
+    uint32_t sequence;
+    std::memcpy(&sequence, ptr + kSequenceOffset, sizeof(sequence));
+    benchmark::DoNotOptimize(sequence);
+  }
+}
+BENCHMARK(BM_ScalarReadBaseline);
+
+void BM_BitsRead(benchmark::State& state) {
+  std::vector<char> buf(kBufferSize);
+  auto header = FlagsHeader::CreateStatic(buf.data());
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(header);
+    benchmark::DoNotOptimize(header.urgent() + header.ack() + header.window());
+  }
+}
+BENCHMARK(BM_BitsRead);
+
+void BM_BitsReadBaseline(benchmark::State& state) {
+  std::vector<char> buf(kBufferSize);
+  char* ptr = buf.data();
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(ptr);
+    uint16_t word;
+    std::memcpy(&word, ptr + sizeof(uint16_t), sizeof(word));
+    benchmark::DoNotOptimize((word >> 15) + ((word >> 14) & 1) +
+                             (word & 0x3fff));
+  }
+}
+BENCHMARK(BM_BitsReadBaseline);
+
+void BM_ScalarWrite(benchmark::State& state) {
+  std::vector<char> buf(kBufferSize);
+  auto packet = Packet::Create(buf.data(), {kPayloadSize});
+  uint32_t sequence = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(packet);
+    packet.set_sequence(sequence++);
+    benchmark::ClobberMemory();
+  }
+}
+BENCHMARK(BM_ScalarWrite);
+
+void BM_ScalarWriteBaseline(benchmark::State& state) {
+  std::vector<char> buf(kBufferSize);
+  char* ptr = buf.data();
+  uint32_t sequence = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(ptr);
+    std::memcpy(ptr + kSequenceOffset, &sequence, sizeof(sequence));
+    sequence++;
+    benchmark::ClobberMemory();
+  }
+}
+BENCHMARK(BM_ScalarWriteBaseline);
+
+template <bool bounds_check>
+void BM_ArrayReadPerElement(benchmark::State& state) {
+  std::vector<char> buf(kBufferSize);
+  auto packet = Packet::Create(buf.data(), {kPayloadSize});
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(packet);
+    unsigned sum = 0;
+    for (std::size_t i = 0; i < kPayloadSize; i++) {
+      sum += packet.payload<bounds_check>(i);
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetBytesProcessed(state.iterations() * kPayloadSize);
+}
+BENCHMARK_TEMPLATE(BM_ArrayReadPerElement, true);
+BENCHMARK_TEMPLATE(BM_ArrayReadPerElement, false);
+
+void BM_ArrayReadPerElementBaseline(benchmark::State& state) {
+  std::vector<char> buf(kBufferSize);
+  char* ptr = buf.data();
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(ptr);
+    unsigned sum = 0;
+    for (std::size_t i = 0; i < kPayloadSize; i++) {
+      char element;
+      std::memcpy(&element, ptr + kPayloadOffset + i, sizeof(element));
+      sum += element;
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetBytesProcessed(state.iterations() * kPayloadSize);
+}
+BENCHMARK(BM_ArrayReadPerElementBaseline);
+
+template <bool bounds_check>
+void BM_ArrayCopyOut(benchmark::State& state) {
+  std::vector<char> buf(kBufferSize);
+  std::vector<char> out(kPayloadSize);
+  auto packet = Packet::Create(buf.data(), {kPayloadSize});
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(packet);
+    packet.payload_copy_to<bounds_check>(out.data(), 0, kPayloadSize);
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * kPayloadSize);
+}
+BENCHMARK_TEMPLATE(BM_ArrayCopyOut, true);
+BENCHMARK_TEMPLATE(BM_ArrayCopyOut, false);
+
+template <bool bounds_check>
+void BM_ArrayCopyOutPerElement(benchmark::State& state) {
+  std::vector<char> buf(kBufferSize);
+  std::vector<char> out(kPayloadSize);
+  auto packet = Packet::Create(buf.data(), {kPayloadSize});
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(packet);
+    for (std::size_t i = 0; i < kPayloadSize; i++) {
+      out[i] = packet.payload<bounds_check>(i);
+    }
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * kPayloadSize);
+}
+BENCHMARK_TEMPLATE(BM_ArrayCopyOutPerElement, true);
+BENCHMARK_TEMPLATE(BM_ArrayCopyOutPerElement, false);
+
+void BM_ArrayCopyOutBaseline(benchmark::State& state) {
+  std::vector<char> buf(kBufferSize);
+  std::vector<char> out(kPayloadSize);
+  char* ptr = buf.data();
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(ptr);
+    std::memcpy(out.data(), ptr + kPayloadOffset, kPayloadSize);
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * kPayloadSize);
+}
+BENCHMARK(BM_ArrayCopyOutBaseline);
+
+template <bool bounds_check>
+void BM_ArrayWritePerElement(benchmark::State& state) {
+  std::vector<char> buf(kBufferSize);
+  auto packet = Packet::Create(buf.data(), {kPayloadSize});
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(packet);
+    for (std::size_t i = 0; i < kPayloadSize; i++) {
+      packet.set_payload<bounds_check>(i, static_cast<char>(i));
+    }
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * kPayloadSize);
+}
+BENCHMARK_TEMPLATE(BM_ArrayWritePerElement, true);
+BENCHMARK_TEMPLATE(BM_ArrayWritePerElement, false);
+
+template <bool bounds_check>
+void BM_ArrayCopyIn(benchmark::State& state) {
+  std::vector<char> buf(kBufferSize);
+  std::vector<char> in(kPayloadSize);
+  auto packet = Packet::Create(buf.data(), {kPayloadSize});
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(packet);
+    packet.set_payload_from<bounds_check>(in.data(), 0, kPayloadSize);
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * kPayloadSize);
+}
+BENCHMARK_TEMPLATE(BM_ArrayCopyIn, true);
+BENCHMARK_TEMPLATE(BM_ArrayCopyIn, false);
+
+void BM_ArrayCopyInBaseline(benchmark::State& state) {
+  std::vector<char> buf(kBufferSize);
+  std::vector<char> in(kPayloadSize);
+  char* ptr = buf.data();
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(ptr);
+    std::memcpy(ptr + kPayloadOffset, in.data(), kPayloadSize);
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * kPayloadSize);
+}
+BENCHMARK(BM_ArrayCopyInBaseline);
+
+void BM_EncodeWithSetters(benchmark::State& state) {
+  std::vector<char> buf(kBufferSize);
+  const std::vector<char> payload(kPayloadSize);
+  for (auto _ : state) {
+    const std::size_t size_bytes = Packet::Create({kPayloadSize}).size_bytes();
+    benchmark::DoNotOptimize(size_bytes);
+    auto packet = Packet::Create(buf.data(), {kPayloadSize});
+    packet.set_type(1);
+    packet.set_sequence(2);
+    packet.set_payload_from(payload.data(), 0, kPayloadSize);
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * kPayloadSize);
+}
+BENCHMARK(BM_EncodeWithSetters);
+
+void BM_EncodeWithBuild(benchmark::State& state) {
+  std::vector<char> buf(kBufferSize);
+  const std::vector<char> payload(kPayloadSize);
+  for (auto _ : state) {
+    auto packet = Packet::Build(buf.data(), buf.size(), 1, 2, payload);
+    benchmark::DoNotOptimize(packet);
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * kPayloadSize);
+}
+BENCHMARK(BM_EncodeWithBuild);
+
+void BM_EncodeWithIovec(benchmark::State& state) {
+  const std::vector<char> payload(kPayloadSize);
+  VarstructIovec<Packet> packet;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(packet.Build(1, 2, payload));
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * kPayloadSize);
+}
+BENCHMARK(BM_EncodeWithIovec);
+
+// Column extraction of Packet::sequence from records with a 16-byte payload.
+constexpr std::size_t kSmallPayloadSize = 16;
+constexpr std::size_t kNumRecords = 1024;
+
+void BM_GatherPerRecord(benchmark::State& state) {
+  std::vector<char> buf(kBufferSize);
+  std::vector<uint32_t> out(kNumRecords);
+  const auto layout = Packet::Create({kSmallPayloadSize});
+  for (auto _ : state) {
+    for (std::size_t i = 0; i < kNumRecords; i++) {
+      out[i] = layout.bind(&buf[i * layout.size_bytes()]).sequence();
+    }
+    benchmark::DoNotOptimize(out.data());
+  }
+  state.SetItemsProcessed(state.iterations() * kNumRecords);
+}
+BENCHMARK(BM_GatherPerRecord);
+
+void BM_Gather(benchmark::State& state) {
+  std::vector<char> buf(kBufferSize);
+  std::vector<uint32_t> out(kNumRecords);
+  const auto layout = Packet::Create({kSmallPayloadSize});
+  for (auto _ : state) {
+    layout.sequence_gather(buf.data(), kNumRecords, out.data());
+    benchmark::DoNotOptimize(out.data());
+  }
+  state.SetItemsProcessed(state.iterations() * kNumRecords);
+}
+BENCHMARK(BM_Gather);
+
+void BM_GatherStatic(benchmark::State& state) {
+  std::vector<char> buf(kBufferSize);
+  std::vector<uint32_t> out(kNumRecords);
+  constexpr auto layout = Packet::CreateStatic<kSmallPayloadSize>();
+  for (auto _ : state) {
+    layout.sequence_gather(buf.data(), kNumRecords, out.data());
+    benchmark::DoNotOptimize(out.data());
+  }
+  state.SetItemsProcessed(state.iterations() * kNumRecords);
+}
+BENCHMARK(BM_GatherStatic);
+
+// Validation of a batch of untrusted records with a header of fixed size and a
+// payload of 16 bytes, one Create() at a time and with ValidateVarstructs().
+DEFINE_VARSTRUCT(IngressRecord) {
+  VARSTRUCT_SCALAR(uint16_t, type);
+  VARSTRUCT_SCALAR(uint16_t, payload_len);
+  VARSTRUCT_ARRAY_SIZED_BY(char, payload, payload_len);
+  VARSTRUCT_MAX_COUNT(payload, 1024);
+};
+
+constexpr std::size_t kIngressRecordSize = 4 + kSmallPayloadSize;
+
+struct IngressBatch {
+  IngressBatch() : buf(kNumRecords * kIngressRecordSize) {
+    for (std::size_t i = 0; i < kNumRecords; i++) {
+      IngressRecord::Create(&buf[i * kIngressRecordSize], {})
+          .set_payload_len(kSmallPayloadSize);
+      records.push_back(&buf[i * kIngressRecordSize]);
+      lens.push_back(kIngressRecordSize);
+    }
+  }
+  std::vector<char> buf;
+  std::vector<const void*> records;
+  std::vector<std::size_t> lens;
+};
+
+void BM_ValidatePerRecord(benchmark::State& state) {
+  const IngressBatch batch;
+  bool valid[kNumRecords];
+  for (auto _ : state) {
+    for (std::size_t i = 0; i < kNumRecords; i++) {
+      valid[i] = static_cast<bool>(
+          IngressRecord::Create(batch.records[i], batch.lens[i], {}));
+    }
+    benchmark::DoNotOptimize(valid);
+  }
+  state.SetItemsProcessed(state.iterations() * kNumRecords);
+}
+BENCHMARK(BM_ValidatePerRecord);
+
+void BM_ValidateBatch(benchmark::State& state) {
+  const IngressBatch batch;
+  bool valid[kNumRecords];
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(ValidateVarstructs<IngressRecord>(
+        batch.records.data(), batch.lens.data(), kNumRecords, {}, valid));
+  }
+  state.SetItemsProcessed(state.iterations() * kNumRecords);
+}
+BENCHMARK(BM_ValidateBatch);
+
+}  // namespace
+
+BENCHMARK_MAIN();
@@ -15,115 +15,2083 @@
 #ifndef VARSTRUCT_VARSTRUCT_INTERNAL_H_
 #define VARSTRUCT_VARSTRUCT_INTERNAL_H_
 
+#include <algorithm>
+#include <array>
 #include <cassert>
 #include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
-#include <deque>
+#include <initializer_list>
+#include <iterator>
+#include <limits>
 #include <type_traits>
-#include <vector>
+#include <utility>
+
+#if defined(VARSTRUCT_STATS)
+#include "varstruct_stats.h"
+#endif
+
+// Expands to its arguments only if VARSTRUCT_STATS is defined, to update the
+// usage counters of varstruct_stats.h from the accessors generated by the
+// VARSTRUCT_*() macros.
+#if defined(VARSTRUCT_STATS)
+#define VARSTRUCT_STATS_HOOK(...) __VA_ARGS__
+#else
+#define VARSTRUCT_STATS_HOOK(...)
+#endif
 
 namespace varstruct_internal {
 
-// Forward declaration needed for VarstructInternal to friend VarstructMember.
-class VarstructMember;
+// The maximum number of VARSTRUCT_SCALAR() plus VARSTRUCT_ARRAY() declarations
+// in a single varstruct. This bounds the depth of the Rank<> hierarchy used to
+// assign field indices at compile time.
+constexpr std::size_t kMaxMembers = 256;
+
+// A compile-time index, used to tag the per-field static functions generated by
+// the VARSTRUCT_*() macros so that they may be looked up by field index.
+template <std::size_t N>
+struct Index {
+  static constexpr std::size_t value = N;
+};
+
+// Rank<N> derives from Rank<N - 1>, so that overload resolution for an argument
+// of type Rank<kMaxMembers> prefers the overload taking the highest Rank.
+//
+// Each VARSTRUCT_*() declaration reads the current field count by calling
+// __varstruct_counter__(Rank<kMaxMembers>()) in an unevaluated context, then
+// declares a new __varstruct_counter__() overload taking the next Rank. Within
+// a class definition, a declaration only sees the overloads declared before it,
+// so this assigns each field its unique ascending index at compile time.
+template <std::size_t N>
+struct Rank : Rank<N - 1> {};
+
+template <>
+struct Rank<0> {};
+
+// The position of the last VARSTRUCT_BITS() field declared so far in a
+// varstruct: its index, the size of its storage word, and the number of bits
+// of the word used up to and including it. FieldCounter declares a position
+// with kSize 0 for varstructs with none.
+template <std::size_t I, std::size_t Size, std::size_t End>
+struct BitPosition {
+  enum : std::size_t { kIndex = I, kSize = Size, kEnd = End };
+};
+
+// Forward declaration needed for FieldCounter to friend FieldAccess.
+struct FieldAccess;
+
+// The Alignment of varstructs whose fields are packed, without padding.
+constexpr std::size_t kPacked = 0;
+
+// Every varstruct derives from FieldCounter, which provides the initial
+// __varstruct_counter__() overload (no fields declared yet). FieldCounter is a
+// non-dependent base so that unqualified lookup inside the varstruct class
+// template finds it.
+//
+// Alignment is kPacked for varstructs defined by DEFINE_VARSTRUCT(). For those
+// defined by DEFINE_VARSTRUCT_ALIGNED(), it is the minimum alignment of each
+// field, and each field is aligned to the larger of that and the alignment of
+// its declared type. NameTag::value() returns the name of the varstruct.
+template <std::size_t Alignment, typename NameTag>
+class FieldCounter {
+  static_assert((Alignment & (Alignment - 1)) == 0,
+                "Alignment must be a power of two");
+
+ protected:
+  static constexpr std::size_t __varstruct_alignment__ = Alignment;
+
+  static constexpr const char* __varstruct_class_name__() {
+    return NameTag::value();
+  }
+
+  static Index<0> __varstruct_counter__(Rank<0>);
+
+  // The number of offsets stored before the first field. Each VARSTRUCT_*()
+  // declaration declares the overload taking the index of the next field,
+  // which returns the number of offsets stored up to and including its own.
+  static Index<0> __varstruct_slots__(Index<0>);
+
+  // The position of the last VARSTRUCT_BITS() field (see BitPosition). Each
+  // VARSTRUCT_BITS() declaration declares the overload taking Rank<index + 1>.
+  static BitPosition<0, 0, 0> __varstruct_bits__(Rank<0>);
+
+  // Never called. Only found for varstructs without fields, which still name
+  // it in the (empty) parameter pack of Varstruct::BuildInternal().
+  static FieldCounter __varstruct_value__(...);
+
+  friend struct FieldAccess;
+};
+
+#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && \
+    __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+constexpr bool kHostIsBigEndian = true;
+#else
+constexpr bool kHostIsBigEndian = false;
+#endif
+
+// Byte orders of varstruct fields. Fields declared by VARSTRUCT_SCALAR() and
+// VARSTRUCT_ARRAY() are in the byte order of the host, and are copied as-is;
+// fields declared by the _BE() and _LE() variants are converted between their
+// byte order and that of the host by their accessors. kSwap is true if that
+// conversion reverses bytes.
+struct NativeByteOrder {
+  static constexpr bool kSwap = false;
+};
+
+struct BigEndianByteOrder {
+  static constexpr bool kSwap = !kHostIsBigEndian;
+};
+
+struct LittleEndianByteOrder {
+  static constexpr bool kSwap = kHostIsBigEndian;
+};
+
+// True for types whose bytes may be reversed by SwapBytes().
+template <typename T>
+struct IsByteSwappable {
+  static constexpr bool value =
+      (std::is_arithmetic<T>::value || std::is_enum<T>::value) &&
+      (sizeof(T) == 1 || sizeof(T) == 2 || sizeof(T) == 4 || sizeof(T) == 8);
+};
+
+// Reverses the bytes of an unsigned integer. With GCC and Clang, these compile
+// to a single bswap instruction (or movbe, when fused with a load or store).
+inline std::uint8_t ByteSwap(std::uint8_t value) { return value; }
+
+#if defined(__GNUC__)
+inline std::uint16_t ByteSwap(std::uint16_t value) {
+  return __builtin_bswap16(value);
+}
+inline std::uint32_t ByteSwap(std::uint32_t value) {
+  return __builtin_bswap32(value);
+}
+inline std::uint64_t ByteSwap(std::uint64_t value) {
+  return __builtin_bswap64(value);
+}
+#else
+inline std::uint16_t ByteSwap(std::uint16_t value) {
+  return static_cast<std::uint16_t>((value >> 8) | (value << 8));
+}
+inline std::uint32_t ByteSwap(std::uint32_t value) {
+  return (value >> 24) | ((value >> 8) & 0xff00) | ((value << 8) & 0xff0000) |
+         (value << 24);
+}
+inline std::uint64_t ByteSwap(std::uint64_t value) {
+  return (static_cast<std::uint64_t>(
+              ByteSwap(static_cast<std::uint32_t>(value)))
+          << 32) |
+         ByteSwap(static_cast<std::uint32_t>(value >> 32));
+}
+#endif
+
+// Metafunction to get the unsigned integer type with the given size.
+template <std::size_t Size>
+struct UintOfSize;
+
+template <>
+struct UintOfSize<1> {
+  using type = std::uint8_t;
+};
+
+template <>
+struct UintOfSize<2> {
+  using type = std::uint16_t;
+};
+
+template <>
+struct UintOfSize<4> {
+  using type = std::uint32_t;
+};
+
+template <>
+struct UintOfSize<8> {
+  using type = std::uint64_t;
+};
+
+// Reverses the bytes of any byte-swappable T (including floating point types
+// and enums).
+template <typename T>
+T SwapBytes(T value) {
+  static_assert(IsByteSwappable<T>::value, "Type cannot be byte-swapped");
+  typename UintOfSize<sizeof(T)>::type bits;
+  std::memcpy(&bits, &value, sizeof(value));
+  bits = ByteSwap(bits);
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+// Converts value between ByteOrder and the byte order of the host (the
+// conversion is the same in both directions). We dispatch on kSwap so that
+// SwapBytes() need not compile for types of fields in NativeByteOrder.
+template <typename T>
+T ConvertByteOrder(T value, std::false_type /* swap */) {
+  return value;
+}
+
+template <typename T>
+T ConvertByteOrder(T value, std::true_type /* swap */) {
+  return SwapBytes(value);
+}
+
+template <typename ByteOrder, typename T>
+T ConvertByteOrder(T value) {
+  return ConvertByteOrder(
+      value, std::integral_constant<bool, ByteOrder::kSwap>());
+}
+
+// Reads a T in ByteOrder from src, which need not be aligned.
+template <typename ByteOrder, typename T>
+T LoadField(const void* src) {
+  T value;
+  std::memcpy(&value, src, sizeof(value));
+  return ConvertByteOrder<ByteOrder>(value);
+}
+
+// Writes a T in ByteOrder to dst, which need not be aligned.
+template <typename ByteOrder, typename T>
+void StoreField(void* dst, T value) {
+  value = ConvertByteOrder<ByteOrder>(value);
+  std::memcpy(dst, &value, sizeof(value));
+}
+
+// Reads count elements of type T in ByteOrder from src into dst. When bytes
+// must be swapped, the elements are copied with one std::memcpy() and then
+// swapped in place in a simple loop that compilers vectorize (for example,
+// with pshufb on x86 or rev on ARM).
+template <typename T>
+void LoadArray(T* dst, const void* src, std::size_t count,
+               std::false_type /* swap */) {
+  std::memcpy(dst, src, count * sizeof(T));
+}
+
+template <typename T>
+void LoadArray(T* dst, const void* src, std::size_t count,
+               std::true_type /* swap */) {
+  std::memcpy(dst, src, count * sizeof(T));
+  for (std::size_t i = 0; i < count; i++) {
+    dst[i] = SwapBytes(dst[i]);
+  }
+}
+
+template <typename ByteOrder, typename T>
+void LoadArray(T* dst, const void* src, std::size_t count) {
+  // The pointers of empty arrays may be null, which std::memcpy() does not
+  // allow.
+  if (count != 0) {
+    LoadArray(dst, src, count,
+              std::integral_constant<bool, ByteOrder::kSwap>());
+  }
+}
+
+// Writes count elements of type T from src into dst in ByteOrder.
+template <typename T>
+void StoreArray(void* dst, const T* src, std::size_t count,
+                std::false_type /* swap */) {
+  std::memcpy(dst, src, count * sizeof(T));
+}
+
+template <typename T>
+void StoreArray(void* dst, const T* src, std::size_t count,
+                std::true_type /* swap */) {
+  char* bytes = static_cast<char*>(dst);
+  for (std::size_t i = 0; i < count; i++) {
+    const T value = SwapBytes(src[i]);
+    std::memcpy(bytes + i * sizeof(T), &value, sizeof(T));
+  }
+}
+
+template <typename ByteOrder, typename T>
+void StoreArray(void* dst, const T* src, std::size_t count) {
+  // The pointers of empty arrays may be null, which std::memcpy() does not
+  // allow.
+  if (count != 0) {
+    StoreArray(dst, src, count,
+               std::integral_constant<bool, ByteOrder::kSwap>());
+  }
+}
+
+// Rounds offset up to a multiple of alignment, which must be a power of two.
+constexpr std::size_t AlignUp(std::size_t offset, std::size_t alignment) {
+  return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+// The alignment of a field whose declared type has the alignment
+// type_alignment, in a varstruct with the given Alignment (see FieldCounter).
+constexpr std::size_t FieldAlignment(std::size_t alignment,
+                                     std::size_t type_alignment) {
+  return (alignment == kPacked)
+             ? 1
+             : (type_alignment > alignment ? type_alignment : alignment);
+}
+
+// Reads count values of type T in ByteOrder, stride bytes apart starting at
+// src, into the contiguous array dst. When stride is a constant expression (as
+// for varstructs returned by CreateStatic()), compilers may turn this loop into
+// strided vector loads or gathers.
+template <typename ByteOrder, typename T>
+void GatherField(const char* src, std::size_t stride, std::size_t count,
+                 T* dst) {
+  for (std::size_t i = 0; i < count; i++) {
+    dst[i] = LoadField<ByteOrder, T>(src + i * stride);
+  }
+}
+
+// Reads an integral scalar of type T in ByteOrder from ptr and returns it as an
+// array element count. Used for arrays declared by VARSTRUCT_ARRAY_SIZED_BY().
+template <typename T, typename ByteOrder>
+std::size_t ReadCount(const char* ptr) {
+  static_assert(std::is_integral<T>::value,
+                "Array sizes must be read from integral scalars");
+  return LoadField<ByteOrder, T>(ptr);
+}
+
+// True if a VARSTRUCT_BITS() field of type T and the given width, with the
+// given index, fits in the storage word of the previous field, at position
+// Prev. Bits fields are only packed together when declared one after another
+// with the same type size.
+template <typename Prev, typename T>
+constexpr bool SharesBits(std::size_t index, std::size_t width) {
+  return Prev::kSize == sizeof(T) && Prev::kIndex + 1 == index &&
+         Prev::kEnd + width <= 8 * sizeof(T);
+}
+
+// The lowest width bits of a T set.
+template <typename T>
+constexpr T BitMask(std::size_t width) {
+  return static_cast<T>(static_cast<T>(~T{0}) >> (8 * sizeof(T) - width));
+}
+
+// Reads the width bits at shift (counted from the least significant bit) of
+// the word of type T in ByteOrder at src. Adjacent reads of the same word
+// compile to one load.
+template <typename ByteOrder, typename T>
+T LoadBits(const void* src, std::size_t shift, std::size_t width) {
+  return static_cast<T>(LoadField<ByteOrder, T>(src) >> shift) &
+         BitMask<T>(width);
+}
+
+// Writes value to the width bits at shift of the word at src, leaving its other
+// bits as they were. A value wider than the field is truncated to its width
+// when asserts are disabled.
+template <typename ByteOrder, typename T>
+void StoreBits(void* dst, T value, std::size_t shift, std::size_t width) {
+  assert(value <= BitMask<T>(width));
+  const T mask = static_cast<T>(BitMask<T>(width) << shift);
+  const T word = LoadField<ByteOrder, T>(dst);
+  StoreField<ByteOrder>(dst, static_cast<T>((word & ~mask) |
+                                            ((value << shift) & mask)));
+}
+
+// Reads a VARSTRUCT_BITS() field from ptr, the start of its storage word, as
+// an array element count.
+template <typename T, typename ByteOrder, std::size_t kShift,
+          std::size_t kWidth>
+std::size_t ReadBitsCount(const char* ptr) {
+  return LoadBits<ByteOrder, T>(ptr, kShift, kWidth);
+}
+
+// Multiplies a by b as 128-bit integers and folds the product to 64 bits by
+// xoring its halves, the mixing step of wyhash.
+inline std::uint64_t HashMix(std::uint64_t a, std::uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+  const unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+  return static_cast<std::uint64_t>(product) ^
+         static_cast<std::uint64_t>(product >> 64);
+#else
+  const std::uint64_t a_lo = a & 0xffffffff, a_hi = a >> 32;
+  const std::uint64_t b_lo = b & 0xffffffff, b_hi = b >> 32;
+  const std::uint64_t lo_lo = a_lo * b_lo, hi_lo = a_hi * b_lo;
+  const std::uint64_t lo_hi = a_lo * b_hi, hi_hi = a_hi * b_hi;
+  const std::uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xffffffff) + lo_hi;
+  const std::uint64_t lo = (cross << 32) | (lo_lo & 0xffffffff);
+  const std::uint64_t hi = hi_hi + (hi_lo >> 32) + (cross >> 32);
+  return lo ^ hi;
+#endif
+}
+
+inline std::uint64_t HashLoad64(const char* ptr) {
+  std::uint64_t value;
+  std::memcpy(&value, ptr, sizeof(value));
+  return value;
+}
+
+inline std::uint64_t HashLoad32(const char* ptr) {
+  std::uint32_t value;
+  std::memcpy(&value, ptr, sizeof(value));
+  return value;
+}
+
+// Hashes the len bytes at data, continuing from the hash seed of the bytes
+// before them. This is a variant of wyhash, which mixes 16 bytes per
+// multiplication. Loads are in host byte order, so hashes differ between hosts
+// of different byte order.
+inline std::uint64_t HashBytes(const char* data, std::size_t len,
+                               std::uint64_t seed) {
+  constexpr std::uint64_t kSecret0 = 0xa0761d6478bd642full;
+  constexpr std::uint64_t kSecret1 = 0xe7037ed1a0b428dbull;
+  constexpr std::uint64_t kSecret2 = 0x8ebc6af09c88c6e3ull;
+  seed ^= kSecret0;
+  const std::uint64_t total_len = len;
+  for (; len > 16; data += 16, len -= 16) {
+    seed = HashMix(HashLoad64(data) ^ kSecret1, HashLoad64(data + 8) ^ seed);
+  }
+  // The last 1 to 16 bytes, read as two (possibly overlapping) words.
+  std::uint64_t a = 0;
+  std::uint64_t b = 0;
+  if (len >= 8) {
+    a = HashLoad64(data);
+    b = HashLoad64(data + len - 8);
+  } else if (len >= 4) {
+    a = HashLoad32(data);
+    b = HashLoad32(data + len - 4);
+  } else if (len > 0) {
+    a = (static_cast<std::uint64_t>(static_cast<unsigned char>(data[0]))
+         << 16) |
+        (static_cast<std::uint64_t>(static_cast<unsigned char>(data[len / 2]))
+         << 8) |
+        static_cast<unsigned char>(data[len - 1]);
+  }
+  return HashMix(kSecret1 ^ total_len,
+                 HashMix(a ^ kSecret1, b ^ seed ^ kSecret2));
+}
+
+// Forward declaration needed for FieldSpec::compute_nested.
+class ArraySizes;
+
+// The FieldAccess::MaxCount() of arrays without a VARSTRUCT_MAX_COUNT().
+constexpr std::size_t kNoMaxCount = std::numeric_limits<std::size_t>::max();
+
+// The largest offset computed for a field. Keeping offsets below half the
+// address space means that aligning them up never overflows, so only the
+// sizes of arrays need to be checked.
+constexpr std::size_t kMaxOffset = std::numeric_limits<std::size_t>::max() / 2;
+
+// The compile-time description of a single varstruct field.
+//
+// The layout of a varstruct stores one offset, or "slot", for each field: the
+// offset immediately after the field. A VARSTRUCT_NESTED() field also stores
+// the offsets of the fields of its nested varstruct, relative to the start of
+// the nested varstruct, in the slots before its own.
+struct FieldSpec {
+  // sizeof() the declared type of the field (the element type, for arrays).
+  std::size_t elem_size;
+
+  // True if the field is a VARSTRUCT_ARRAY() or VARSTRUCT_ARRAY_SIZED_BY(),
+  // false for a VARSTRUCT_SCALAR().
+  bool is_array;
+
+  // For VARSTRUCT_ARRAY_SIZED_BY() fields, the index of the earlier scalar
+  // holding the element count and a function that reads it. Otherwise,
+  // read_count is null.
+  std::size_t count_field;
+  std::size_t (*read_count)(const char*);
+
+  // The alignment of the offset of the field. This is 1 unless the varstruct
+  // was defined by DEFINE_VARSTRUCT_ALIGNED().
+  std::size_t alignment;
+
+  // The number of slots used by the field, and the index of the last one,
+  // which holds the offset immediately after the field.
+  std::size_t num_slots;
+  std::size_t end_slot;
+
+  // For VARSTRUCT_NESTED() fields, a function that computes the offsets of
+  // the nested varstruct like ComputeFieldOffsets(), then stores its size
+  // (elem_size is unused). Otherwise, null.
+  bool (*compute_nested)(const char* base, std::size_t buffer_len,
+                         ArraySizes* array_sizes, std::size_t* offsets,
+                         std::size_t* size, std::size_t* needed_len);
+
+  // True if computing the offsets of the field reads array sizes from the
+  // buffer: for VARSTRUCT_ARRAY_SIZED_BY() fields, and VARSTRUCT_NESTED()
+  // fields of varstructs that have any.
+  bool reads_sizes;
+
+  // The number of bytes at the start of the field that it shares with the
+  // end of the previous field: the size of the storage word for a
+  // VARSTRUCT_BITS() field packed into the same word as the previous one, and
+  // 0 otherwise.
+  std::size_t overlap;
+
+  // True for a VARSTRUCT_TRAILING_ARRAY() field, whose size is inferred from
+  // the length of the buffer when it is known.
+  bool trailing;
+};
+
+constexpr FieldSpec ScalarSpec(std::size_t elem_size) {
+  return FieldSpec{elem_size, false, 0,     nullptr, 1,
+                   1,         0,     nullptr, false, 0, false};
+}
+
+constexpr FieldSpec ArraySpec(std::size_t elem_size) {
+  return FieldSpec{elem_size, true, 0,       nullptr, 1,
+                   1,         0,    nullptr, false,   0, false};
+}
+
+constexpr FieldSpec TrailingArraySpec(std::size_t elem_size) {
+  return FieldSpec{elem_size, true, 0,       nullptr, 1,
+                   1,         0,    nullptr, false,   0, true};
+}
+
+// How the values of a field are stored, for its FieldSchema: whether they are
+// big endian and, for VARSTRUCT_BITS() fields, the bits of the word they
+// occupy. bit_width is 0 for other fields.
+struct FieldEncoding {
+  bool big_endian;
+  std::size_t bit_shift;
+  std::size_t bit_width;
+};
+
+template <typename ByteOrder>
+constexpr FieldEncoding ByteOrderEncoding() {
+  return FieldEncoding{ByteOrder::kSwap != kHostIsBigEndian, 0, 0};
+}
+
+constexpr FieldSpec SizedArraySpec(std::size_t elem_size,
+                                   std::size_t count_field,
+                                   std::size_t (*read_count)(const char*)) {
+  return FieldSpec{elem_size, true,    count_field, read_count, 1,
+                   1,         0,       nullptr,     true,       0,
+                   false};
+}
+
+// Returns spec with the given alignment, end_slot and overlap, as only known to
+// the varstruct that declares the field.
+constexpr FieldSpec PlacedSpec(FieldSpec spec, std::size_t alignment,
+                               std::size_t end_slot, std::size_t overlap) {
+  return FieldSpec{spec.elem_size,  spec.is_array,       spec.count_field,
+                   spec.read_count, alignment,           spec.num_slots,
+                   end_slot,        spec.compute_nested, spec.reads_sizes,
+                   overlap,         spec.trailing};
+}
+
+// The offset of field in a varstruct with the given layout storage, as
+// returned by its foo_offset() method.
+template <typename Layout>
+constexpr std::size_t FieldOffset(const FieldSpec& field,
+                                  const Layout& layout) {
+  return AlignUp(layout.begin(field.end_slot + 1 - field.num_slots),
+                 field.alignment) -
+         field.overlap;
+}
+
+// Forward declaration needed for FieldAccess::Bytes().
+template <typename T>
+class ArrayValue;
+
+// Grants the internal templates below access to the private static members
+// generated by the VARSTRUCT_*() macros. Each VARSTRUCT_*() declaration
+// befriends this class.
+struct FieldAccess {
+  // The number of VARSTRUCT_*() declarations in Fields.
+  template <typename Fields>
+  static constexpr std::size_t NumFields() {
+    return decltype(Fields::__varstruct_counter__(Rank<kMaxMembers>()))::value;
+  }
+
+  template <typename Fields, std::size_t I>
+  static constexpr FieldSpec Spec(Index<I> index) {
+    return Fields::__varstruct_field__(index);
+  }
+
+  // The number of slots in the layout of Fields (see FieldSpec).
+  template <typename Fields>
+  static constexpr std::size_t NumSlots() {
+    return decltype(Fields::__varstruct_slots__(
+        Index<NumFields<Fields>()>()))::value;
+  }
+
+  // The Alignment that Fields was defined with (see FieldCounter).
+  template <typename Fields>
+  static constexpr std::size_t Alignment() {
+    return Fields::__varstruct_alignment__;
+  }
+
+  // The type of the value of a field passed to Build(): the declared type of
+  // a scalar, or an ArrayValue of the declared type of an array.
+  template <typename Fields, std::size_t I>
+  using Value = decltype(Fields::__varstruct_value__(Index<I>()));
+
+  // Whether a field is hashed and compared by Hash() and Equals(), which
+  // VARSTRUCT_EXCLUDE_FROM_HASH() overrides.
+  template <typename Fields, std::size_t I>
+  static constexpr bool Hashed(Index<I> index) {
+    return Fields::__varstruct_hashed__(index, Rank<1>());
+  }
+
+  // The largest number of elements of an array field, as declared by
+  // VARSTRUCT_MAX_COUNT(), or kNoMaxCount.
+  template <typename Fields, std::size_t I>
+  static constexpr std::size_t MaxCount(Index<I> index) {
+    return Fields::__varstruct_max_count__(index, Rank<1>());
+  }
+
+  // The name of a field, and its declared type (see FieldInfo).
+  template <typename Fields, std::size_t I>
+  static constexpr const char* Name(Index<I> index) {
+    return Fields::__varstruct_name__(index);
+  }
+
+  // The name given to DEFINE_VARSTRUCT().
+  template <typename Fields>
+  static constexpr const char* ClassName() {
+    return Fields::__varstruct_class_name__();
+  }
+
+  // The declared type of a field as written in its declaration, and how its
+  // values are stored (see FieldSchema).
+  template <typename Fields, std::size_t I>
+  static constexpr const char* TypeName(Index<I> index) {
+    return Fields::__varstruct_type_name__(index);
+  }
+
+  template <typename Fields, std::size_t I>
+  static constexpr FieldEncoding Encoding(Index<I> index) {
+    return Fields::__varstruct_encoding__(index);
+  }
+
+  template <typename Fields, std::size_t I>
+  using Type = typename std::remove_pointer<decltype(
+      Fields::__varstruct_type__(Index<I>()))>::type;
+
+  // Writes the value of a field to dst, in the byte order of the field.
+  template <typename Fields, std::size_t I>
+  static void Store(Index<I> index, char* dst, const Value<Fields, I>& value) {
+    Fields::__varstruct_store__(index, dst, value);
+  }
+
+  // Returns the bytes of the value of an array field, if they are stored
+  // as-is, or null if their byte order must be converted. Scalars are always
+  // stored by Store(), so this is null for them.
+  template <typename Fields, std::size_t I, typename T>
+  static const void* Bytes(Index<I> index, const ArrayValue<T>& value) {
+    return Fields::__varstruct_bytes__(index, value);
+  }
+
+  template <typename Fields, std::size_t I, typename T>
+  static const void* Bytes(Index<I>, const T&) {
+    return nullptr;
+  }
+};
+
+// A C++11 stand-in for std::index_sequence.
+template <std::size_t... Is>
+struct IndexSequence {};
+
+template <std::size_t N, std::size_t... Is>
+struct MakeIndexSequence : MakeIndexSequence<N - 1, N - 1, Is...> {};
+
+template <std::size_t... Is>
+struct MakeIndexSequence<0, Is...> {
+  using type = IndexSequence<Is...>;
+};
+
+// A static table of the FieldSpec of every field in Fields, ordered by
+// declaration. kFields has one trailing sentinel entry so that the array is
+// never zero-sized.
+template <typename Fields, typename Sequence = typename MakeIndexSequence<
+                               FieldAccess::NumFields<Fields>()>::type>
+struct FieldTable;
+
+template <typename Fields, std::size_t... Is>
+struct FieldTable<Fields, IndexSequence<Is...>> {
+  static constexpr std::size_t kNumFields = sizeof...(Is);
+  static constexpr FieldSpec kFields[kNumFields + 1] = {
+      FieldAccess::Spec<Fields>(Index<Is>())..., ScalarSpec(0)};
+};
+
+template <typename Fields, std::size_t... Is>
+constexpr FieldSpec FieldTable<Fields, IndexSequence<Is...>>::kFields[];
+
+#if defined(VARSTRUCT_STATS)
+// The names of the fields of Fields, ordered by declaration.
+template <typename Fields, std::size_t... Is>
+std::vector<const char*> FieldNames(IndexSequence<Is...>) {
+  const char* const names[] = {FieldAccess::Name<Fields>(Index<Is>())...,
+                               nullptr};
+  return std::vector<const char*>(names, names + sizeof...(Is));
+}
+
+// Returns the usage counters of Fields for the calling thread (see
+// varstruct_stats.h), registering the type on first use.
+template <typename Fields>
+ThreadStats& StatsFor() {
+  static TypeStats* const type = RegisterTypeStats(
+      FieldAccess::ClassName<Fields>(),
+      FieldNames<Fields>(typename MakeIndexSequence<
+                         FieldAccess::NumFields<Fields>()>::type()));
+  static thread_local ThreadStatsHandle handle(type);
+  return *handle.get();
+}
+#endif  // defined(VARSTRUCT_STATS)
+
+// Whether each field of Fields is hashed (see FieldAccess::Hashed()), ordered
+// by declaration, with one trailing sentinel entry like FieldTable.
+template <typename Fields, typename Sequence = typename MakeIndexSequence<
+                               FieldAccess::NumFields<Fields>()>::type>
+struct HashedTable;
+
+template <typename Fields, std::size_t... Is>
+struct HashedTable<Fields, IndexSequence<Is...>> {
+  static constexpr bool kHashed[sizeof...(Is) + 1] = {
+      FieldAccess::Hashed<Fields>(Index<Is>())..., false};
+};
+
+template <typename Fields, std::size_t... Is>
+constexpr bool HashedTable<Fields, IndexSequence<Is...>>::kHashed[];
+
+// Whether any of the first count max counts is not kNoMaxCount.
+constexpr bool AnyMaxCount(const std::size_t* max_counts, std::size_t count) {
+  return count != 0 &&
+         (*max_counts != kNoMaxCount || AnyMaxCount(max_counts + 1, count - 1));
+}
+
+// The FieldAccess::MaxCount() of each field of Fields, ordered by declaration,
+// with one trailing sentinel entry like FieldTable.
+template <typename Fields, typename Sequence = typename MakeIndexSequence<
+                               FieldAccess::NumFields<Fields>()>::type>
+struct MaxCountTable;
+
+template <typename Fields, std::size_t... Is>
+struct MaxCountTable<Fields, IndexSequence<Is...>> {
+  static constexpr std::size_t kMaxCounts[sizeof...(Is) + 1] = {
+      FieldAccess::MaxCount<Fields>(Index<Is>())..., kNoMaxCount};
+
+  // Whether any field has a max count, so that the checks of varstructs
+  // without one are compiled out.
+  static constexpr bool kAny = AnyMaxCount(kMaxCounts, sizeof...(Is));
+};
+
+template <typename Fields, std::size_t... Is>
+constexpr std::size_t MaxCountTable<Fields, IndexSequence<Is...>>::kMaxCounts[];
+
+// Whether only arrays among the first count fields have a max count.
+constexpr bool MaxCountsOnArrays(const FieldSpec* fields,
+                                 const std::size_t* max_counts,
+                                 std::size_t count) {
+  return count == 0 ||
+         ((fields->is_array || *max_counts == kNoMaxCount) &&
+          MaxCountsOnArrays(fields + 1, max_counts + 1, count - 1));
+}
+
+// Whether among the first count fields, each VARSTRUCT_BITS() field that
+// shares the storage word of the field before it is hashed exactly when that
+// field is. Hash() and Equals() cover each storage word as a whole.
+constexpr bool HashedWordsWhole(const FieldSpec* fields, const bool* hashed,
+                                std::size_t count) {
+  return count <= 1 ||
+         ((fields[1].overlap == 0 || hashed[0] == hashed[1]) &&
+          HashedWordsWhole(fields + 1, hashed + 1, count - 1));
+}
+
+// Whether each of the given sizes of the arrays among the first count fields
+// is at most the max count of its array.
+constexpr bool WithinMaxCounts(const FieldSpec* fields,
+                               const std::size_t* max_counts,
+                               const std::size_t* array_sizes,
+                               std::size_t count) {
+  return count == 0 ||
+         ((!fields->is_array || *array_sizes <= *max_counts) &&
+          WithinMaxCounts(fields + 1, max_counts + 1,
+                          array_sizes + (fields->is_array ? 1 : 0),
+                          count - 1));
+}
+
+// The description of a field of a varstruct passed to the visitor of
+// ForEachField(). Everything but the offset, size and data of the field is
+// known at compile time; with CreateStatic(), so are those.
+template <typename Fields, std::size_t I, typename PtrType>
+struct FieldInfo {
+  // The declared type of the field: the element type of an array, or the
+  // varstruct type of a VARSTRUCT_NESTED() field.
+  using type = FieldAccess::Type<Fields, I>;
+
+  // The name of the field, as declared.
+  static constexpr const char* name() {
+    return FieldAccess::Name<Fields>(Index<I>());
+  }
+
+  // The index of the field, in declaration order.
+  static constexpr std::size_t index() { return I; }
+
+  static constexpr bool is_array() {
+    return FieldAccess::Spec<Fields>(Index<I>()).is_array;
+  }
+
+  static constexpr bool is_nested() {
+    return FieldAccess::Spec<Fields>(Index<I>()).compute_nested != nullptr;
+  }
+
+  // The offset and size in bytes of the field, as returned by its foo_offset()
+  // and foo_size() methods.
+  std::size_t offset;
+  std::size_t size;
+
+  // A pointer to the field, of the pointer type of the varstruct (NoPtr if it
+  // has none).
+  PtrType data;
+};
+
+// The number of arrays among the first count fields.
+constexpr std::size_t CountArrays(const FieldSpec* fields, std::size_t count) {
+  return (count == 0)
+             ? 0
+             : (fields->is_array ? 1 : 0) + CountArrays(fields + 1, count - 1);
+}
+
+// The number of fields that read array sizes from the buffer among the first
+// count fields (see FieldSpec::reads_sizes).
+constexpr std::size_t CountSizedArrays(const FieldSpec* fields,
+                                       std::size_t count) {
+  return (count == 0) ? 0
+                      : (fields->reads_sizes ? 1 : 0) +
+                            CountSizedArrays(fields + 1, count - 1);
+}
+
+// The number of VARSTRUCT_TRAILING_ARRAY() fields among the first count
+// fields.
+constexpr std::size_t CountTrailingArrays(const FieldSpec* fields,
+                                          std::size_t count) {
+  return (count == 0) ? 0
+                      : (fields->trailing ? 1 : 0) +
+                            CountTrailingArrays(fields + 1, count - 1);
+}
+
+// A non-owning, read-only view of the array sizes passed to Create().
+//
+// ArraySizes is implicitly constructible from a brace list, so that
+// Create({5, 8}) works as expected; it may also refer to a pointer and count,
+// or to any contiguous container of std::size_t (like std::array or
+// std::vector) when the sizes are computed at runtime. It does not allocate.
+class ArraySizes {
+ public:
+  ArraySizes() : begin_(nullptr), end_(nullptr) {}
+
+  // The brace list outlives the Create() call that it is passed to, which is
+  // as long as an ArraySizes is used.
+  ArraySizes(std::initializer_list<std::size_t> sizes) {
+    begin_ = sizes.begin();
+    end_ = sizes.end();
+  }
+
+  ArraySizes(const std::size_t* sizes, std::size_t count)
+      : begin_(sizes), end_(sizes + count) {}
+
+  template <typename Container,
+            typename = decltype(static_cast<const std::size_t*>(
+                std::declval<const Container&>().data()))>
+  ArraySizes(const Container& sizes)
+      : begin_(sizes.data()), end_(sizes.data() + sizes.size()) {}
+
+  bool empty() const { return begin_ == end_; }
+  std::size_t size() const { return end_ - begin_; }
+  std::size_t front() const { return *begin_; }
+  void pop_front() { ++begin_; }
+
+ private:
+  const std::size_t* begin_;
+  const std::size_t* end_;
+};
+
+// A non-owning, read-only view of the elements of an array field passed to
+// Build(). It may refer to any contiguous container of T (like std::vector,
+// std::string or the view returned by an array's name_span()).
+template <typename T>
+class ArrayValue {
+ public:
+  template <typename Container,
+            typename = decltype(static_cast<const T*>(
+                std::declval<const Container&>().data()))>
+  ArrayValue(const Container& values)
+      : data_(values.data()), size_(values.size()) {}
+
+  const T* data() const { return data_; }
+  std::size_t size() const { return size_; }
+
+ private:
+  const T* data_;
+  std::size_t size_;
+};
+
+// The type of the values of VARSTRUCT_NESTED() fields passed to Build(),
+// which does not support them. It is never defined.
+struct NestedValue;
+
+// The number of elements of a value passed to Build(), or 0 for scalars.
+template <typename T>
+std::size_t ElementCount(const ArrayValue<T>& value) {
+  return value.size();
+}
+
+template <typename T>
+std::size_t ElementCount(const T&) {
+  return 0;
+}
+
+// The largest alignment of the first count fields, or 1 if there are none.
+constexpr std::size_t MaxAlignment(const FieldSpec* fields, std::size_t count,
+                                   std::size_t max = 1) {
+  return (count == 0) ? max
+                      : MaxAlignment(fields + 1, count - 1,
+                                     fields->alignment > max ? fields->alignment
+                                                             : max);
+}
+
+// The kind of declaration of a field, in its FieldSchema.
+enum class FieldKind {
+  kScalar,         // VARSTRUCT_SCALAR()
+  kBits,           // VARSTRUCT_BITS()
+  kArray,          // VARSTRUCT_ARRAY()
+  kSizedByArray,   // VARSTRUCT_ARRAY_SIZED_BY()
+  kTrailingArray,  // VARSTRUCT_TRAILING_ARRAY()
+  kNested,         // VARSTRUCT_NESTED()
+  kNestedArray,    // VARSTRUCT_NESTED_ARRAY()
+};
+
+// The kind of values of the declared type of a field, in its FieldSchema.
+enum class ValueKind {
+  kUnsigned,  // Unsigned integers and bool.
+  kSigned,    // Signed integers.
+  kFloat,     // Floating point.
+  kOther,     // Other types, such as structs and nested varstructs.
+};
+
+template <typename T>
+constexpr ValueKind ValueKindOf() {
+  return std::is_floating_point<T>::value
+             ? ValueKind::kFloat
+             : !std::is_integral<T>::value
+                   ? ValueKind::kOther
+                   : std::is_signed<T>::value ? ValueKind::kSigned
+                                              : ValueKind::kUnsigned;
+}
+
+// The field index of FieldSchema::size_field for fields other than
+// VARSTRUCT_ARRAY_SIZED_BY() arrays.
+constexpr std::size_t kNoSizeField = std::numeric_limits<std::size_t>::max();
+
+struct Schema;
+
+// The description of a field returned by schema(), as needed to decode it
+// without the varstruct definition, as from another language. Everything is
+// known at compile time.
+struct FieldSchema {
+  // The name of the field, and its declared type as written in the
+  // declaration (such as "uint16_t").
+  const char* name;
+  const char* type;
+
+  FieldKind kind;
+  ValueKind value_kind;
+
+  // sizeof() the declared type: the size of an array element, or of the
+  // storage word of a VARSTRUCT_BITS() field. 0 for nested varstructs, whose
+  // size depends on their array sizes.
+  std::size_t elem_size;
+
+  // The alignment of the offset of the field, as for FieldSpec.
+  std::size_t alignment;
+
+  // Whether the values are stored big endian (rather than little endian).
+  bool big_endian;
+
+  // For VARSTRUCT_BITS() fields, the shift of the field from the least
+  // significant bit of its word, its width, and whether the word is the one
+  // of the previous field.
+  std::size_t bit_shift;
+  std::size_t bit_width;
+  bool shares_word;
+
+  // For VARSTRUCT_ARRAY_SIZED_BY() arrays, the index of the field holding the
+  // number of elements. Otherwise, kNoSizeField.
+  std::size_t size_field;
+
+  // The VARSTRUCT_MAX_COUNT() of an array, or kNoMaxCount.
+  std::size_t max_count;
+
+  // Whether the field is included by Hash() and Equals().
+  bool hashed;
+
+  // The schema of the varstruct of a nested field, and null otherwise.
+  const Schema* nested;
+};
+
+// The description of a varstruct returned by schema(): its name and
+// alignment, and the schema of each of its fields in declaration order.
+struct Schema {
+  const char* name;
+  std::size_t alignment;
+  std::size_t num_fields;
+  const FieldSchema* fields;
+};
+
+template <typename Fields, typename Sequence = typename MakeIndexSequence<
+                               FieldAccess::NumFields<Fields>()>::type>
+struct SchemaTable;
+
+// The schema of the varstruct T, if it is one (as for nested fields), and null
+// otherwise.
+template <typename T, typename = decltype(T::schema())>
+constexpr const Schema* NestedSchema(Rank<1>) {
+  return &SchemaTable<T>::kSchema;
+}
+
+template <typename T>
+constexpr const Schema* NestedSchema(Rank<0>) {
+  return nullptr;
+}
+
+constexpr FieldKind KindOf(const FieldSpec& spec,
+                           const FieldEncoding& encoding) {
+  return (spec.compute_nested != nullptr)
+             ? (spec.is_array ? FieldKind::kNestedArray : FieldKind::kNested)
+             : !spec.is_array
+                   ? (encoding.bit_width != 0 ? FieldKind::kBits
+                                              : FieldKind::kScalar)
+                   : (spec.read_count != nullptr)
+                         ? FieldKind::kSizedByArray
+                         : spec.trailing ? FieldKind::kTrailingArray
+                                         : FieldKind::kArray;
+}
+
+template <typename Fields, std::size_t I>
+constexpr FieldSchema MakeFieldSchema(const FieldSpec& spec,
+                                      const FieldEncoding& encoding) {
+  return FieldSchema{
+      FieldAccess::Name<Fields>(Index<I>()),
+      FieldAccess::TypeName<Fields>(Index<I>()),
+      KindOf(spec, encoding),
+      ValueKindOf<FieldAccess::Type<Fields, I>>(),
+      (spec.compute_nested != nullptr) ? 0 : spec.elem_size,
+      spec.alignment,
+      encoding.big_endian,
+      encoding.bit_shift,
+      encoding.bit_width,
+      spec.overlap != 0,
+      (spec.read_count != nullptr) ? spec.count_field : kNoSizeField,
+      FieldAccess::MaxCount<Fields>(Index<I>()),
+      FieldAccess::Hashed<Fields>(Index<I>()),
+      NestedSchema<FieldAccess::Type<Fields, I>>(Rank<1>())};
+}
+
+template <typename Fields, std::size_t... Is>
+struct SchemaTable<Fields, IndexSequence<Is...>> {
+  // With one trailing sentinel entry like FieldTable.
+  static constexpr FieldSchema kFields[sizeof...(Is) + 1] = {
+      MakeFieldSchema<Fields, Is>(
+          FieldTable<Fields>::kFields[Is],
+          FieldAccess::Encoding<Fields>(Index<Is>()))...,
+      FieldSchema{"", "", FieldKind::kScalar, ValueKind::kOther, 0, 1, false,
+                  0, 0, false, kNoSizeField, kNoMaxCount, false, nullptr}};
+
+  static constexpr Schema kSchema = {
+      FieldAccess::ClassName<Fields>(),
+      MaxAlignment(FieldTable<Fields>::kFields, sizeof...(Is)), sizeof...(Is),
+      kFields};
+};
+
+template <typename Fields, std::size_t... Is>
+constexpr FieldSchema SchemaTable<Fields, IndexSequence<Is...>>::kFields[];
+
+template <typename Fields, std::size_t... Is>
+constexpr Schema SchemaTable<Fields, IndexSequence<Is...>>::kSchema;
+
+// The buffer_len used when the length of the buffer is not known.
+constexpr std::size_t kUnknownBufferLen =
+    std::numeric_limits<std::size_t>::max();
+
+// Stores the sizes of the arrays of Fields in array_sizes, in declaration
+// order, given the ElementCount() of the value of each field, as passed to
+// Build(). Returns the number of arrays.
+template <typename Fields>
+std::size_t CollectArraySizes(const std::size_t* counts,
+                              std::size_t* array_sizes) {
+  std::size_t num_array_sizes = 0;
+  for (std::size_t i = 0; i < FieldTable<Fields>::kNumFields; i++) {
+    if (FieldTable<Fields>::kFields[i].is_array) {
+      array_sizes[num_array_sizes++] = counts[i];
+    }
+  }
+  return num_array_sizes;
+}
+
+// The index of the first VARSTRUCT_ARRAY_SIZED_BY() array among fields k to
+// count - 1 whose size is read from field i, or kNoSizeField if there is
+// none.
+constexpr std::size_t ArraySizedBy(const FieldSpec* fields,
+                                   std::size_t count, std::size_t i,
+                                   std::size_t k = 0) {
+  return (k == count) ? kNoSizeField
+         : (fields[k].is_array && fields[k].reads_sizes &&
+            fields[k].count_field == i)
+             ? k
+             : ArraySizedBy(fields, count, i, k + 1);
+}
+
+// The array size that field I of Fields holds once value is stored in it, as
+// read back by the VARSTRUCT_ARRAY_SIZED_BY() arrays it sizes, or 0 if it
+// sizes none. Like Build(), this stores a VARSTRUCT_BITS() field into a word
+// whose other bits are zero.
+template <typename Fields, std::size_t I>
+std::size_t StoredCount(Index<I> index,
+                        const FieldAccess::Value<Fields, I>& value,
+                        std::true_type /* sizes_array */) {
+  using Table = FieldTable<Fields>;
+  char word[Table::kFields[I].elem_size] = {};
+  FieldAccess::Store<Fields>(index, word, value);
+  return Table::kFields[ArraySizedBy(Table::kFields, Table::kNumFields, I)]
+      .read_count(word);
+}
+
+template <typename Fields, std::size_t I>
+std::size_t StoredCount(Index<I>, const FieldAccess::Value<Fields, I>&,
+                        std::false_type /* sizes_array */) {
+  return 0;
+}
+
+template <typename Fields, std::size_t I>
+std::size_t StoredCount(Index<I> index,
+                        const FieldAccess::Value<Fields, I>& value) {
+  using Table = FieldTable<Fields>;
+  return StoredCount<Fields>(
+      index, value,
+      std::integral_constant<bool, ArraySizedBy(Table::kFields,
+                                                Table::kNumFields,
+                                                I) != kNoSizeField>());
+}
+
+// Whether the count field of each VARSTRUCT_ARRAY_SIZED_BY() array of Fields
+// holds the size of the array, given the ElementCount() and StoredCount() of
+// the value of each field, as passed to Build(). A count that does not fit in
+// its field is truncated when stored, so it is compared as read back.
+template <typename Fields>
+bool CountFieldsMatch(const std::size_t* counts,
+                      const std::size_t* stored_counts) {
+  for (std::size_t i = 0; i < FieldTable<Fields>::kNumFields; i++) {
+    const FieldSpec& field = FieldTable<Fields>::kFields[i];
+    if (field.is_array && field.reads_sizes &&
+        stored_counts[field.count_field] != counts[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Stores start + size * count in *end, and returns whether it is at most
+// kMaxOffset. Sizes of arrays may come from untrusted buffers, so this guards
+// against the product wrapping around.
+inline bool ComputeFieldEnd(std::size_t start, std::size_t size,
+                            std::size_t count, std::size_t* end) {
+#if defined(__GNUC__)
+  std::size_t bytes;
+  if (__builtin_mul_overflow(size, count, &bytes)) {
+    return false;
+  }
+#else
+  if (size != 0 && count > kMaxOffset / size) {
+    return false;
+  }
+  const std::size_t bytes = size * count;
+#endif
+  if (start > kMaxOffset || bytes > kMaxOffset - start) {
+    return false;
+  }
+  *end = start + bytes;
+  return true;
+}
+
+// Forward declaration needed for ComputeFieldOffsets().
+template <typename Fields>
+bool ComputeFieldOffset(std::size_t i, const char* base, std::size_t buffer_len,
+                        ArraySizes* remaining_sizes, std::size_t* offsets,
+                        std::size_t* needed_len = nullptr);
+
+// Computes the offset immediately after each field of Fields, given the sizes
+// of its arrays, and stores them in offsets (which must have room for
+// FieldAccess::NumSlots<Fields>() entries, in the order described by
+// FieldSpec).
+//
+// That is, offsets[0] is the offset of the second member, as the offset of the
+// first member is always 0, and the last offset is the size of the entire
+// varstruct. For varstructs defined by DEFINE_VARSTRUCT_ALIGNED(), each member
+// instead begins at the first multiple of its alignment at or after the end of
+// the previous member, and the size excludes any trailing padding.
+//
+// If base is not null, the sizes of VARSTRUCT_ARRAY_SIZED_BY() arrays are read
+// from their count fields in the buffer at base as the pass reaches them (the
+// count field always precedes the array, so its offset is already known).
+// Otherwise, their sizes are taken from array_sizes like any other array.
+// Likewise, if base is not null and buffer_len is known, the size of a
+// VARSTRUCT_TRAILING_ARRAY() is the number of whole elements that fit in the
+// rest of the buffer. Sizes are consumed from the front of array_sizes,
+// including those of the arrays of nested varstructs, in declaration order.
+//
+// Returns false, leaving offsets partially computed, if a count field to be
+// read or the start of a trailing array does not lie within the first
+// buffer_len bytes of the buffer, if the size of an array exceeds its
+// VARSTRUCT_MAX_COUNT(), or if an offset would exceed kMaxOffset. In the first
+// case only, if needed_len is not null, the length the buffer needs (at least)
+// to hold that count field or the start of that array is stored in
+// *needed_len, so that callers can tell records that have not fully arrived
+// from invalid ones.
+template <typename Fields>
+bool ComputeFieldOffsets(const char* base, std::size_t buffer_len,
+                         ArraySizes* remaining_sizes, std::size_t* offsets,
+                         std::size_t* needed_len = nullptr) {
+  for (std::size_t i = 0; i < FieldTable<Fields>::kNumFields; i++) {
+    if (!ComputeFieldOffset<Fields>(i, base, buffer_len, remaining_sizes,
+                                    offsets, needed_len)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Computes the offsets stored for field i alone, like ComputeFieldOffsets(),
+// given those of the fields before it.
+template <typename Fields>
+bool ComputeFieldOffset(std::size_t i, const char* base, std::size_t buffer_len,
+                        ArraySizes* remaining_sizes, std::size_t* offsets,
+                        std::size_t* needed_len) {
+  using Table = FieldTable<Fields>;
+  ArraySizes& array_sizes = *remaining_sizes;
+  const FieldSpec& field = Table::kFields[i];
+  const std::size_t total =
+      (i == 0) ? 0 : offsets[Table::kFields[i - 1].end_slot];
+  const std::size_t start = AlignUp(total, field.alignment) - field.overlap;
+  std::size_t count = 1;
+  if (field.is_array) {
+    if (field.read_count != nullptr && base != nullptr) {
+      const FieldSpec& count_field = Table::kFields[field.count_field];
+      if (offsets[count_field.end_slot] > buffer_len) {
+        if (needed_len != nullptr) {
+          *needed_len = offsets[count_field.end_slot];
+        }
+        return false;
+      }
+      count = field.read_count(base + offsets[count_field.end_slot] -
+                               count_field.elem_size);
+    } else if (field.trailing && base != nullptr &&
+               buffer_len != kUnknownBufferLen) {
+      // The array is the last field, so it ends where the varstruct does,
+      // before any padding up to its alignment.
+      const std::size_t end =
+          buffer_len &
+          ~(MaxAlignment(Table::kFields, Table::kNumFields) - 1);
+      if (start > end) {
+        if (needed_len != nullptr) {
+          *needed_len = start;
+        }
+        return false;
+      }
+      count = (end - start) / field.elem_size;
+    } else {
+      assert(!array_sizes.empty());
+      count = array_sizes.front();
+      array_sizes.pop_front();
+    }
+    if (MaxCountTable<Fields>::kAny &&
+        count > MaxCountTable<Fields>::kMaxCounts[i]) {
+      return false;
+    }
+  }
+  // The elements of arrays of nested varstructs all have the same layout, so
+  // their sizes are never read from the buffer.
+  std::size_t size = field.elem_size;
+  // Relative to the start of the nested varstruct, and 0 unless it had not
+  // fully arrived.
+  std::size_t nested_needed_len = 0;
+  if (field.compute_nested != nullptr &&
+      !field.compute_nested(
+          (base == nullptr || field.is_array) ? nullptr : base + start,
+          (start > buffer_len) ? 0 : buffer_len - start, &array_sizes,
+          offsets + field.end_slot + 1 - field.num_slots, &size,
+          &nested_needed_len)) {
+    if (needed_len != nullptr && nested_needed_len != 0) {
+      *needed_len = start + nested_needed_len;
+    }
+    return false;
+  }
+  // Multiply the size of each array element by its array size, and make the
+  // offsets real offsets by carry adding.
+  return ComputeFieldEnd(start, size, count, offsets + field.end_slot);
+}
+
+// Computes the offsets of every field of Fields, as stored by the layout of a
+// varstruct.
+template <typename Fields>
+bool ComputeOffsets(const char* base, std::size_t buffer_len,
+                    ArraySizes array_sizes, std::size_t* offsets) {
+  if (!ComputeFieldOffsets<Fields>(base, buffer_len, &array_sizes, offsets)) {
+    return false;
+  }
+  // The number of array_sizes elements should be the same as the number of
+  // VARSTRUCT_ARRAY() declarations.
+  assert(array_sizes.empty());
+  return true;
+}
+
+// Called when the offsets of a varstruct cannot be computed by the Create()
+// overloads that have no buffer length and so no way to report failure, which
+// only happens if an array size exceeds its VARSTRUCT_MAX_COUNT() or the
+// offsets overflow, or when more array sizes are passed than there are slots
+// to copy them to. Continuing would leave the varstruct with indeterminate
+// offsets, so this aborts in every build mode.
+[[noreturn]] inline void AbortInvalidLayout() {
+  std::fputs(
+      "varstruct: too many array sizes, an array size exceeds its "
+      "VARSTRUCT_MAX_COUNT(), or the offsets overflow\n",
+      stderr);
+  std::abort();
+}
+
+// The FieldSpec::compute_nested function of VARSTRUCT_NESTED() fields of type
+// Nested.
+template <typename Nested>
+bool ComputeNested(const char* base, std::size_t buffer_len,
+                   ArraySizes* array_sizes, std::size_t* offsets,
+                   std::size_t* size, std::size_t* needed_len) {
+  constexpr std::size_t kNumSlots = FieldAccess::NumSlots<Nested>();
+  if (!ComputeFieldOffsets<Nested>(base, buffer_len, array_sizes, offsets,
+                                   needed_len)) {
+    return false;
+  }
+  *size = AlignUp((kNumSlots == 0) ? 0 : offsets[kNumSlots - 1],
+                  Nested::alignment());
+  return true;
+}
+
+// The spec of a VARSTRUCT_NESTED() field, or of a VARSTRUCT_NESTED_ARRAY()
+// field if is_array is true, of type Nested.
+template <typename Nested>
+constexpr FieldSpec NestedSpec(bool is_array) {
+  return FieldSpec{0,
+                   is_array,
+                   0,
+                   nullptr,
+                   1,
+                   FieldAccess::NumSlots<Nested>() + 1,
+                   0,
+                   &ComputeNested<Nested>,
+                   !is_array &&
+                       CountSizedArrays(FieldTable<Nested>::kFields,
+                                        FieldTable<Nested>::kNumFields) != 0,
+                   0,
+                   false};
+}
+
+// The alignment of a VARSTRUCT_NESTED() field with the given nested_alignment
+// (that of its varstruct), in a varstruct with the given Alignment.
+constexpr std::size_t NestedAlignment(std::size_t alignment,
+                                      std::size_t nested_alignment) {
+  return (FieldAlignment(alignment, 1) > nested_alignment)
+             ? FieldAlignment(alignment, 1)
+             : nested_alignment;
+}
+
+// Holds either a T or nothing, like a minimal C++11 std::optional. Returned by
+// the Create() overloads that validate the length of the buffer.
+template <typename T>
+class Optional {
+ public:
+  Optional() : has_value_(false) {}
+  explicit Optional(const T& value) : value_(value), has_value_(true) {}
+
+  bool has_value() const { return has_value_; }
+  explicit operator bool() const { return has_value_; }
+
+  const T& operator*() const {
+    assert(has_value_);
+    return value_;
+  }
+  T& operator*() {
+    assert(has_value_);
+    return value_;
+  }
+  const T* operator->() const { return &**this; }
+  T* operator->() { return &**this; }
+
+ private:
+  T value_;
+  bool has_value_;
+};
+
+// The layout type of the user-facing varstruct type (the one named by
+// DEFINE_VARSTRUCT()). That type only has static members; its instance methods
+// are not usable, since it has no offsets.
+class SchemaOnly {};
+
+// Layout storage referring to offsets held by another varstruct, as returned
+// by bind(). Copying a SharedOffsets only copies a pointer, but the varstruct
+// holding the offsets must outlive it.
+template <std::size_t N>
+class SharedOffsets {
+ public:
+  SharedOffsets() : offsets_(nullptr) {}
+  explicit SharedOffsets(const std::size_t* offsets) : offsets_(offsets) {}
+
+  std::size_t begin(std::size_t index) const {
+    return (index == 0) ? 0 : offsets_[index - 1];
+  }
+
+  std::size_t end(std::size_t index) const { return offsets_[index]; }
+
+  std::size_t size_bytes() const { return (N == 0) ? 0 : offsets_[N - 1]; }
+
+  SharedOffsets share() const { return *this; }
+
+  // The stored offsets, for the views of nested varstructs.
+  const std::size_t* slots() const { return offsets_; }
+
+ private:
+  const std::size_t* offsets_;
+};
+
+// Layout storage holding the offsets of the N members of a varstruct inline, so
+// that a varstruct returned from Create() never touches the heap.
+template <std::size_t N>
+class InlineOffsets {
+ public:
+  // The offset of the member with the given index, before any padding that
+  // aligns it (that is, the offset immediately after the previous member).
+  std::size_t begin(std::size_t index) const {
+    return (index == 0) ? 0 : offsets_[index - 1];
+  }
+
+  // The offset immediately after the member with the given index.
+  std::size_t end(std::size_t index) const { return offsets_[index]; }
+
+  // After ComputeOffsets(), the last offsets_ cell holds the offset
+  // immediately after the last member, which is also the size of the entire
+  // varstruct.
+  std::size_t size_bytes() const {
+    return offsets_.empty() ? 0 : offsets_.back();
+  }
+
+  // Returns layout storage referring to these offsets.
+  SharedOffsets<N> share() const { return SharedOffsets<N>(offsets_.data()); }
+
+  // The stored offsets, for the views of nested varstructs.
+  const std::size_t* slots() const { return offsets_.data(); }
+
+  std::array<std::size_t, N> offsets_;
+};
+
+// Layout storage that computes the offsets of the fields of Fields on demand,
+// as returned by CreateLazy(). Each access computes the offsets of the fields
+// up to the one accessed, if not already computed, so reading the first few
+// fields of a varstruct with many never computes the rest. The N offsets and
+// the array sizes (which a brace list would not keep alive) are held inline.
+//
+// Since its accessors update it, a LazyOffsets must not be used by more than
+// one thread at a time, even for reads.
+template <typename Fields, std::size_t N>
+class LazyOffsets {
+  using Table = FieldTable<Fields>;
+
+ public:
+  LazyOffsets()
+      : base_(nullptr),
+        num_array_sizes_(0),
+        next_array_size_(0),
+        num_fields_(0),
+        num_slots_(0) {}
+
+  LazyOffsets(const char* base, ArraySizes array_sizes)
+      : base_(base),
+        num_array_sizes_(array_sizes.size()),
+        next_array_size_(0),
+        num_fields_(0),
+        num_slots_(0) {
+    // There are never more array sizes than slots.
+    if (num_array_sizes_ > array_sizes_.size()) {
+      AbortInvalidLayout();
+    }
+    for (std::size_t i = 0; i < num_array_sizes_; i++) {
+      array_sizes_[i] = array_sizes.front();
+      array_sizes.pop_front();
+    }
+  }
+
+  std::size_t begin(std::size_t index) const {
+    return (index == 0) ? 0 : end(index - 1);
+  }
+
+  std::size_t end(std::size_t index) const {
+    if (index >= num_slots_) {
+      ComputeThrough(index);
+    }
+    return offsets_[index];
+  }
+
+  std::size_t size_bytes() const { return (N == 0) ? 0 : end(N - 1); }
+
+  // Returns layout storage referring to these offsets, all of which are
+  // computed first.
+  SharedOffsets<N> share() const { return SharedOffsets<N>(slots()); }
+
+  // The stored offsets, for the views of nested varstructs. The view may read
+  // any of them, so all are computed first.
+  const std::size_t* slots() const {
+    size_bytes();
+    return offsets_.data();
+  }
+
+ private:
+  // Computes the offsets of the fields before and including the one holding
+  // the given slot.
+  void ComputeThrough(std::size_t slot) const {
+    assert(slot < N);
+    while (num_slots_ <= slot) {
+      ArraySizes array_sizes(array_sizes_.data() + next_array_size_,
+                             num_array_sizes_ - next_array_size_);
+      // Without a buffer length, this only fails for array sizes beyond a
+      // VARSTRUCT_MAX_COUNT() or offsets that overflow, which abort as for
+      // Create(ptr, array_sizes).
+      if (!ComputeFieldOffset<Fields>(num_fields_, base_, kUnknownBufferLen,
+                                      &array_sizes, offsets_.data())) {
+        AbortInvalidLayout();
+      }
+      next_array_size_ = num_array_sizes_ - array_sizes.size();
+      num_slots_ = Table::kFields[num_fields_].end_slot + 1;
+      num_fields_++;
+    }
+    // The number of array sizes should be the same as the number of
+    // VARSTRUCT_ARRAY() declarations.
+    assert(num_fields_ < Table::kNumFields ||
+           next_array_size_ == num_array_sizes_);
+  }
+
+  const char* base_;
+  std::array<std::size_t, N> array_sizes_;
+  std::size_t num_array_sizes_;
+  mutable std::size_t next_array_size_;
+  // The number of fields, and of slots, whose offsets have been computed.
+  mutable std::size_t num_fields_;
+  mutable std::size_t num_slots_;
+  mutable std::array<std::size_t, N> offsets_;
+};
+
+// A compile-time list of array sizes, as passed to CreateStatic().
+template <std::size_t... Sizes>
+struct SizeList {};
+
+// The offset immediately after the first count fields, given the sizes of the
+// arrays among them, if the first field begins at or after offset start. This
+// is the constexpr equivalent of ComputeOffsets().
+constexpr std::size_t StaticEnd(const FieldSpec* fields,
+                                const std::size_t* array_sizes,
+                                std::size_t count, std::size_t start = 0) {
+  return (count == 0)
+             ? start
+             : StaticEnd(fields + 1, array_sizes + (fields->is_array ? 1 : 0),
+                         count - 1,
+                         AlignUp(start, fields->alignment) -
+                             fields->overlap +
+                             fields->elem_size *
+                                 (fields->is_array ? *array_sizes : 1));
+}
+
+// The offsets of each field of Fields for compile-time array sizes. kEnds has
+// the same meaning as the offsets computed by ComputeOffsets(), with one
+// trailing sentinel entry so that the array is never zero-sized.
+template <typename Fields, typename Sizes,
+          typename Sequence = typename MakeIndexSequence<
+              FieldAccess::NumFields<Fields>()>::type>
+struct StaticOffsetTable;
+
+template <typename Fields, std::size_t... Sizes, std::size_t... Is>
+struct StaticOffsetTable<Fields, SizeList<Sizes...>, IndexSequence<Is...>> {
+  using Table = FieldTable<Fields>;
+
+  // The number of sizes passed to CreateStatic() should be the same as the
+  // number of VARSTRUCT_ARRAY() declarations.
+  static_assert(sizeof...(Sizes) ==
+                    CountArrays(Table::kFields, Table::kNumFields),
+                "Wrong number of array sizes");
+  static_assert(FieldAccess::NumSlots<Fields>() == Table::kNumFields,
+                "CreateStatic() does not support VARSTRUCT_NESTED() fields");
+
+  static constexpr std::size_t kArraySizes[sizeof...(Sizes) + 1] = {Sizes...,
+                                                                    0};
+  static_assert(WithinMaxCounts(Table::kFields,
+                                MaxCountTable<Fields>::kMaxCounts, kArraySizes,
+                                Table::kNumFields),
+                "Array size exceeds VARSTRUCT_MAX_COUNT()");
+  static constexpr std::size_t kEnds[sizeof...(Is) + 1] = {
+      StaticEnd(Table::kFields, kArraySizes, Is + 1)..., 0};
+};
+
+template <typename Fields, std::size_t... Sizes, std::size_t... Is>
+constexpr std::size_t StaticOffsetTable<Fields, SizeList<Sizes...>,
+                                        IndexSequence<Is...>>::kArraySizes[];
+
+template <typename Fields, std::size_t... Sizes, std::size_t... Is>
+constexpr std::size_t StaticOffsetTable<Fields, SizeList<Sizes...>,
+                                        IndexSequence<Is...>>::kEnds[];
+
+// Layout storage for array sizes known at compile time, as returned by
+// CreateStatic(). It has no members: every offset is a constant expression, so
+// accessors compile down to fixed displacements from the base pointer.
+template <typename Fields, std::size_t... Sizes>
+class StaticOffsets {
+  using Table = StaticOffsetTable<Fields, SizeList<Sizes...>>;
+
+ public:
+  static constexpr std::size_t begin(std::size_t index) {
+    return (index == 0) ? 0 : Table::kEnds[index - 1];
+  }
+
+  static constexpr std::size_t end(std::size_t index) {
+    return Table::kEnds[index];
+  }
+
+  static constexpr std::size_t size_bytes() {
+    return (FieldAccess::NumFields<Fields>() == 0)
+               ? 0
+               : Table::kEnds[FieldAccess::NumFields<Fields>() - 1];
+  }
+
+  StaticOffsets share() const { return *this; }
+};
+
+// The layout type of varstructs returned by bind() for a varstruct with the
+// given Layout. Dummy defers evaluation until bind() is used, as SchemaOnly has
+// no offsets to share.
+template <typename Layout, typename Dummy>
+struct SharedLayout {
+  using type = decltype(std::declval<const Layout&>().share());
+};
+
+// A "pointer" type used to indicate that no base pointer was provided.
+//
+// NoPtr wins by doing absolutely nothing: it is default and copy constructible,
+// but contains no members. Its use should generate no code, and should require
+// minimal memory usage (C++ requires that every object have an address, so a
+// zero-sized object is impossible).
+class NoPtr {};
+
+// Adds offset to a void* or const void* pointer. NoPtr stays NoPtr.
+inline void* OffsetPtr(void* ptr, std::size_t offset) {
+  return static_cast<char*>(ptr) + offset;
+}
+inline const void* OffsetPtr(const void* ptr, std::size_t offset) {
+  return static_cast<const char*>(ptr) + offset;
+}
+inline NoPtr OffsetPtr(NoPtr ptr, std::size_t) { return ptr; }
+
+// Forward declaration needed for the return type of CreateRange().
+template <template <typename, typename> class CrtpTemplate, typename PtrType>
+class VarstructRange;
+
+// Forward declarations needed for the return type of slice().
+template <typename T>
+class Span;
+template <typename PtrType>
+struct CharPtrType;
+
+// Compile-time properties of a varstruct, computed on demand.
+//
+// The varstruct class template is incomplete while its Varstruct base class is
+// instantiated, so anything that depends on its fields must be deferred until
+// use. Dummy is always a template parameter of the using function template to
+// make that happen.
+template <template <typename, typename> class CrtpTemplate, typename Dummy>
+struct VarstructTraits {
+  using Fields = CrtpTemplate<NoPtr, SchemaOnly>;
+  static constexpr std::size_t kNumMembers = FieldAccess::NumFields<Fields>();
+  static constexpr std::size_t kNumSlots = FieldAccess::NumSlots<Fields>();
+  using Offsets = InlineOffsets<kNumSlots>;
+  using LazyLayout = LazyOffsets<Fields, kNumSlots>;
+
+  static_assert(CountTrailingArrays(FieldTable<Fields>::kFields,
+                                    kNumMembers == 0 ? 0 : kNumMembers - 1) ==
+                    0,
+                "VARSTRUCT_TRAILING_ARRAY() must be the last member");
+  static_assert(MaxCountsOnArrays(FieldTable<Fields>::kFields,
+                                  MaxCountTable<Fields>::kMaxCounts,
+                                  kNumMembers),
+                "VARSTRUCT_MAX_COUNT() must name an array");
+  static_assert(HashedWordsWhole(FieldTable<Fields>::kFields,
+                                 HashedTable<Fields>::kHashed, kNumMembers),
+                "VARSTRUCT_EXCLUDE_FROM_HASH() must name every field of a "
+                "VARSTRUCT_BITS() word or none");
+};
+
+// The base template class of every varstruct.
+//
+// Base class members shared by all varstructs like Create(), size_bytes(), and
+// num_members() are declared here. All other members of subclasses are
+// generated by the VARSTRUCT_SCALAR() and VARSTRUCT_ARRAY() macros.
+//
+// Subclass templates are parameterized on pointer type so that we can support
+// mutable pointer, const pointer, and pointerless (offsets only) variants, and
+// on the layout type that stores the computed offsets. We use a variant of the
+// curiously-recurring template pattern (CRTP) with a template template
+// parameter so that we can extract the base template of derived members. This
+// allows constructing subclass templates with different pointer and layout
+// types, as necessary to make the different Create() factories work.
+//
+// DEFINE_VARSTRUCT() ensures varstruct classes (the subclasses) specify NoPtr
+// and SchemaOnly as default template parameters so that the Create() methods
+// may be called without template parameters. This and the use of "auto" work
+// to abstract away explicit reference to the template parameters from user
+// code.
+//
+// The layout storage is a private base class rather than a member so that the
+// empty base class optimization applies: a varstruct returned by
+// CreateStatic(ptr) is exactly the size of a pointer, and one returned by
+// bind() is the size of two pointers.
+template <template <typename, typename> class CrtpTemplate, typename PtrType,
+          typename LayoutType>
+class Varstruct : private LayoutType {
+  template <typename Dummy>
+  using Traits = VarstructTraits<CrtpTemplate, Dummy>;
+
+  // The layout type of varstructs returned by CreateStatic().
+  template <std::size_t... ArraySizes>
+  using StaticLayout =
+      StaticOffsets<CrtpTemplate<NoPtr, SchemaOnly>, ArraySizes...>;
+
+ public:
+  // Create a Varstruct given a void* pointer.
+  template <typename Dummy = char>
+  static CrtpTemplate<void*, typename Traits<Dummy>::Offsets> Create(
+      void* ptr, ArraySizes array_sizes) {
+    return CreateOrAbort<Dummy>(ptr, array_sizes);
+  }
+
+  // Create a Varstruct given a const void* pointer.
+  template <typename Dummy = char>
+  static CrtpTemplate<const void*, typename Traits<Dummy>::Offsets> Create(
+      const void* ptr, ArraySizes array_sizes) {
+    return CreateOrAbort<Dummy>(ptr, array_sizes);
+  }
+
+  // Create a Varstruct given a void* pointer to a buffer of buffer_len bytes.
+  //
+  // Returns an empty Optional, rather than asserting, if the Varstruct would
+  // not fit in the buffer. Array sizes read by VARSTRUCT_ARRAY_SIZED_BY()
+  // declarations are only read if they are inside the buffer. Otherwise, all
+  // accessors of the Varstruct will stay within the buffer, so they may be
+  // used with bounds_check=false on any in-range index.
+  template <typename Dummy = char>
+  static Optional<CrtpTemplate<void*, typename Traits<Dummy>::Offsets>> Create(
+      void* ptr, std::size_t buffer_len, ArraySizes array_sizes) {
+    return CreateInternal<Dummy>(ptr, buffer_len, array_sizes);
+  }
+
+  // Create a Varstruct given a const void* pointer to a buffer of buffer_len
+  // bytes, validating the length like the void* overload.
+  template <typename Dummy = char>
+  static Optional<CrtpTemplate<const void*, typename Traits<Dummy>::Offsets>>
+  Create(const void* ptr, std::size_t buffer_len, ArraySizes array_sizes) {
+    return CreateInternal<Dummy>(ptr, buffer_len, array_sizes);
+  }
+
+  // Create a Varstruct given a pointer to a buffer whose array sizes are all
+  // read from the buffer itself by VARSTRUCT_ARRAY_SIZED_BY() declarations.
+  // Equivalent to Create(ptr, {}).
+  //
+  // This is a template (the pointer may be to any type) so that Create({})
+  // still unambiguously calls the pointerless overload.
+  template <typename T>
+  static CrtpTemplate<typename std::conditional<std::is_const<T>::value,
+                                                const void*, void*>::type,
+                      typename Traits<T>::Offsets>
+  Create(T* ptr) {
+    return Create(ptr, ArraySizes());
+  }
+
+  // Create a Varstruct without a pointer. Methods that add the pointer to an
+  // offset will be disabled.
+  template <typename Dummy = char>
+  static CrtpTemplate<NoPtr, typename Traits<Dummy>::Offsets> Create(
+      ArraySizes array_sizes) {
+    return CreateOrAbort<Dummy>(NoPtr(), array_sizes);
+  }
+
+  // Create a Varstruct in size_bytes() bytes of uninitialized memory allocated
+  // from arena, which may be a VarstructArena or any other type with a method
+  // void* Allocate(std::size_t size, std::size_t alignment).
+  template <typename Arena, typename Dummy = char>
+  static CrtpTemplate<void*, typename Traits<Dummy>::Offsets>
+  AllocateAndCreate(Arena* arena, ArraySizes array_sizes) {
+    auto varstruct =
+        CreateOrAbort<Dummy>(static_cast<void*>(nullptr), array_sizes);
+    varstruct.ptr_ = arena->Allocate(varstruct.size_bytes(), alignment());
+    return varstruct;
+  }
+
+  // Create a Varstruct given a void* pointer whose offsets are computed on
+  // demand: accessing a member only computes the offsets of the members up to
+  // it, and keeps them for later accesses. The array sizes are copied.
+  template <typename Dummy = char>
+  static CrtpTemplate<void*, typename Traits<Dummy>::LazyLayout> CreateLazy(
+      void* ptr, ArraySizes array_sizes) {
+    return CreateLazyInternal<Dummy>(ptr, array_sizes);
+  }
+
+  // Create a Varstruct given a const void* pointer whose offsets are computed
+  // on demand.
+  template <typename Dummy = char>
+  static CrtpTemplate<const void*, typename Traits<Dummy>::LazyLayout>
+  CreateLazy(const void* ptr, ArraySizes array_sizes) {
+    return CreateLazyInternal<Dummy>(ptr, array_sizes);
+  }
+
+  // Create a Varstruct given a void* pointer with array sizes known at compile
+  // time. Every offset and size is a constant expression.
+  template <std::size_t... ArraySizes>
+  static CrtpTemplate<void*, StaticLayout<ArraySizes...>> CreateStatic(
+      void* ptr) {
+    CrtpTemplate<void*, StaticLayout<ArraySizes...>> varstruct;
+    varstruct.ptr_ = ptr;
+    return varstruct;
+  }
+
+  // Create a Varstruct given a const void* pointer with array sizes known at
+  // compile time.
+  template <std::size_t... ArraySizes>
+  static CrtpTemplate<const void*, StaticLayout<ArraySizes...>> CreateStatic(
+      const void* ptr) {
+    CrtpTemplate<const void*, StaticLayout<ArraySizes...>> varstruct;
+    varstruct.ptr_ = ptr;
+    return varstruct;
+  }
+
+  // Create a Varstruct without a pointer with array sizes known at compile
+  // time. The result may be declared constexpr.
+  template <std::size_t... ArraySizes>
+  static constexpr CrtpTemplate<NoPtr, StaticLayout<ArraySizes...>>
+  CreateStatic() {
+    return CrtpTemplate<NoPtr, StaticLayout<ArraySizes...>>();
+  }
+
+  // Create a range over the Varstructs stored back to back in the buffer_len
+  // bytes at the void* pointer ptr, each with the given array sizes.
+  //
+  // If prefetch_bytes is not zero, that many bytes following each Varstruct
+  // are prefetched when the range advances to it.
+  static VarstructRange<CrtpTemplate, void*> CreateRange(
+      void* ptr, std::size_t buffer_len, ArraySizes array_sizes,
+      std::size_t prefetch_bytes = 0) {
+    return VarstructRange<CrtpTemplate, void*>(ptr, buffer_len, array_sizes,
+                                               prefetch_bytes);
+  }
+
+  // Create a range over the Varstructs stored back to back in the buffer_len
+  // bytes at the const void* pointer ptr.
+  static VarstructRange<CrtpTemplate, const void*> CreateRange(
+      const void* ptr, std::size_t buffer_len, ArraySizes array_sizes,
+      std::size_t prefetch_bytes = 0) {
+    return VarstructRange<CrtpTemplate, const void*>(ptr, buffer_len,
+                                                     array_sizes,
+                                                     prefetch_bytes);
+  }
+
+  // Write a Varstruct with the given field values, in declaration order, to a
+  // void* pointer to a buffer of buffer_len bytes.
+  //
+  // The sizes of arrays are those of their values, so the layout is computed
+  // in one pass and each field is then written with a single std::memcpy().
+  // Returns an empty Optional, writing nothing, if the Varstruct would not fit
+  // in the buffer, or if the value of the count field of a
+  // VARSTRUCT_ARRAY_SIZED_BY() array is not the size of the array.
+  template <typename Dummy = char, typename... Values>
+  static Optional<CrtpTemplate<void*, typename Traits<Dummy>::Offsets>> Build(
+      void* ptr, std::size_t buffer_len, const Values&... values) {
+    static_assert(sizeof...(Values) == Traits<Dummy>::kNumMembers,
+                  "Wrong number of field values");
+    static_assert(Traits<Dummy>::kNumSlots == Traits<Dummy>::kNumMembers,
+                  "Build() does not support VARSTRUCT_NESTED() fields");
+    return BuildInternal<Dummy>(
+        typename MakeIndexSequence<sizeof...(Values)>::type(),
+        static_cast<char*>(ptr), buffer_len, values...);
+  }
+
+  // Bind the offsets of this Varstruct to a void* pointer.
+  //
+  // The returned Varstruct refers to the offsets of this one rather than
+  // copying them, so this Varstruct must outlive it. Use this to compute the
+  // layout once with Create(array_sizes) and then access many buffers with the
+  // same array sizes.
+  template <typename Dummy = char>
+  CrtpTemplate<void*, typename SharedLayout<LayoutType, Dummy>::type> bind(
+      void* ptr) const {
+    return BindInternal<Dummy>(ptr);
+  }
+
+  // Bind the offsets of this Varstruct to a const void* pointer.
+  template <typename Dummy = char>
+  CrtpTemplate<const void*, typename SharedLayout<LayoutType, Dummy>::type>
+  bind(const void* ptr) const {
+    return BindInternal<Dummy>(ptr);
+  }
 
-// The internal members of Varstruct that need to be accessed by
-// VarstructMember.
-//
-// Without declaring these in a separate class, VarstructMember
-// would need to know the template parameters of Varstruct.
-class VarstructInternal {
- protected:
-  // Bit vector where each bit corresponds to a field in the varstruct and is
-  // true if that field is an array, and false otherwise. This is only needed
-  // for Varstruct::Create(), so Create() will clear this vector before
-  // returning.
-  std::vector<bool> arrays_;
-
-  // Also corresponds to a list of fields ordered by declaration.
-  // VarstructMember instances append to this vector the sizes of their member
-  // types during construction. Varstruct::Create() then modifies these to refer
-  // to the offset of the next member (that is, offsets_[0] is the offset of the
-  // second member, as the offset of the first member is always 0).
-  std::vector<std::size_t> offsets_;
-  friend class VarstructMember;
-};
-
-// An instance of this class is declared as a field for each varstruct field. It
-// stores the unique ascending index of each member. These indices are used for
-// the vectors in VarstructInternal.
-class VarstructMember {
- public:
-  VarstructMember(std::size_t size, bool is_array, VarstructInternal* varstruct)
-      : index_(varstruct->offsets_.size()) {
-    varstruct->offsets_.push_back(size);
-    varstruct->arrays_.push_back(is_array);
+  // Returns a view of the bytes from the start of the field with index First
+  // through the end of the field with index Last, as returned by their
+  // foo_index() methods, including any padding between them. The view is of
+  // const char if the pointer was to const, and of char otherwise.
+  template <std::size_t First, std::size_t Last, typename Dummy = char>
+  Span<typename std::remove_pointer<typename CharPtrType<PtrType>::type>::type>
+  slice() const {
+    static_assert(!std::is_same<PtrType, NoPtr>::value,
+                  "slice() requires a pointer");
+    static_assert(First <= Last && Last < Traits<Dummy>::kNumMembers,
+                  "slice() requires the indices of a range of fields");
+    using Table = FieldTable<typename Traits<Dummy>::Fields>;
+    const std::size_t begin =
+        FieldOffset(Table::kFields[First], __varstruct_layout__());
+    const std::size_t end =
+        __varstruct_layout__().end(Table::kFields[Last].end_slot);
+    return {static_cast<typename CharPtrType<PtrType>::type>(
+                OffsetPtr(ptr_, begin)),
+            end - begin};
   }
 
-  // Index is the index where this member may be found in
-  // VarstructInternal::arrays_ and VarstructInternal::offsets_;
-  std::size_t index() const { return index_; }
+  // The size in bytes of the entire Varstruct. For varstructs defined by
+  // DEFINE_VARSTRUCT_ALIGNED(), this includes trailing padding up to a
+  // multiple of alignment(), so that varstructs may be stored back to back.
+  constexpr std::size_t size_bytes() const {
+    return AlignUp(__varstruct_layout__().size_bytes(), alignment());
+  }
 
- private:
-  std::size_t index_;
-};
+  // The alignment required of the pointer passed to Create(): the largest
+  // alignment of any member. This is 1 unless the Varstruct was defined by
+  // DEFINE_VARSTRUCT_ALIGNED().
+  static constexpr std::size_t alignment() {
+    return MaxAlignment(FieldTable<CrtpTemplate<NoPtr, SchemaOnly>>::kFields,
+                        num_members());
+  }
 
-// A "pointer" type used to indicate that no base pointer was provided.
-//
-// NoPtr wins by doing absolutely nothing: it is default and copy constructible,
-// but contains no members. Its use should generate no code, and should require
-// minimal memory usage (C++ requires that every object have an address, so a
-// zero-sized object is impossible).
-class NoPtr {};
+  // Hashes the bytes of every field not excluded by
+  // VARSTRUCT_EXCLUDE_FROM_HASH(), continuing from seed. Runs of adjacent
+  // hashed fields with no padding between them are hashed as one range.
+  // Varstructs that are Equals() have the same hash.
+  template <typename Dummy = char>
+  std::uint64_t Hash(std::uint64_t seed = 0) const {
+    static_assert(!std::is_same<PtrType, NoPtr>::value,
+                  "Hash() requires a pointer");
+    using Fields = typename Traits<Dummy>::Fields;
+    using Table = FieldTable<Fields>;
+    const char* base = BasePtr(ptr_);
+    std::size_t begin = 0;
+    std::size_t end = 0;
+    for (std::size_t i = 0; i < Table::kNumFields; i++) {
+      if (!HashedTable<Fields>::kHashed[i]) {
+        continue;
+      }
+      const FieldSpec& field = Table::kFields[i];
+      const std::size_t offset = FieldOffset(field, __varstruct_layout__());
+      if (!Coalesces<Fields>(i) && end != begin) {
+        seed = HashBytes(base + begin, end - begin, seed);
+        begin = offset;
+      } else if (end == begin) {
+        begin = offset;
+      }
+      end = __varstruct_layout__().end(field.end_slot);
+    }
+    return (end == begin) ? seed : HashBytes(base + begin, end - begin, seed);
+  }
 
-// The base template class of every varstruct.
-//
-// Base class members shared by all varstructs like Create(), size_bytes(), and
-// num_members() are declared here. All other members of subclasses are
-// generated by the VARSTRUCT_SCALAR() and VARSTRUCT_ARRAY() macros.
-//
-// Subclass templates are parameterized on pointer type so that we can support
-// mutable pointer, const pointer, and pointerless (offsets only) variants. We
-// use a variant of the curiously-recurring template pattern (CRTP) with a
-// template template parameter so that we can extract the base template of
-// derived members. This allows constructing subclass templates with different
-// pointer types, as necessary to make the different Create() factories work.
-//
-// DEFINE_VARSTRUCT() ensures varstruct classes (the subclasses) specify NoPtr
-// as a default template parameter so that the Create() methods may be called
-// without template parameters. This and the use of "auto" work to abstract away
-// explicit reference to the template parameters from user code.
-template <template <typename> class CrtpTemplate, typename PtrType>
-class Varstruct : public VarstructInternal {
- public:
-  // Create a Varstruct given a void* pointer.
-  static CrtpTemplate<void*> Create(void* ptr,
-                                    std::deque<std::size_t> array_sizes) {
-    return CrtpTemplate<void*>::CreateInternal(ptr, array_sizes);
+  // Whether the fields not excluded by VARSTRUCT_EXCLUDE_FROM_HASH() have the
+  // same sizes and bytes in this Varstruct and other, which may have a
+  // different pointer and layout type. Runs of adjacent compared fields with
+  // no padding between them are compared by one std::memcmp().
+  template <typename OtherPtrType, typename OtherLayoutType>
+  bool Equals(
+      const CrtpTemplate<OtherPtrType, OtherLayoutType>& other_view) const {
+    static_assert(!std::is_same<PtrType, NoPtr>::value &&
+                      !std::is_same<OtherPtrType, NoPtr>::value,
+                  "Equals() requires pointers");
+    using Fields = typename Traits<OtherPtrType>::Fields;
+    using Table = FieldTable<Fields>;
+    const Varstruct<CrtpTemplate, OtherPtrType, OtherLayoutType>& other =
+        other_view;
+    const char* base = BasePtr(ptr_);
+    const char* other_base = BasePtr(other.ptr_);
+    std::size_t begin = 0;
+    std::size_t other_begin = 0;
+    std::size_t len = 0;
+    for (std::size_t i = 0; i < Table::kNumFields; i++) {
+      if (!HashedTable<Fields>::kHashed[i]) {
+        continue;
+      }
+      const FieldSpec& field = Table::kFields[i];
+      const std::size_t offset = FieldOffset(field, __varstruct_layout__());
+      const std::size_t other_offset =
+          FieldOffset(field, other.__varstruct_layout__());
+      const std::size_t size =
+          __varstruct_layout__().end(field.end_slot) - offset;
+      if (other.__varstruct_layout__().end(field.end_slot) - other_offset !=
+          size) {
+        return false;
+      }
+      if (!Coalesces<Fields>(i) || len == 0) {
+        if (len != 0 &&
+            std::memcmp(base + begin, other_base + other_begin, len) != 0) {
+          return false;
+        }
+        begin = offset;
+        other_begin = other_offset;
+      }
+      // Fields packed into the same storage word overlap.
+      len = offset + size - begin;
+    }
+    return len == 0 ||
+           std::memcmp(base + begin, other_base + other_begin, len) == 0;
   }
 
-  // Create a Varstruct given a const void* pointer.
-  static CrtpTemplate<const void*> Create(const void* ptr,
-                                          std::deque<std::size_t> array_sizes) {
-    return CrtpTemplate<const void*>::CreateInternal(ptr, array_sizes);
+  // Calls visitor(field) for each field of this Varstruct in declaration
+  // order, where field is a FieldInfo describing it. The type of field differs
+  // between calls, so the visitor should be generic.
+  template <typename Visitor, typename Dummy = char>
+  void ForEachField(Visitor&& visitor) const {
+    ForEachFieldInternal<typename Traits<Dummy>::Fields>(
+        typename MakeIndexSequence<Traits<Dummy>::kNumMembers>::type(),
+        visitor);
   }
 
-  // Create a Varstruct without a pointer. Methods that add the pointer to an
-  // offset will be disabled.
-  static CrtpTemplate<NoPtr> Create(std::deque<std::size_t> array_sizes) {
-    return CrtpTemplate<NoPtr>::CreateInternal(NoPtr(), array_sizes);
+  // Create a view of a nested varstruct at ptr, whose offsets are stored in
+  // the layout of the varstruct containing it. Used by the accessors
+  // generated by VARSTRUCT_NESTED(); not part of the public API.
+  template <typename NewPtrType>
+  static CrtpTemplate<
+      NewPtrType,
+      SharedOffsets<VarstructTraits<CrtpTemplate, NewPtrType>::kNumSlots>>
+  __varstruct_nested__(NewPtrType ptr, const std::size_t* offsets) {
+    CrtpTemplate<NewPtrType, SharedOffsets<VarstructTraits<
+                                 CrtpTemplate, NewPtrType>::kNumSlots>>
+        varstruct;
+    varstruct.ptr_ = ptr;
+    varstruct.__varstruct_layout__() = SharedOffsets<
+        VarstructTraits<CrtpTemplate, NewPtrType>::kNumSlots>(offsets);
+    return varstruct;
   }
 
-  // The size in bytes of the entire Varstruct.
-  std::size_t size_bytes() const {
-    // After Create(), the last offsets_ cell holds the offset immediately after
-    // the last member, which is also the size of the entire Varstruct.
-    return offsets_.empty() ? 0 : offsets_.back();
+  // Create a Varstruct without a pointer like Create(array_sizes), but return
+  // an empty Optional rather than abort if the offsets cannot be computed.
+  // Used by VarstructLayoutCache; not part of the public API.
+  template <typename Dummy = char>
+  static Optional<CrtpTemplate<NoPtr, typename Traits<Dummy>::Offsets>>
+  __varstruct_try_create__(ArraySizes array_sizes) {
+    return CreateInternal<Dummy>(NoPtr(), kUnknownBufferLen, array_sizes);
+  }
+
+  // The description of every field of this Varstruct, which is known at
+  // compile time (see Schema).
+  static constexpr const Schema& schema() {
+    return SchemaTable<CrtpTemplate<NoPtr, SchemaOnly>>::kSchema;
   }
 
   // The number of VARSTRUCT_SCALAR() declarations plus the number of
   // VARSTRUCT_ARRAY() declarations.
-  std::size_t num_members() const { return offsets_.size(); }
+  static constexpr std::size_t num_members() {
+    return FieldAccess::NumFields<CrtpTemplate<NoPtr, SchemaOnly>>();
+  }
 
  protected:
   // The pointer, for instantiations where a void* or const void* was provided.
@@ -132,57 +2100,173 @@ class Varstruct : public VarstructInternal {
   // std::enable_if.
   PtrType ptr_;
 
+  // The layout storage, which holds the offsets of each member.
+  constexpr const LayoutType& __varstruct_layout__() const { return *this; }
+  LayoutType& __varstruct_layout__() { return *this; }
+
+#if defined(VARSTRUCT_STATS)
+  // The usage counters of this varstruct type for the calling thread, updated
+  // by the generated accessors.
+  template <typename Dummy = char>
+  static ThreadStats& __varstruct_stats__() {
+    return StatsFor<typename Traits<Dummy>::Fields>();
+  }
+#endif
+
  private:
   // Internal creation function called by each Create() overload. The template
   // instantiation parmeters used to invoke this function determine the
-  // instantiation variant of the return value.
-  static CrtpTemplate<PtrType> CreateInternal(
-      PtrType ptr, std::deque<std::size_t> array_sizes);
+  // instantiation variant of the return value. The result is empty if the
+  // Varstruct does not fit in buffer_len bytes.
+  template <typename Dummy, typename NewPtrType>
+  static Optional<CrtpTemplate<NewPtrType, typename Traits<Dummy>::Offsets>>
+  CreateInternal(NewPtrType ptr, std::size_t buffer_len,
+                 ArraySizes array_sizes) {
+    using Result = CrtpTemplate<NewPtrType, typename Traits<Dummy>::Offsets>;
+    // Offsets are aligned relative to the pointer.
+    assert(reinterpret_cast<std::uintptr_t>(BasePtr(ptr)) % alignment() == 0);
+    Result varstruct;
+    varstruct.ptr_ = ptr;
+    const bool ok = ComputeOffsets<typename Traits<Dummy>::Fields>(
+                        BasePtr(ptr), buffer_len, array_sizes,
+                        varstruct.__varstruct_layout__().offsets_.data()) &&
+                    varstruct.size_bytes() <= buffer_len;
+#if defined(VARSTRUCT_STATS)
+    __varstruct_stats__<Dummy>().AddCreate(ok, varstruct.size_bytes());
+#endif
+    if (!ok) {
+      return Optional<Result>();
+    }
+    return Optional<Result>(varstruct);
+  }
 
-  // We're friends with other template instantiations. We need this so that
-  // CreateInternal() from one template instantiation may be called from another
-  // template instantiation. (Recall that NoPtr is used as the default pointer
-  // type so that user code doesn't have to concern itself with template
-  // parameters).
-  template <template <typename> class A, typename B>
-  friend class Varstruct;
-};
+  // Internal creation function called by the Create() overloads without a
+  // buffer length, which return the varstruct itself rather than an Optional.
+  // They abort, in every build mode, if the offsets cannot be computed (see
+  // AbortInvalidLayout()).
+  template <typename Dummy, typename NewPtrType>
+  static CrtpTemplate<NewPtrType, typename Traits<Dummy>::Offsets>
+  CreateOrAbort(NewPtrType ptr, ArraySizes array_sizes) {
+    auto varstruct = CreateInternal<Dummy>(ptr, kUnknownBufferLen, array_sizes);
+    if (!varstruct) {
+      AbortInvalidLayout();
+    }
+    return *varstruct;
+  }
 
-template <template <typename> class CrtpTemplate, typename PtrType>
-CrtpTemplate<PtrType> Varstruct<CrtpTemplate, PtrType>::CreateInternal(
-    PtrType ptr, std::deque<std::size_t> array_sizes) {
-  // All computation of indices and setting of VarstructInternal members
-  // occurs upon construction of the varstruct below.
-  //
-  // After construction, offsets will hold sizes, not the actual offsets. We
-  // compute offsets below.
-  CrtpTemplate<PtrType> varstruct;
+  // Internal creation function called by each CreateLazy() overload. No
+  // offsets are computed until the first access.
+  template <typename Dummy, typename NewPtrType>
+  static CrtpTemplate<NewPtrType, typename Traits<Dummy>::LazyLayout>
+  CreateLazyInternal(NewPtrType ptr, ArraySizes array_sizes) {
+    assert(reinterpret_cast<std::uintptr_t>(BasePtr(ptr)) % alignment() == 0);
+    CrtpTemplate<NewPtrType, typename Traits<Dummy>::LazyLayout> varstruct;
+    varstruct.ptr_ = ptr;
+#if defined(VARSTRUCT_STATS)
+    __varstruct_stats__<Dummy>().AddLazyCreate();
+#endif
+    varstruct.__varstruct_layout__() =
+        typename Traits<Dummy>::LazyLayout(BasePtr(ptr), array_sizes);
+    return varstruct;
+  }
 
-  varstruct.ptr_ = ptr;
+  // Internal function called by Build(). Converting each value to the type of
+  // its field here, rather than in Build(), lets Build() deduce the types of
+  // the values it is passed.
+  template <typename Dummy, std::size_t... Is>
+  static Optional<CrtpTemplate<void*, typename Traits<Dummy>::Offsets>>
+  BuildInternal(IndexSequence<Is...>, char* ptr, std::size_t buffer_len,
+                const FieldAccess::Value<typename Traits<Dummy>::Fields, Is>&...
+                    values) {
+    using Fields = typename Traits<Dummy>::Fields;
+    using Table = FieldTable<Fields>;
+    using Result = CrtpTemplate<void*, typename Traits<Dummy>::Offsets>;
 
-  // Multiply each array "offset" (it is currently the type size) by its array
-  // size.
-  for (int i = 0; i < varstruct.num_members(); i++) {
-    if (varstruct.arrays_[i]) {
-      assert(!array_sizes.empty());
-      varstruct.offsets_[i] *= array_sizes.front();
-      array_sizes.pop_front();
+    // Gather the sizes of the arrays (including VARSTRUCT_ARRAY_SIZED_BY()
+    // arrays) like a pointerless Create() would be passed.
+    const std::size_t counts[] = {ElementCount(values)..., 0};
+    const std::size_t stored_counts[] = {
+        StoredCount<Fields>(Index<Is>(), values)..., 0};
+    std::array<std::size_t, Table::kNumFields + 1> array_sizes;
+    const std::size_t num_array_sizes =
+        CollectArraySizes<Fields>(counts, array_sizes.data());
+
+    Result varstruct;
+    varstruct.ptr_ = ptr;
+    if (!CountFieldsMatch<Fields>(counts, stored_counts) ||
+        !ComputeOffsets<Fields>(
+            nullptr, kUnknownBufferLen,
+            ArraySizes(array_sizes.data(), num_array_sizes),
+            varstruct.__varstruct_layout__().offsets_.data()) ||
+        varstruct.size_bytes() > buffer_len) {
+      return Optional<Result>();
     }
+
+    // C++11 has no fold expressions, so expand the stores in an initializer.
+    const int stores[] = {
+        0, (FieldAccess::Store<Fields>(
+                Index<Is>(),
+                ptr + FieldOffset(Table::kFields[Is],
+                                  varstruct.__varstruct_layout__()),
+                values),
+            0)...};
+    (void)stores;
+    return Optional<Result>(varstruct);
   }
-  // The number of array_sizes elements should be the same as the number of
-  // VARSTRUCT_ARRAY() declarations.
-  assert(array_sizes.empty());
-  varstruct.arrays_.clear();
 
-  // Now, make the offsets real offsets by carry adding.
-  std::size_t total = 0;
-  for (int i = 0; i < varstruct.num_members(); i++) {
-    total += varstruct.offsets_[i];
-    varstruct.offsets_[i] = total;
+  // Whether field i of Fields is hashed and compared in the same range as the
+  // field before it: both are hashed, and there can be no padding between
+  // them. In every layout of Fields, the ranges then split the bytes of equal
+  // varstructs at the same places, so their hashes are the same.
+  template <typename Fields>
+  static constexpr bool Coalesces(std::size_t i) {
+    return i != 0 && HashedTable<Fields>::kHashed[i - 1] &&
+           FieldTable<Fields>::kFields[i].alignment == 1;
   }
 
-  return varstruct;
-}
+  // Internal function called by ForEachField().
+  template <typename Fields, typename Visitor, std::size_t... Is>
+  void ForEachFieldInternal(IndexSequence<Is...>, Visitor& visitor) const {
+    // C++11 has no fold expressions, so expand the calls in an initializer.
+    const int visits[] = {0, (visitor(Describe<Fields>(Index<Is>())), 0)...};
+    (void)visits;
+  }
+
+  // The FieldInfo of field I of this Varstruct.
+  template <typename Fields, std::size_t I>
+  FieldInfo<Fields, I, PtrType> Describe(Index<I> index) const {
+    constexpr FieldSpec field = FieldAccess::Spec<Fields>(index);
+    const std::size_t offset = FieldOffset(field, __varstruct_layout__());
+    return FieldInfo<Fields, I, PtrType>{
+        offset, __varstruct_layout__().end(field.end_slot) - offset,
+        OffsetPtr(ptr_, offset)};
+  }
+
+  // The buffer ComputeOffsets() reads array sizes from, if any.
+  static const char* BasePtr(const void* ptr) {
+    return static_cast<const char*>(ptr);
+  }
+  static const char* BasePtr(NoPtr) { return nullptr; }
+
+  // Internal function called by each bind() overload.
+  template <typename Dummy, typename NewPtrType>
+  CrtpTemplate<NewPtrType, typename SharedLayout<LayoutType, Dummy>::type>
+  BindInternal(NewPtrType ptr) const {
+    CrtpTemplate<NewPtrType, typename SharedLayout<LayoutType, Dummy>::type>
+        varstruct;
+    varstruct.ptr_ = ptr;
+    varstruct.__varstruct_layout__() = __varstruct_layout__().share();
+    return varstruct;
+  }
+
+  // We're friends with other template instantiations. We need this so that
+  // CreateInternal() from one template instantiation may access the members of
+  // another template instantiation. (Recall that NoPtr and SchemaOnly are used
+  // as the default template parameters so that user code doesn't have to
+  // concern itself with template parameters).
+  template <template <typename, typename> class A, typename B, typename C>
+  friend class Varstruct;
+};
 
 // Metafunction to detect NoPtr -- we disable the pointer arithmetic variants
 // when using the NoPtr specialization.
@@ -206,6 +2290,217 @@ struct CharPtrType {
       const char*, char*>::type;
 };
 
+// False, but dependent on T, for static_asserts that must only fire when the
+// enclosing template is instantiated.
+template <typename T>
+struct AlwaysFalse {
+  static constexpr bool value = false;
+};
+
+// Metafunction to get either T* or const T*, based on the type of PtrType.
+template <typename PtrType, typename T>
+struct ElementPtrType {
+  using type = typename std::conditional<
+      std::is_const<typename std::remove_pointer<PtrType>::type>::value,
+      const T*, T*>::type;
+};
+
+// A non-owning view of contiguous elements of type T inside a varstruct, as
+// returned by the name_bytes() and name_span() methods of array fields.
+template <typename T>
+class Span {
+ public:
+  Span(T* data, std::size_t size) : data_(data), size_(size) {}
+
+  T* data() const { return data_; }
+  std::size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  T* begin() const { return data_; }
+  T* end() const { return data_ + size_; }
+
+  // No bounds checking is performed.
+  T& operator[](std::size_t index) const { return data_[index]; }
+
+  // Returns a view of the count elements starting at index offset, which must
+  // be within this view.
+  Span subspan(std::size_t offset, std::size_t count) const {
+    assert(offset <= size_ && count <= size_ - offset);
+    return Span(data_ + offset, count);
+  }
+
+ private:
+  T* data_;
+  std::size_t size_;
+};
+
+// The granularity of Prefetch().
+constexpr std::size_t kCacheLineSize = 64;
+
+// Hints to the processor that the len bytes at ptr will be read soon.
+inline void Prefetch(const char* ptr, std::size_t len) {
+#if defined(__GNUC__)
+  for (std::size_t i = 0; i < len; i += kCacheLineSize) {
+    __builtin_prefetch(ptr + i);
+  }
+#else
+  (void)ptr;
+  (void)len;
+#endif
+}
+
+// A range over varstructs stored back to back in one buffer, as returned by
+// CreateRange().
+//
+// Iterating yields each varstruct in turn, with a pointer into the buffer, and
+// stops before the first one that would not fit in the rest of the buffer (or
+// whose count field would not). A varstruct of size zero also ends the range,
+// since the range could not advance past it. Nothing is allocated.
+//
+// If the varstruct has no VARSTRUCT_ARRAY_SIZED_BY() arrays, every record has
+// the same layout, so the offsets are computed once and each record is bound
+// to them, like bind(). The range must then outlive its records. Otherwise,
+// offsets are computed for each record, in one pass that reads its sizes.
+template <template <typename, typename> class CrtpTemplate, typename PtrType>
+class VarstructRange {
+  using Traits = VarstructTraits<CrtpTemplate, PtrType>;
+  using Table = FieldTable<typename Traits::Fields>;
+  using Layout = CrtpTemplate<NoPtr, typename Traits::Offsets>;
+  using CharPtr = typename CharPtrType<PtrType>::type;
+
+  static constexpr bool kFixedLayout =
+      CountSizedArrays(Table::kFields, Table::kNumFields) == 0;
+
+  // A trailing array would run to the end of the buffer, taking up every
+  // record after the first, unless its size is passed in.
+  static_assert(kFixedLayout ||
+                    CountTrailingArrays(Table::kFields, Table::kNumFields) == 0,
+                "Ranges of varstructs with VARSTRUCT_ARRAY_SIZED_BY() arrays "
+                "cannot have a VARSTRUCT_TRAILING_ARRAY()");
+
+ public:
+  // The type of each varstruct in the range.
+  using value_type = typename std::conditional<
+      kFixedLayout,
+      decltype(std::declval<const Layout&>().bind(std::declval<PtrType>())),
+      CrtpTemplate<PtrType, typename Traits::Offsets>>::type;
+
+  class iterator {
+   public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = VarstructRange::value_type;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const value_type*;
+    using reference = const value_type&;
+
+    const value_type& operator*() const { return record_; }
+    const value_type* operator->() const { return &record_; }
+
+    iterator& operator++() {
+      offset_ += record_.size_bytes();
+      done_ = !range_->Decode(offset_, &record_);
+      return *this;
+    }
+
+    // The offset of the current varstruct in the buffer. Once the range has
+    // ended, the offset of the first byte not covered by a varstruct, so
+    // trailing bytes may be detected by comparing it to the buffer length.
+    std::size_t offset() const { return offset_; }
+
+    // Every iterator past the end of the range is equal to end().
+    bool operator==(const iterator& other) const {
+      return done_ == other.done_ && (done_ || offset_ == other.offset_);
+    }
+    bool operator!=(const iterator& other) const { return !(*this == other); }
+
+   private:
+    friend class VarstructRange;
+
+    iterator(const VarstructRange* range, std::size_t offset, bool done)
+        : range_(range), offset_(offset), done_(done) {
+      if (!done_) {
+        done_ = !range_->Decode(offset_, &record_);
+      }
+    }
+
+    const VarstructRange* range_;
+    std::size_t offset_;
+    bool done_;
+    value_type record_;
+  };
+
+  VarstructRange(PtrType ptr, std::size_t buffer_len, ArraySizes array_sizes,
+                 std::size_t prefetch_bytes)
+      : ptr_(static_cast<CharPtr>(ptr)),
+        buffer_len_(buffer_len),
+        num_array_sizes_(array_sizes.size()),
+        prefetch_bytes_(prefetch_bytes) {
+    // There are never more array sizes than slots.
+    if (num_array_sizes_ > array_sizes_.size()) {
+      AbortInvalidLayout();
+    }
+    // Copy the sizes, as a brace list does not outlive the CreateRange() call
+    // when the range is used in a range-based for loop.
+    for (std::size_t i = 0; i < num_array_sizes_; i++) {
+      array_sizes_[i] = array_sizes.front();
+      array_sizes.pop_front();
+    }
+    if (kFixedLayout) {
+      layout_ = Layout::Create(sizes());
+    }
+  }
+
+  iterator begin() const { return iterator(this, 0, false); }
+  iterator end() const { return iterator(this, buffer_len_, true); }
+
+ private:
+  ArraySizes sizes() const {
+    return ArraySizes(array_sizes_.data(), num_array_sizes_);
+  }
+
+  // Sets record to the varstruct at offset. Returns false if there is none.
+  bool Decode(std::size_t offset, value_type* record) const {
+    if (!DecodeLayout(offset, record,
+                      std::integral_constant<bool, kFixedLayout>()) ||
+        record->size_bytes() == 0) {
+      return false;
+    }
+    if (prefetch_bytes_ != 0) {
+      const std::size_t next = offset + record->size_bytes();
+      Prefetch(ptr_ + next, std::min(prefetch_bytes_, buffer_len_ - next));
+    }
+    return true;
+  }
+
+  bool DecodeLayout(std::size_t offset, value_type* record,
+                    std::true_type /* fixed_layout */) const {
+    if (layout_.size_bytes() > buffer_len_ - offset) {
+      return false;
+    }
+    *record = layout_.bind(ptr_ + offset);
+    return true;
+  }
+
+  bool DecodeLayout(std::size_t offset, value_type* record,
+                    std::false_type /* fixed_layout */) const {
+    auto varstruct = Layout::Create(ptr_ + offset, buffer_len_ - offset,
+                                    sizes());
+    if (!varstruct) {
+      return false;
+    }
+    *record = *varstruct;
+    return true;
+  }
+
+  CharPtr ptr_;
+  std::size_t buffer_len_;
+  std::array<std::size_t, Traits::kNumSlots> array_sizes_;
+  std::size_t num_array_sizes_;
+  std::size_t prefetch_bytes_;
+  // The offsets shared by every record, if kFixedLayout.
+  Layout layout_;
+};
+
 // A constexpr function that performs C-string comparison. Returns true if the
 // strings are the same, and false otherwise.
 //
@@ -226,14 +2521,22 @@ constexpr bool EqualStrings(const char* a, const char* b) {
 // Internal macro definitions
 // =============================================================================
 
+// The underlying type of scalars and arrays must be a plain-old data type,
+// since we need to std::memcpy() to copy the type.
+#define VARSTRUCT_ASSERT_POD(decl_type)        \
+  static_assert(std::is_pod<decl_type>::value, \
+                "Type '" #decl_type "' is not POD");
+
 // An internal macro called by VARSTRUCT_SCALAR_INTERNAL() and
-// VARSTRUCT_ARRAY_INTERNAL() that contains the logic shared by both. This macro
-// declares the VarstructMember for the field, along with the offset and pointer
-// methods.
+// VARSTRUCT_ARRAY_DEF() that contains the logic shared by both. This macro
+// assigns the compile-time index of the field and declares its FieldSpec
+// (field_spec, which must be parenthesized if it contains commas), along with
+// the offset and pointer methods.
 //
 // The pointer method is disabled for the NoPtr template variant, as that
 // variant only calculates offsets.
-#define VARSTRUCT_DEF_COMMON(decl_type, name, array)                           \
+#define VARSTRUCT_DEF_COMMON(decl_type, name, field_spec, field_alignment,     \
+                             field_overlap)                                    \
   /* We disallow some problematic varstruct member names. */                   \
   static_assert(!varstruct_internal::EqualStrings(#name, "size_bytes"),        \
                 "Cannot name varstruct member 'size_bytes'");                  \
@@ -241,20 +2544,102 @@ constexpr bool EqualStrings(const char* a, const char* b) {
   static_assert(!varstruct_internal::EqualStrings(#name, "num_members"),       \
                 "Cannot name varstruct member 'num_members'");                 \
                                                                                \
-  /* The underlying type must be a plain-old data type, since we need to */    \
-  /* std::memcpy() to copy the type. */                                        \
-  static_assert(std::is_pod<decl_type>::value,                                 \
-                "Type '" #decl_type "' is not POD");                           \
+  static_assert(!varstruct_internal::EqualStrings(#name, "alignment"),         \
+                "Cannot name varstruct member 'alignment'");                   \
+                                                                               \
+  static_assert(!varstruct_internal::EqualStrings(#name, "schema"),            \
+                "Cannot name varstruct member 'schema'");                      \
+                                                                               \
+  static_assert(!varstruct_internal::EqualStrings(#name, "slice"),             \
+                "Cannot name varstruct member 'slice'");                       \
+                                                                               \
+ private:                                                                      \
+  /* The unique ascending index of this field, in declaration order. See */    \
+  /* varstruct_internal::Rank for how this is computed. */                     \
+  enum : std::size_t {                                                         \
+    __##name##_index__ = decltype(__varstruct_counter__(                       \
+        varstruct_internal::Rank<varstruct_internal::kMaxMembers>()))::value   \
+  };                                                                           \
+  static_assert(__##name##_index__ < varstruct_internal::kMaxMembers,          \
+                "Too many varstruct members");                                 \
+                                                                               \
+  /* Advances the field count for the next declaration. */                     \
+  static varstruct_internal::Index<__##name##_index__ + 1>                     \
+      __varstruct_counter__(                                                   \
+          varstruct_internal::Rank<__##name##_index__ + 1>);                   \
+                                                                               \
+  /* The alignment of the offset of this field, the number of bytes it */      \
+  /* shares with the previous field, and the indices of the first and */       \
+  /* last slots of the layout that this field uses (see */                     \
+  /* varstruct_internal::FieldSpec). */                                        \
+  enum : std::size_t {                                                         \
+    __##name##_alignment__ = field_alignment,                                  \
+    __##name##_overlap__ = field_overlap,                                      \
+    __##name##_first_slot__ = decltype(__varstruct_slots__(                    \
+        varstruct_internal::Index<__##name##_index__>()))::value,              \
+    __##name##_end_slot__ =                                                    \
+        __##name##_first_slot__ + (field_spec).num_slots - 1                   \
+  };                                                                           \
+                                                                               \
+  /* Advances the slot count for the next declaration. */                      \
+  static varstruct_internal::Index<__##name##_end_slot__ + 1>                  \
+      __varstruct_slots__(varstruct_internal::Index<__##name##_index__ + 1>);  \
+                                                                               \
+  /* This declaration allows Varstruct::Create() to read the size of the */    \
+  /* field, along with whether it is an array or not. */                       \
+  static constexpr varstruct_internal::FieldSpec __varstruct_field__(          \
+      varstruct_internal::Index<__##name##_index__>) {                         \
+    return varstruct_internal::PlacedSpec(field_spec, __##name##_alignment__,  \
+                                          __##name##_end_slot__,               \
+                                          __##name##_overlap__);               \
+  }                                                                            \
+                                                                               \
+  /* The name and declared type of this field, for ForEachField() and */       \
+  /* schema(). */                                                              \
+  static constexpr const char* __varstruct_name__(                             \
+      varstruct_internal::Index<__##name##_index__>) {                         \
+    return #name;                                                              \
+  }                                                                            \
+  static constexpr const char* __varstruct_type_name__(                        \
+      varstruct_internal::Index<__##name##_index__>) {                         \
+    return #decl_type;                                                         \
+  }                                                                            \
+  static decl_type* __varstruct_type__(                                        \
+      varstruct_internal::Index<__##name##_index__>);                          \
+                                                                               \
+  /* Fields are hashed unless VARSTRUCT_EXCLUDE_FROM_HASH() declares the */    \
+  /* overload taking Rank<1>. */                                               \
+  static constexpr bool __varstruct_hashed__(                                  \
+      varstruct_internal::Index<__##name##_index__>,                           \
+      varstruct_internal::Rank<0>) {                                           \
+    return true;                                                               \
+  }                                                                            \
+                                                                               \
+  /* Arrays may have any number of elements unless VARSTRUCT_MAX_COUNT() */    \
+  /* declares the overload taking Rank<1>. */                                  \
+  static constexpr std::size_t __varstruct_max_count__(                        \
+      varstruct_internal::Index<__##name##_index__>,                           \
+      varstruct_internal::Rank<0>) {                                           \
+    return varstruct_internal::kNoMaxCount;                                    \
+  }                                                                            \
+                                                                               \
+  friend struct varstruct_internal::FieldAccess;                               \
                                                                                \
  public:                                                                       \
   /* Returns the offset of a member in the Varstruct. This generated method */ \
   /* is always available, whether a pointer was provided to Create() or */     \
   /* not. */                                                                   \
-  std::size_t name##_offset() {                                                \
-    const std::size_t index = __##name##_member_.index();                      \
-    return (index == 0) ? 0 : this->offsets_[index - 1];                       \
+  constexpr std::size_t name##_offset() const {                                \
+    return varstruct_internal::AlignUp(                                        \
+               this->__varstruct_layout__().begin(__##name##_first_slot__),    \
+               __##name##_alignment__) -                                       \
+           __##name##_overlap__;                                               \
   }                                                                            \
                                                                                \
+  /* Returns the index of this field in declaration order, as passed to */     \
+  /* slice(). */                                                               \
+  static constexpr std::size_t name##_index() { return __##name##_index__; }   \
+                                                                               \
  private:                                                                      \
   /* Gets a void* or const void* to the given member, with an optional */      \
   /* array index. */                                                           \
@@ -263,59 +2648,106 @@ constexpr bool EqualStrings(const char* a, const char* b) {
   PtrType __##name##__void__ptr__(                                             \
       std::size_t array_index = 0,                                             \
       typename std::enable_if<!varstruct_internal::IsNoPtr<PtrType>::value,    \
-                              Dummy>::type* = 0) {                             \
+                              Dummy>::type* = 0) const {                       \
     if (bounds_check) {                                                        \
       const std::size_t array_elems = name##_size() / sizeof(decl_type);       \
+      VARSTRUCT_STATS_HOOK(if (array_index >= array_elems) {                   \
+        this->__varstruct_stats__().AddBoundsCheckFailure();                   \
+      })                                                                       \
       assert(array_index >= 0 && array_index < array_elems);                   \
     }                                                                          \
     return static_cast<                                                        \
                typename varstruct_internal::CharPtrType<PtrType>::type>(       \
                this->ptr_) +                                                   \
            name##_offset() + array_index * sizeof(decl_type);                  \
-  }                                                                            \
-                                                                               \
-  /* The declaration of the VarstructMember for this field. This */            \
-  /* declaration allows Varstruct::CreateInternal() to read the size of */     \
-  /* field, along with whether it is an array or not. */                       \
-  varstruct_internal::VarstructMember __##name##_member_{sizeof(decl_type),    \
-                                                         array, this};
+  }
+
+#define DEFINE_VARSTRUCT_INTERNAL(name) \
+  DEFINE_VARSTRUCT_ALIGNED_INTERNAL(name, varstruct_internal::kPacked)
 
-#define DEFINE_VARSTRUCT_INTERNAL(name)                                   \
+#define DEFINE_VARSTRUCT_ALIGNED_INTERNAL(name, min_alignment)            \
   /* Forward declare the user varstruct class and declare a using */      \
   /* statement. This allows the user to call their varstruct's static */  \
   /* methods without a template qualifier like <> at the end. */          \
-  template <typename PtrType = varstruct_internal::NoPtr>                 \
+  template <typename PtrType = varstruct_internal::NoPtr,                 \
+            typename LayoutType = varstruct_internal::SchemaOnly>         \
   class name##_template;                                                  \
   using name = name##_template<>;                                         \
                                                                           \
+  /* Names the varstruct, for schema() and the usage counters of */       \
+  /* varstruct_stats.h. */                                                \
+  struct name##_name_tag {                                                \
+    static constexpr const char* value() { return #name; }                \
+  };                                                                      \
+                                                                          \
   /* This is the beginning of the actual Varstruct definition that the */ \
   /* libary consumer will fill out. An open brace with the declared */    \
   /* members is expected to follow. We use a variant of the */            \
   /* curiously-recurring template pattern with template template */       \
   /* parameters to allow mutable pointer, const pointer, and  */          \
   /* pointerless (offsets-only) variants. User code should *NOT* */       \
-  /* manually specify its own PtrType. */                                 \
-  template <typename PtrType>                                             \
+  /* manually specify its own PtrType or LayoutType. */                   \
+  template <typename PtrType, typename LayoutType>                        \
   class name##_template                                                   \
-      : public varstruct_internal::Varstruct<name##_template, PtrType>
+      : public varstruct_internal::Varstruct<name##_template, PtrType,    \
+                                             LayoutType>,                 \
+        public varstruct_internal::FieldCounter<min_alignment,            \
+                                                name##_name_tag>
 
-#define VARSTRUCT_SCALAR_INTERNAL(decl_type, name)                             \
-  VARSTRUCT_DEF_COMMON(decl_type, name, false)                                 \
+// An internal macro called by VARSTRUCT_SCALAR_INTERNAL() and its byte order
+// variants that declares a scalar field in the given byte_order, along with its
+// accessors.
+#define VARSTRUCT_SCALAR_DEF(decl_type, name, byte_order)                      \
+  VARSTRUCT_DEF_COMMON(                                                        \
+      decl_type, name, varstruct_internal::ScalarSpec(sizeof(decl_type)),      \
+      varstruct_internal::FieldAlignment(__varstruct_alignment__,              \
+                                         alignof(decl_type)),                  \
+      0)                                                                       \
+  VARSTRUCT_ASSERT_POD(decl_type)                                              \
+                                                                               \
+  static_assert(                                                               \
+      std::is_same<byte_order, varstruct_internal::NativeByteOrder>::value ||  \
+          varstruct_internal::IsByteSwappable<decl_type>::value,               \
+      "Type '" #decl_type "' cannot be byte-swapped");                         \
+                                                                               \
+ private:                                                                      \
+  /* How the values of the field are stored, for schema(). */                  \
+  static constexpr varstruct_internal::FieldEncoding __varstruct_encoding__(   \
+      varstruct_internal::Index<__##name##_index__>) {                         \
+    return varstruct_internal::ByteOrderEncoding<byte_order>();                \
+  }                                                                            \
+                                                                               \
+  /* Reads the scalar at ptr, for VARSTRUCT_ARRAY_SIZED_BY() declarations */   \
+  /* that read their size from it. */                                          \
+  static std::size_t __##name##_read_count__(const char* ptr) {                \
+    return varstruct_internal::ReadCount<decl_type, byte_order>(ptr);          \
+  }                                                                            \
+                                                                               \
+  /* The type of the value of the scalar passed to Build(), and the */         \
+  /* function that writes it. */                                               \
+  static decl_type __varstruct_value__(                                        \
+      varstruct_internal::Index<__##name##_index__>);                          \
+  static void __varstruct_store__(                                             \
+      varstruct_internal::Index<__##name##_index__>, char* dst,                \
+      decl_type value) {                                                       \
+    varstruct_internal::StoreField<byte_order>(dst, value);                    \
+  }                                                                            \
                                                                                \
  public:                                                                       \
   /* Returns the total size in bytes of the scalar. */                         \
-  static std::size_t name##_size() { return sizeof(decl_type); }               \
+  static constexpr std::size_t name##_size() { return sizeof(decl_type); }     \
                                                                                \
   /* Reads from the scalar. We use enable_if to disable this method when */    \
   /* NoPtr is used. */                                                         \
   template <typename Dummy = char>                                             \
   decl_type name(                                                              \
       typename std::enable_if<!varstruct_internal::IsNoPtr<PtrType>::value,    \
-                              Dummy>::type* = 0) {                             \
+                              Dummy>::type* = 0) const {                       \
     constexpr bool kBoundsCheck = false;                                       \
-    decl_type tmp;                                                             \
-    std::memcpy(&tmp, __##name##__void__ptr__<kBoundsCheck>(), sizeof(tmp));   \
-    return tmp;                                                                \
+    VARSTRUCT_STATS_HOOK(this->__varstruct_stats__().AddFieldBytes(            \
+        __##name##_index__, sizeof(decl_type));)                               \
+    return varstruct_internal::LoadField<byte_order, decl_type>(               \
+        __##name##__void__ptr__<kBoundsCheck>());                              \
   }                                                                            \
                                                                                \
   /* Writes to the scalar. We use enable_if to disable this method when */     \
@@ -328,22 +2760,222 @@ constexpr bool EqualStrings(const char* a, const char* b) {
                                       PtrType>::type>::value,                  \
                               Dummy>::type* = 0) {                             \
     constexpr bool kBoundsCheck = false;                                       \
-    std::memcpy(__##name##__void__ptr__<kBoundsCheck>(), &new_value,           \
-                sizeof(new_value));                                            \
+    VARSTRUCT_STATS_HOOK(this->__varstruct_stats__().AddFieldBytes(            \
+        __##name##_index__, sizeof(decl_type));)                               \
+    varstruct_internal::StoreField<byte_order>(                                \
+        __##name##__void__ptr__<kBoundsCheck>(), new_value);                   \
+  }                                                                            \
+                                                                               \
+  /* Reads the scalar of each of count varstructs with this layout, stored */  \
+  /* stride bytes apart starting at records, into the array out. */            \
+  void name##_gather(const void* records, std::size_t stride,                  \
+                     std::size_t count, decl_type* out) const {                \
+    VARSTRUCT_STATS_HOOK(this->__varstruct_stats__().AddFieldBytes(            \
+        __##name##_index__, count * sizeof(decl_type));)                       \
+    varstruct_internal::GatherField<byte_order>(                               \
+        static_cast<const char*>(records) + name##_offset(), stride, count,    \
+        out);                                                                  \
+  }                                                                            \
+                                                                               \
+  /* As above, for varstructs stored back to back. */                          \
+  void name##_gather(const void* records, std::size_t count, decl_type* out)   \
+      const {                                                                  \
+    name##_gather(records, this->size_bytes(), count, out);                    \
+  }
+
+#define VARSTRUCT_SCALAR_INTERNAL(decl_type, name) \
+  VARSTRUCT_SCALAR_DEF(decl_type, name, varstruct_internal::NativeByteOrder)
+
+#define VARSTRUCT_SCALAR_BE_INTERNAL(decl_type, name) \
+  VARSTRUCT_SCALAR_DEF(decl_type, name, varstruct_internal::BigEndianByteOrder)
+
+#define VARSTRUCT_SCALAR_LE_INTERNAL(decl_type, name) \
+  VARSTRUCT_SCALAR_DEF(decl_type, name,               \
+                       varstruct_internal::LittleEndianByteOrder)
+
+// True if the VARSTRUCT_BITS() field name of type decl_type and the given
+// width is packed into the storage word of the previous field.
+#define VARSTRUCT_SHARES_BITS(decl_type, name, width)                    \
+  (varstruct_internal::SharesBits<                                       \
+      decltype(__varstruct_bits__(                                       \
+          varstruct_internal::Rank<varstruct_internal::kMaxMembers>())), \
+      decl_type>(__##name##_index__, width))
+
+// An internal macro called by VARSTRUCT_BITS_INTERNAL() and its byte order
+// variants that declares a field of the given width in bits, stored in a word
+// of type decl_type in the given byte_order, along with its accessors. Bits
+// are assigned from the most significant bit of the word down, and the field
+// starts a new word unless it fits in the rest of the word of the previous
+// field (see varstruct_internal::SharesBits()). A field sharing a word is
+// placed at the offset of the word and overlaps it entirely.
+#define VARSTRUCT_BITS_DEF(decl_type, name, width, byte_order)                 \
+  VARSTRUCT_DEF_COMMON(                                                        \
+      decl_type, name, varstruct_internal::ScalarSpec(sizeof(decl_type)),      \
+      (VARSTRUCT_SHARES_BITS(decl_type, name, width)                           \
+           ? 1                                                                 \
+           : varstruct_internal::FieldAlignment(__varstruct_alignment__,       \
+                                                alignof(decl_type))),          \
+      (VARSTRUCT_SHARES_BITS(decl_type, name, width) ? sizeof(decl_type)       \
+                                                     : 0))                     \
+                                                                               \
+  static_assert(std::is_integral<decl_type>::value &&                          \
+                    std::is_unsigned<decl_type>::value,                        \
+                "Bits must be stored in an unsigned integral type");           \
+  static_assert(width >= 1 && width <= 8 * sizeof(decl_type),                  \
+                "Bits must fit in their type");                                \
+  static_assert(                                                               \
+      std::is_same<byte_order, varstruct_internal::NativeByteOrder>::value ||  \
+          varstruct_internal::IsByteSwappable<decl_type>::value,               \
+      "Type '" #decl_type "' cannot be byte-swapped");                         \
+                                                                               \
+ private:                                                                      \
+  /* The first bit of the word used by this field, counted from the most */    \
+  /* significant bit, and the shift of the field from the least */             \
+  /* significant bit. */                                                       \
+  enum : std::size_t {                                                         \
+    __##name##_bit_begin__ =                                                   \
+        VARSTRUCT_SHARES_BITS(decl_type, name, width)                          \
+            ? static_cast<std::size_t>(decltype(__varstruct_bits__(            \
+                  varstruct_internal::Rank<                                    \
+                      varstruct_internal::kMaxMembers>()))::kEnd)              \
+            : std::size_t{0},                                                  \
+    __##name##_shift__ = 8 * sizeof(decl_type) - __##name##_bit_begin__ -      \
+                         (width)                                               \
+  };                                                                           \
+                                                                               \
+  /* How the values of the field are stored, for schema(). */                  \
+  static constexpr varstruct_internal::FieldEncoding __varstruct_encoding__(   \
+      varstruct_internal::Index<__##name##_index__>) {                         \
+    return varstruct_internal::FieldEncoding{                                  \
+        varstruct_internal::ByteOrderEncoding<byte_order>().big_endian,        \
+        __##name##_shift__, (width)};                                          \
+  }                                                                            \
+                                                                               \
+  /* Advances the bit position for the next declaration. */                    \
+  static varstruct_internal::BitPosition<                                      \
+      __##name##_index__, sizeof(decl_type), __##name##_bit_begin__ + (width)> \
+      __varstruct_bits__(varstruct_internal::Rank<__##name##_index__ + 1>);    \
+                                                                               \
+  /* Reads the field from its word at ptr, for VARSTRUCT_ARRAY_SIZED_BY() */   \
+  /* declarations that read their size from it. */                             \
+  static std::size_t __##name##_read_count__(const char* ptr) {                \
+    return varstruct_internal::ReadBitsCount<decl_type, byte_order,            \
+                                             __##name##_shift__, width>(ptr);  \
+  }                                                                            \
+                                                                               \
+  /* The type of the value of the field passed to Build(), and the */          \
+  /* function that writes it. The first field of each word writes all of */    \
+  /* it, so that bits not used by any field are zero. */                       \
+  static decl_type __varstruct_value__(                                        \
+      varstruct_internal::Index<__##name##_index__>);                          \
+  static void __varstruct_store__(                                             \
+      varstruct_internal::Index<__##name##_index__>, char* dst,                \
+      decl_type value) {                                                       \
+    if (__##name##_bit_begin__ == 0) {                                         \
+      varstruct_internal::StoreField<byte_order>(dst, decl_type{0});           \
+    }                                                                          \
+    varstruct_internal::StoreBits<byte_order>(dst, value, __##name##_shift__,  \
+                                              width);                          \
+  }                                                                            \
+                                                                               \
+ public:                                                                       \
+  /* Returns the size in bytes of the word holding the field. */               \
+  static constexpr std::size_t name##_size() { return sizeof(decl_type); }     \
+                                                                               \
+  /* Returns the width in bits of the field. */                                \
+  static constexpr std::size_t name##_width() { return width; }                \
+                                                                               \
+  /* Reads the field. We use enable_if to disable this method when NoPtr */    \
+  /* is used. */                                                               \
+  template <typename Dummy = char>                                             \
+  decl_type name(                                                              \
+      typename std::enable_if<!varstruct_internal::IsNoPtr<PtrType>::value,    \
+                              Dummy>::type* = 0) const {                       \
+    constexpr bool kBoundsCheck = false;                                       \
+    VARSTRUCT_STATS_HOOK(this->__varstruct_stats__().AddFieldBytes(            \
+        __##name##_index__, sizeof(decl_type));)                               \
+    return varstruct_internal::LoadBits<byte_order, decl_type>(                \
+        __##name##__void__ptr__<kBoundsCheck>(), __##name##_shift__, width);   \
+  }                                                                            \
+                                                                               \
+  /* Writes the field, leaving the other bits of its word unchanged. */        \
+  /* new_value must fit in width bits. We use enable_if to disable this */     \
+  /* method when NoPtr is used or if the pointer was to const. */              \
+  template <typename Dummy = char>                                             \
+  void set_##name(                                                             \
+      decl_type new_value,                                                     \
+      typename std::enable_if<                                                 \
+          !varstruct_internal::IsNoPtr<PtrType>::value &&                      \
+              !std::is_const<typename std::remove_pointer<                     \
+                  PtrType>::type>::value,                                      \
+          Dummy>::type* = 0) {                                                 \
+    constexpr bool kBoundsCheck = false;                                       \
+    VARSTRUCT_STATS_HOOK(this->__varstruct_stats__().AddFieldBytes(            \
+        __##name##_index__, sizeof(decl_type));)                               \
+    varstruct_internal::StoreBits<byte_order>(                                 \
+        __##name##__void__ptr__<kBoundsCheck>(), new_value,                    \
+        __##name##_shift__, width);                                            \
   }
 
-#define VARSTRUCT_ARRAY_INTERNAL(decl_type, name)                              \
-  VARSTRUCT_DEF_COMMON(decl_type, name, true)                                  \
+#define VARSTRUCT_BITS_INTERNAL(decl_type, name, width) \
+  VARSTRUCT_BITS_DEF(decl_type, name, width,            \
+                     varstruct_internal::NativeByteOrder)
+
+#define VARSTRUCT_BITS_BE_INTERNAL(decl_type, name, width) \
+  VARSTRUCT_BITS_DEF(decl_type, name, width,               \
+                     varstruct_internal::BigEndianByteOrder)
+
+#define VARSTRUCT_BITS_LE_INTERNAL(decl_type, name, width) \
+  VARSTRUCT_BITS_DEF(decl_type, name, width,               \
+                     varstruct_internal::LittleEndianByteOrder)
+
+// An internal macro called by VARSTRUCT_ARRAY_INTERNAL(), its byte order
+// variants and VARSTRUCT_ARRAY_SIZED_BY_INTERNAL() that declares an array field
+// with the given FieldSpec and elements in the given byte_order, along with its
+// accessors.
+#define VARSTRUCT_ARRAY_DEF(decl_type, name, field_spec, byte_order)           \
+  VARSTRUCT_DEF_COMMON(                                                        \
+      decl_type, name, field_spec,                                             \
+      varstruct_internal::FieldAlignment(__varstruct_alignment__,              \
+                                         alignof(decl_type)),                  \
+      0)                                                                       \
+  VARSTRUCT_ASSERT_POD(decl_type)                                              \
+                                                                               \
+  static_assert(                                                               \
+      std::is_same<byte_order, varstruct_internal::NativeByteOrder>::value ||  \
+          varstruct_internal::IsByteSwappable<decl_type>::value,               \
+      "Type '" #decl_type "' cannot be byte-swapped");                         \
+                                                                               \
+ private:                                                                      \
+  /* How the values of the field are stored, for schema(). */                  \
+  static constexpr varstruct_internal::FieldEncoding __varstruct_encoding__(   \
+      varstruct_internal::Index<__##name##_index__>) {                         \
+    return varstruct_internal::ByteOrderEncoding<byte_order>();                \
+  }                                                                            \
+                                                                               \
+  /* The type of the value of the array passed to Build(), the function */     \
+  /* that writes it, and the one that returns its bytes if they need no */     \
+  /* conversion. */                                                            \
+  static varstruct_internal::ArrayValue<decl_type> __varstruct_value__(        \
+      varstruct_internal::Index<__##name##_index__>);                          \
+  static void __varstruct_store__(                                             \
+      varstruct_internal::Index<__##name##_index__>, char* dst,                \
+      const varstruct_internal::ArrayValue<decl_type>& value) {                \
+    varstruct_internal::StoreArray<byte_order>(dst, value.data(),              \
+                                               value.size());                  \
+  }                                                                            \
+  static const void* __varstruct_bytes__(                                      \
+      varstruct_internal::Index<__##name##_index__>,                           \
+      const varstruct_internal::ArrayValue<decl_type>& value) {                \
+    return (sizeof(decl_type) == 1 || !byte_order::kSwap) ? value.data()       \
+                                                          : nullptr;           \
+  }                                                                            \
                                                                                \
  public:                                                                       \
   /* Returns the total size in bytes of all array elements. */                 \
-  std::size_t name##_size() {                                                  \
-    const std::size_t index = __##name##_member_.index();                      \
-    if (index == 0) {                                                          \
-      return this->offsets_[index];                                            \
-    } else {                                                                   \
-      return this->offsets_[index] - this->offsets_[index - 1];                \
-    }                                                                          \
+  constexpr std::size_t name##_size() const {                                  \
+    return this->__varstruct_layout__().end(__##name##_end_slot__) -           \
+           name##_offset();                                                    \
   }                                                                            \
                                                                                \
   /* Reads and returns an element of the array. Performs bounds checking if */ \
@@ -353,11 +2985,11 @@ constexpr bool EqualStrings(const char* a, const char* b) {
   decl_type name(                                                              \
       std::size_t array_index,                                                 \
       typename std::enable_if<!varstruct_internal::IsNoPtr<PtrType>::value,    \
-                              Dummy>::type* = 0) {                             \
-    decl_type tmp;                                                             \
-    std::memcpy(&tmp, __##name##__void__ptr__<bounds_check>(array_index),      \
-                sizeof(tmp));                                                  \
-    return tmp;                                                                \
+                              Dummy>::type* = 0) const {                       \
+    VARSTRUCT_STATS_HOOK(this->__varstruct_stats__().AddFieldBytes(            \
+        __##name##_index__, sizeof(decl_type));)                               \
+    return varstruct_internal::LoadField<byte_order, decl_type>(               \
+        __##name##__void__ptr__<bounds_check>(array_index));                   \
   }                                                                            \
                                                                                \
   /* Writes to an element of the array. Performs bounds checking if */         \
@@ -371,8 +3003,251 @@ constexpr bool EqualStrings(const char* a, const char* b) {
                                   !std::is_const<typename std::remove_pointer< \
                                       PtrType>::type>::value,                  \
                               Dummy>::type* = 0) {                             \
-    std::memcpy(__##name##__void__ptr__<bounds_check>(array_index),            \
-                &new_value, sizeof(new_value));                                \
+    VARSTRUCT_STATS_HOOK(this->__varstruct_stats__().AddFieldBytes(            \
+        __##name##_index__, sizeof(decl_type));)                               \
+    varstruct_internal::StoreField<byte_order>(                                \
+        __##name##__void__ptr__<bounds_check>(array_index), new_value);        \
+  }                                                                            \
+                                                                               \
+  /* Copies count elements starting at first into dst with one */              \
+  /* std::memcpy() (followed by a vectorizable byte swap loop, for arrays */   \
+  /* not in host byte order). Performs a single range check if the */          \
+  /* bounds_check template parameter is true (defaults to true). We use */     \
+  /* enable_if to disable this method when NoPtr is used. */                   \
+  template <bool bounds_check = true, typename Dummy = char>                   \
+  void name##_copy_to(                                                         \
+      decl_type* dst, std::size_t first, std::size_t count,                    \
+      typename std::enable_if<!varstruct_internal::IsNoPtr<PtrType>::value,    \
+                              Dummy>::type* = 0) const {                       \
+    if (bounds_check) {                                                        \
+      const std::size_t array_elems = name##_size() / sizeof(decl_type);       \
+      VARSTRUCT_STATS_HOOK(if (first > array_elems ||                          \
+                               count > array_elems - first) {                  \
+        this->__varstruct_stats__().AddBoundsCheckFailure();                   \
+      })                                                                       \
+      assert(first <= array_elems && count <= array_elems - first);            \
+    }                                                                          \
+    VARSTRUCT_STATS_HOOK(this->__varstruct_stats__().AddFieldBytes(            \
+        __##name##_index__, count * sizeof(decl_type));)                       \
+    constexpr bool kBoundsCheck = false;                                       \
+    varstruct_internal::LoadArray<byte_order>(                                 \
+        dst, __##name##__void__ptr__<kBoundsCheck>(first), count);             \
+  }                                                                            \
+                                                                               \
+  /* Copies count elements from src into the array starting at first with */   \
+  /* one std::memcpy() (or a vectorizable byte swap loop, for arrays not */    \
+  /* in host byte order). Performs a single range check if the */              \
+  /* bounds_check template parameter is true (defaults to true). We use */     \
+  /* enable_if to disable this method when NoPtr is used or if the pointer */  \
+  /* was to const. */                                                          \
+  template <bool bounds_check = true, typename Dummy = char>                   \
+  void set_##name##_from(                                                      \
+      const decl_type* src, std::size_t first, std::size_t count,              \
+      typename std::enable_if<!varstruct_internal::IsNoPtr<PtrType>::value &&  \
+                                  !std::is_const<typename std::remove_pointer< \
+                                      PtrType>::type>::value,                  \
+                              Dummy>::type* = 0) {                             \
+    if (bounds_check) {                                                        \
+      const std::size_t array_elems = name##_size() / sizeof(decl_type);       \
+      VARSTRUCT_STATS_HOOK(if (first > array_elems ||                          \
+                               count > array_elems - first) {                  \
+        this->__varstruct_stats__().AddBoundsCheckFailure();                   \
+      })                                                                       \
+      assert(first <= array_elems && count <= array_elems - first);            \
+    }                                                                          \
+    VARSTRUCT_STATS_HOOK(this->__varstruct_stats__().AddFieldBytes(            \
+        __##name##_index__, count * sizeof(decl_type));)                       \
+    constexpr bool kBoundsCheck = false;                                       \
+    varstruct_internal::StoreArray<byte_order>(                                \
+        __##name##__void__ptr__<kBoundsCheck>(first), src, count);             \
+  }                                                                            \
+                                                                               \
+  /* Returns a view of the bytes of the whole array, without copying. The */   \
+  /* view is of const char if the pointer was to const, and of char */         \
+  /* otherwise. We use enable_if to disable this method when NoPtr is used. */ \
+  template <typename Dummy = char>                                             \
+  varstruct_internal::Span<typename std::remove_pointer<                       \
+      typename varstruct_internal::CharPtrType<PtrType>::type>::type>          \
+      name##_bytes(                                                            \
+          typename std::enable_if<                                             \
+              !varstruct_internal::IsNoPtr<PtrType>::value, Dummy>::type* =    \
+              0) const {                                                       \
+    constexpr bool kBoundsCheck = false;                                       \
+    VARSTRUCT_STATS_HOOK(this->__varstruct_stats__().AddFieldBytes(            \
+        __##name##_index__, name##_size());)                                   \
+    return {static_cast<typename varstruct_internal::CharPtrType<              \
+                PtrType>::type>(__##name##__void__ptr__<kBoundsCheck>()),      \
+            name##_size()};                                                    \
+  }                                                                            \
+                                                                               \
+  /* Returns a typed view of the elements of the whole array, without */       \
+  /* copying. As Varstruct adds no padding, elements are only suitably */      \
+  /* aligned for direct access if alignof(decl_type) is 1; otherwise, the */   \
+  /* caller must assert that the array is aligned with the assume_aligned */   \
+  /* template parameter (this is checked in debug builds). Elements are */     \
+  /* not converted, so this is only available for arrays in host byte */       \
+  /* order. We use enable_if to disable this method when NoPtr is used. */     \
+  template <bool assume_aligned = false, typename Dummy = char>                \
+  varstruct_internal::Span<typename std::remove_pointer<                       \
+      typename varstruct_internal::ElementPtrType<PtrType,                     \
+                                                  decl_type>::type>::type>     \
+      name##_span(                                                             \
+          typename std::enable_if<                                             \
+              !varstruct_internal::IsNoPtr<PtrType>::value, Dummy>::type* =    \
+              0) const {                                                       \
+    static_assert(alignof(decl_type) == 1 ||                                   \
+                      __##name##_alignment__ >= alignof(decl_type) ||          \
+                      assume_aligned,                                          \
+                  "Elements of '" #name "' may be misaligned; use "            \
+                  #name "_span</*assume_aligned=*/true>()");                   \
+    static_assert(                                                             \
+        std::is_same<byte_order,                                               \
+                     varstruct_internal::NativeByteOrder>::value ||            \
+            sizeof(decl_type) == 1 ||                                          \
+            varstruct_internal::AlwaysFalse<Dummy>::value,                     \
+        "Elements of '" #name "' are not in host byte order");                 \
+    constexpr bool kBoundsCheck = false;                                       \
+    VARSTRUCT_STATS_HOOK(this->__varstruct_stats__().AddFieldBytes(            \
+        __##name##_index__, name##_size());)                                   \
+    const PtrType elems = __##name##__void__ptr__<kBoundsCheck>();             \
+    assert(reinterpret_cast<std::uintptr_t>(elems) % alignof(decl_type) == 0); \
+    return {static_cast<typename varstruct_internal::ElementPtrType<           \
+                PtrType, decl_type>::type>(elems),                             \
+            name##_size() / sizeof(decl_type)};                                \
+  }
+
+#define VARSTRUCT_ARRAY_INTERNAL(decl_type, name)                       \
+  VARSTRUCT_ARRAY_DEF(decl_type, name,                                  \
+                      varstruct_internal::ArraySpec(sizeof(decl_type)), \
+                      varstruct_internal::NativeByteOrder)
+
+#define VARSTRUCT_ARRAY_BE_INTERNAL(decl_type, name)                    \
+  VARSTRUCT_ARRAY_DEF(decl_type, name,                                  \
+                      varstruct_internal::ArraySpec(sizeof(decl_type)), \
+                      varstruct_internal::BigEndianByteOrder)
+
+#define VARSTRUCT_ARRAY_LE_INTERNAL(decl_type, name)                    \
+  VARSTRUCT_ARRAY_DEF(decl_type, name,                                  \
+                      varstruct_internal::ArraySpec(sizeof(decl_type)), \
+                      varstruct_internal::LittleEndianByteOrder)
+
+#define VARSTRUCT_ARRAY_SIZED_BY_INTERNAL(decl_type, name, size_name)      \
+  /* size_name must name an earlier VARSTRUCT_SCALAR() or */               \
+  /* VARSTRUCT_BITS() declaration. */                                      \
+  VARSTRUCT_ARRAY_DEF(                                                     \
+      decl_type, name,                                                     \
+      (varstruct_internal::SizedArraySpec(sizeof(decl_type),               \
+                                          __##size_name##_index__,         \
+                                          &__##size_name##_read_count__)), \
+      varstruct_internal::NativeByteOrder)
+
+#define VARSTRUCT_TRAILING_ARRAY_INTERNAL(decl_type, name)   \
+  VARSTRUCT_ARRAY_DEF(decl_type, name,                       \
+                      varstruct_internal::TrailingArraySpec( \
+                          sizeof(decl_type)),                \
+                      varstruct_internal::NativeByteOrder)
+
+#define VARSTRUCT_EXCLUDE_FROM_HASH_INTERNAL(name)                 \
+ private:                                                          \
+  /* Overrides the overload declared by VARSTRUCT_DEF_COMMON(). */ \
+  static constexpr bool __varstruct_hashed__(                      \
+      varstruct_internal::Index<__##name##_index__>,               \
+      varstruct_internal::Rank<1>) {                               \
+    return false;                                                  \
+  }                                                                \
+                                                                   \
+ public:
+
+#define VARSTRUCT_MAX_COUNT_INTERNAL(name, max_count)              \
+ private:                                                          \
+  /* Overrides the overload declared by VARSTRUCT_DEF_COMMON(). */ \
+  static constexpr std::size_t __varstruct_max_count__(            \
+      varstruct_internal::Index<__##name##_index__>,               \
+      varstruct_internal::Rank<1>) {                               \
+    return max_count;                                              \
+  }                                                                \
+                                                                   \
+ public:
+
+// An internal macro called by VARSTRUCT_NESTED_INTERNAL() and
+// VARSTRUCT_NESTED_ARRAY_INTERNAL() that declares a field holding a varstruct
+// of type nested_type, or an array of them if is_array is true.
+#define VARSTRUCT_NESTED_DEF(nested_type, name, is_array)                    \
+  VARSTRUCT_DEF_COMMON(                                                      \
+      nested_type, name,                                                     \
+      varstruct_internal::NestedSpec<nested_type>(is_array),                 \
+      varstruct_internal::NestedAlignment(__varstruct_alignment__,           \
+                                          nested_type::alignment()),         \
+      0)                                                                     \
+                                                                             \
+  static_assert(                                                             \
+      varstruct_internal::CountTrailingArrays(                               \
+          varstruct_internal::FieldTable<nested_type>::kFields,              \
+          varstruct_internal::FieldTable<nested_type>::kNumFields) == 0,     \
+      "Nested varstructs cannot have a VARSTRUCT_TRAILING_ARRAY()");         \
+                                                                             \
+ private:                                                                    \
+  /* How the values of the field are stored, for schema(). */                \
+  static constexpr varstruct_internal::FieldEncoding __varstruct_encoding__( \
+      varstruct_internal::Index<__##name##_index__>) {                       \
+    return varstruct_internal::ByteOrderEncoding<                            \
+        varstruct_internal::NativeByteOrder>();                              \
+  }                                                                          \
+                                                                             \
+  /* Nested varstructs cannot be passed to Build(). */                       \
+  static varstruct_internal::NestedValue __varstruct_value__(                \
+      varstruct_internal::Index<__##name##_index__>);                        \
+                                                                             \
+  /* Returns a view of the nested varstruct at offset, which shares the */   \
+  /* offsets stored in the layout of this varstruct. */                      \
+  decltype(nested_type::__varstruct_nested__(std::declval<PtrType>(),        \
+                                             nullptr))                       \
+      __##name##_view__(std::size_t offset) const {                          \
+    return nested_type::__varstruct_nested__(                                \
+        varstruct_internal::OffsetPtr(this->ptr_, offset),                   \
+        this->__varstruct_layout__().slots() + __##name##_first_slot__);     \
+  }                                                                          \
+                                                                             \
+ public:                                                                     \
+  /* Returns the total size in bytes of the nested varstruct (or of all */   \
+  /* of the array elements). */                                              \
+  constexpr std::size_t name##_size() const {                                \
+    return this->__varstruct_layout__().end(__##name##_end_slot__) -         \
+           name##_offset();                                                  \
+  }
+
+#define VARSTRUCT_NESTED_INTERNAL(nested_type, name)                         \
+  VARSTRUCT_NESTED_DEF(nested_type, name, false)                             \
+                                                                             \
+ public:                                                                     \
+  /* Returns a view of the nested varstruct, with a pointer into this one */ \
+  /* if any. */                                                              \
+  decltype(nested_type::__varstruct_nested__(std::declval<PtrType>(),        \
+                                             nullptr))                       \
+      name() const {                                                         \
+    return __##name##_view__(name##_offset());                               \
+  }
+
+#define VARSTRUCT_NESTED_ARRAY_INTERNAL(nested_type, name)               \
+  VARSTRUCT_NESTED_DEF(nested_type, name, true)                          \
+                                                                         \
+ public:                                                                 \
+  /* Returns a view of the 0-indexed element of the array given by */    \
+  /* array_index. */                                                     \
+  template <bool bounds_check = true>                                    \
+  decltype(nested_type::__varstruct_nested__(std::declval<PtrType>(),    \
+                                             nullptr))                   \
+      name(std::size_t array_index) const {                              \
+    const std::size_t elem_size = __##name##_view__(0).size_bytes();     \
+    if (bounds_check) {                                                  \
+      const std::size_t array_elems =                                    \
+          (elem_size == 0) ? 0 : name##_size() / elem_size;              \
+      VARSTRUCT_STATS_HOOK(if (array_index >= array_elems) {             \
+        this->__varstruct_stats__().AddBoundsCheckFailure();             \
+      })                                                                 \
+      assert(array_index >= 0 && array_index < array_elems);             \
+    }                                                                    \
+    return __##name##_view__(name##_offset() + array_index * elem_size); \
   }
 
 #endif  // VARSTRUCT_VARSTRUCT_INTERNAL_H_
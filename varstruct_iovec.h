@@ -0,0 +1,234 @@
+// Copyright 2017 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// VarstructIovec builds a varstruct as a list of iovecs for writev(),
+// sendmsg() or io_uring, rather than into one buffer, so that large arrays are
+// sent from where they already are instead of being copied into the record:
+//
+// VarstructIovec<Packet> packet;
+// if (!packet.Build(type, sequence, payload)) return kTooManySegments;
+// ::writev(fd, packet.iov(), packet.iovcnt());
+//
+// Build() takes the value of every field in declaration order, like
+// Varstruct::Build(), and writes the scalars, the small arrays and the padding
+// between fields into an inline buffer of kInlineBytes bytes, in runs that
+// each make up one iovec. Arrays of at least min_ref_bytes bytes (given to the
+// constructor) whose elements are stored as-is get their own iovec, which
+// points at the memory of their value; those values must outlive the iovecs.
+// Arrays whose bytes must be swapped, as declared by VARSTRUCT_ARRAY_BE() or
+// VARSTRUCT_ARRAY_LE(), are always copied.
+//
+// The iovecs point into the VarstructIovec, which therefore cannot be copied
+// or moved. Build() may be called again to build another record.
+//
+// This header requires POSIX <sys/uio.h>. Varstructs with VARSTRUCT_NESTED()
+// fields are not supported, as by Varstruct::Build().
+
+#ifndef VARSTRUCT_VARSTRUCT_IOVEC_H_
+#define VARSTRUCT_VARSTRUCT_IOVEC_H_
+
+#include <sys/uio.h>
+
+#include <array>
+#include <cstddef>
+#include <cstring>
+
+#include "varstruct.h"
+
+template <typename Varstruct, std::size_t kInlineBytes = 256,
+          std::size_t kMaxIovecs = 8>
+class VarstructIovec {
+  using Table = varstruct_internal::FieldTable<Varstruct>;
+  static constexpr std::size_t kNumSlots =
+      varstruct_internal::FieldAccess::NumSlots<Varstruct>();
+
+  static_assert(kNumSlots == Table::kNumFields,
+                "VarstructIovec does not support VARSTRUCT_NESTED() fields");
+
+ public:
+  explicit VarstructIovec(std::size_t min_ref_bytes = 64)
+      : min_ref_bytes_(min_ref_bytes), iovcnt_(0), size_(0) {}
+
+  VarstructIovec(const VarstructIovec&) = delete;
+  VarstructIovec& operator=(const VarstructIovec&) = delete;
+
+  // Builds the iovecs of a varstruct with the given field values. Returns
+  // false, leaving no iovecs, if the copied bytes do not fit in kInlineBytes,
+  // more than kMaxIovecs iovecs would be needed, an array exceeds its
+  // VARSTRUCT_MAX_COUNT(), or a count field does not hold the size of its
+  // VARSTRUCT_ARRAY_SIZED_BY() array, as for Varstruct::Build().
+  template <typename... Values>
+  bool Build(const Values&... values) {
+    static_assert(sizeof...(Values) == Table::kNumFields,
+                  "Wrong number of field values");
+    return BuildInternal(typename varstruct_internal::MakeIndexSequence<
+                             sizeof...(Values)>::type(),
+                         values...);
+  }
+
+  // The iovecs built by the last successful Build().
+  const struct iovec* iov() const { return iov_.data(); }
+  int iovcnt() const { return static_cast<int>(iovcnt_); }
+
+  // The total size of the varstruct, as returned by its size_bytes().
+  std::size_t size_bytes() const { return size_; }
+
+ private:
+  // The state of Build() as it writes the fields in order: every byte of the
+  // varstruct before pos has been added, and the current run of bytes in
+  // inline_, which are not yet in an iovec, starts at the offset run_start of
+  // the varstruct and the offset run_inline of inline_.
+  struct Cursor {
+    bool ok;
+    std::size_t pos;
+    std::size_t run_start;
+    std::size_t run_inline;
+  };
+
+  // Converting each value to the type of its field here, rather than in
+  // Build(), lets Build() deduce the types of the values it is passed.
+  template <std::size_t... Is>
+  bool BuildInternal(
+      varstruct_internal::IndexSequence<Is...>,
+      const varstruct_internal::FieldAccess::Value<Varstruct, Is>&... values) {
+    const std::size_t counts[] = {varstruct_internal::ElementCount(values)...,
+                                  0};
+    const std::size_t stored_counts[] = {
+        varstruct_internal::StoredCount<Varstruct>(
+            varstruct_internal::Index<Is>(), values)...,
+        0};
+    std::array<std::size_t, Table::kNumFields + 1> array_sizes;
+    const std::size_t num_array_sizes =
+        varstruct_internal::CollectArraySizes<Varstruct>(counts,
+                                                         array_sizes.data());
+    std::array<std::size_t, kNumSlots + 1> offsets;
+    iovcnt_ = 0;
+    size_ = 0;
+    if (!varstruct_internal::CountFieldsMatch<Varstruct>(counts,
+                                                         stored_counts) ||
+        !varstruct_internal::ComputeOffsets<Varstruct>(
+            nullptr, varstruct_internal::kUnknownBufferLen,
+            varstruct_internal::ArraySizes(array_sizes.data(),
+                                           num_array_sizes),
+            offsets.data())) {
+      return false;
+    }
+    const varstruct_internal::SharedOffsets<kNumSlots> layout(offsets.data());
+
+    size_ = varstruct_internal::AlignUp(layout.size_bytes(),
+                                        Varstruct::alignment());
+    Cursor cursor = {true, 0, 0, 0};
+    // C++11 has no fold expressions, so expand the fields in an initializer.
+    const int fields[] = {
+        0, (AddField(varstruct_internal::Index<Is>(), layout, values, &cursor),
+            0)...};
+    (void)fields;
+    // The padding at the end, up to alignment().
+    AddPadding(size_, &cursor);
+    FlushRun(&cursor);
+    if (!cursor.ok) {
+      iovcnt_ = 0;
+      size_ = 0;
+    }
+    return cursor.ok;
+  }
+
+  template <std::size_t I>
+  void AddField(
+      varstruct_internal::Index<I> index,
+      const varstruct_internal::SharedOffsets<kNumSlots>& layout,
+      const varstruct_internal::FieldAccess::Value<Varstruct, I>& value,
+      Cursor* cursor) {
+    if (!cursor->ok) {
+      return;
+    }
+    const varstruct_internal::FieldSpec& field = Table::kFields[I];
+    const std::size_t offset = varstruct_internal::FieldOffset(field, layout);
+    const std::size_t end = layout.end(field.end_slot);
+    const void* bytes =
+        varstruct_internal::FieldAccess::Bytes<Varstruct>(index, value);
+    if (bytes != nullptr && end != offset && end - offset >= min_ref_bytes_) {
+      AddPadding(offset, cursor);
+      FlushRun(cursor);
+      AddIovec(bytes, end - offset, cursor);
+      cursor->pos = cursor->run_start = end;
+      return;
+    }
+    // The field is stored inline, and must fit in inline_. VARSTRUCT_BITS()
+    // fields packed into the word of the previous field end where it does,
+    // and are written into the word in place, so this holds for them already;
+    // it is checked on both paths, with the size of scalars known at compile
+    // time, so that the compiler sees the bound of the store.
+    const std::size_t inline_begin =
+        cursor->run_inline + offset - cursor->run_start;
+    const std::size_t size =
+        (field.is_array || field.compute_nested != nullptr) ? end - offset
+                                                            : field.elem_size;
+    if (inline_begin > kInlineBytes || size > kInlineBytes - inline_begin) {
+      cursor->ok = false;
+      return;
+    }
+    if (end > cursor->pos) {
+      AddPadding(offset, cursor);
+      cursor->pos = end;
+    }
+    varstruct_internal::FieldAccess::Store<Varstruct>(
+        index, inline_ + inline_begin, value);
+  }
+
+  // Zeroes the bytes from pos up to end, which is at most kInlineBytes past
+  // the start of the run.
+  void AddPadding(std::size_t end, Cursor* cursor) {
+    if (!cursor->ok || end <= cursor->pos) {
+      return;
+    }
+    if (cursor->run_inline + end - cursor->run_start > kInlineBytes) {
+      cursor->ok = false;
+      return;
+    }
+    std::memset(inline_ + cursor->run_inline + cursor->pos - cursor->run_start,
+                0, end - cursor->pos);
+    cursor->pos = end;
+  }
+
+  // Adds the current run of inline bytes as an iovec, if it is not empty.
+  void FlushRun(Cursor* cursor) {
+    if (cursor->pos == cursor->run_start) {
+      return;
+    }
+    AddIovec(inline_ + cursor->run_inline, cursor->pos - cursor->run_start,
+             cursor);
+    cursor->run_inline += cursor->pos - cursor->run_start;
+    cursor->run_start = cursor->pos;
+  }
+
+  void AddIovec(const void* data, std::size_t size, Cursor* cursor) {
+    if (!cursor->ok || iovcnt_ == kMaxIovecs) {
+      cursor->ok = false;
+      return;
+    }
+    // iovec is also used for writes, so its base is not const.
+    iov_[iovcnt_].iov_base = const_cast<void*>(data);
+    iov_[iovcnt_].iov_len = size;
+    iovcnt_++;
+  }
+
+  const std::size_t min_ref_bytes_;
+  char inline_[kInlineBytes];
+  std::array<struct iovec, kMaxIovecs> iov_;
+  std::size_t iovcnt_;
+  std::size_t size_;
+};
+
+#endif  // VARSTRUCT_VARSTRUCT_IOVEC_H_
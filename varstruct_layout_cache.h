@@ -0,0 +1,179 @@
+// Copyright 2017 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// VarstructLayoutCache holds the layouts of a varstruct type for the array
+// sizes it is looked up with, and may be shared by any number of threads.
+//
+// When the same few combinations of array sizes recur, as across the workers
+// of a server, the offsets for each combination may be computed once and then
+// bound to each buffer, just like bind() on a single layout:
+//
+// VarstructLayoutCache<SimpleStruct> cache;  // Shared by all threads.
+// ...
+// const auto* layout = cache.Lookup({5, n});
+// if (layout == nullptr) return SlowPath(...);
+// auto simple_struct = layout->bind(my_ptr);
+//
+// The array sizes are those that would be passed to Create() without a
+// pointer, so they include the sizes of VARSTRUCT_ARRAY_SIZED_BY() arrays.
+//
+// The cache is an open-addressed table of kCapacity (a power of two) slots,
+// each holding an atomic pointer to an immutable layout. Looking up cached
+// sizes takes no lock and writes nothing; a miss computes the layout and
+// publishes it with a compare-and-swap. Layouts are never evicted, so the
+// pointers returned by Lookup() stay valid for the life of the cache. Once
+// every slot is taken, sizes not in the cache are no longer added, and Lookup()
+// returns null for them. Lookup() also returns null, rather than caching
+// anything, for sizes beyond a VARSTRUCT_MAX_COUNT() or whose offsets would
+// overflow, for which Create(array_sizes) would abort.
+
+#ifndef VARSTRUCT_VARSTRUCT_LAYOUT_CACHE_H_
+#define VARSTRUCT_VARSTRUCT_LAYOUT_CACHE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "varstruct.h"
+
+template <typename Varstruct, std::size_t kCapacity = 64>
+class VarstructLayoutCache {
+  static_assert(kCapacity != 0 && (kCapacity & (kCapacity - 1)) == 0,
+                "kCapacity must be a power of two");
+
+ public:
+  // The type of the cached layouts: a varstruct without a pointer, as returned
+  // by Create(array_sizes).
+  using Layout = decltype(
+      Varstruct::Create(std::declval<varstruct_internal::ArraySizes>()));
+
+  VarstructLayoutCache() {
+    for (std::atomic<const Entry*>& slot : slots_) {
+      slot.store(nullptr, std::memory_order_relaxed);
+    }
+  }
+
+  ~VarstructLayoutCache() {
+    for (std::atomic<const Entry*>& slot : slots_) {
+      delete slot.load(std::memory_order_relaxed);
+    }
+  }
+
+  VarstructLayoutCache(const VarstructLayoutCache&) = delete;
+  VarstructLayoutCache& operator=(const VarstructLayoutCache&) = delete;
+
+  // Returns the layout of Varstruct for the given array sizes, computing and
+  // caching it if it is not cached yet. Returns null if it is not cached and
+  // the cache is full, or if the array sizes are invalid.
+  const Layout* Lookup(varstruct_internal::ArraySizes array_sizes) {
+    std::unique_ptr<Entry> new_entry;
+    const std::size_t hash = Hash(array_sizes);
+    for (std::size_t i = 0; i < kCapacity; i++) {
+      std::atomic<const Entry*>& slot = slots_[(hash + i) & (kCapacity - 1)];
+      const Entry* entry = slot.load(std::memory_order_acquire);
+      if (entry == nullptr) {
+        if (new_entry == nullptr) {
+          // The sizes are validated as the layout is computed, and only when
+          // they are not cached yet, so hits are not slowed down.
+          auto layout = Varstruct::__varstruct_try_create__(array_sizes);
+          if (!layout) {
+            CountLookup(false);
+            return nullptr;
+          }
+          new_entry.reset(new Entry(array_sizes, *layout));
+        }
+        if (slot.compare_exchange_strong(entry, new_entry.get(),
+                                         std::memory_order_acq_rel,
+                                         std::memory_order_acquire)) {
+          CountLookup(false);
+          return &new_entry.release()->layout;
+        }
+        // Another thread took the slot first, and entry is now its entry.
+      }
+      if (entry->Matches(array_sizes)) {
+        // The layout computed by another thread for the same sizes is a miss,
+        // since this thread computed it too.
+        CountLookup(new_entry == nullptr);
+        return &entry->layout;
+      }
+    }
+    CountLookup(false);
+    return nullptr;
+  }
+
+  // The number of cached layouts. Other threads may be adding more.
+  std::size_t size() const {
+    std::size_t size = 0;
+    for (const std::atomic<const Entry*>& slot : slots_) {
+      if (slot.load(std::memory_order_relaxed) != nullptr) {
+        size++;
+      }
+    }
+    return size;
+  }
+
+ private:
+  // Counts a lookup in the usage counters of Varstruct, if VARSTRUCT_STATS is
+  // defined (see varstruct_stats.h).
+  static void CountLookup(bool hit) {
+#if defined(VARSTRUCT_STATS)
+    varstruct_internal::StatsFor<Varstruct>().AddCacheLookup(hit);
+#else
+    (void)hit;
+#endif
+  }
+
+  // The layout for one combination of array sizes, which is never modified
+  // once published in a slot.
+  struct Entry {
+    Entry(varstruct_internal::ArraySizes sizes, const Layout& computed)
+        : layout(computed) {
+      for (; !sizes.empty(); sizes.pop_front()) {
+        array_sizes.push_back(sizes.front());
+      }
+    }
+
+    bool Matches(varstruct_internal::ArraySizes sizes) const {
+      if (sizes.size() != array_sizes.size()) {
+        return false;
+      }
+      for (std::size_t size : array_sizes) {
+        if (size != sizes.front()) {
+          return false;
+        }
+        sizes.pop_front();
+      }
+      return true;
+    }
+
+    std::vector<std::size_t> array_sizes;
+    Layout layout;
+  };
+
+  // A 64-bit FNV-1a hash of the array sizes.
+  static std::size_t Hash(varstruct_internal::ArraySizes sizes) {
+    std::uint64_t hash = 14695981039346656037ull;
+    for (; !sizes.empty(); sizes.pop_front()) {
+      hash = (hash ^ sizes.front()) * 1099511628211ull;
+    }
+    return static_cast<std::size_t>(hash ^ (hash >> 32));
+  }
+
+  std::atomic<const Entry*> slots_[kCapacity];
+};
+
+#endif  // VARSTRUCT_VARSTRUCT_LAYOUT_CACHE_H_
@@ -0,0 +1,256 @@
+// Copyright 2017 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// MappedVarstructFile maps a file of varstructs stored back to back into
+// memory, read-only, so that they are read straight from the page cache
+// without copying them into a buffer first:
+//
+// MappedVarstructFile<SimpleStruct> file;
+// if (!file.Open("records.bin")) return errno;
+// for (const auto& record : file.records({5, 8})) {
+//   Process(record.foo());
+// }
+//
+// records() is CreateRange() over the mapping, so the records are varstructs
+// with const pointers into it, and stay valid until the file is closed.
+//
+// To access records by index, BuildIndex() scans the file once and keeps the
+// offset of each record:
+//
+// file.BuildIndex({5, 8});
+// auto last = file.record(file.num_records() - 1);
+//
+// Open() takes a union of the MappedVarstructFile::Advice flags, which are
+// passed on to the kernel as madvise() hints: kSequential (the default) for
+// files read front to back, kWillNeed to start reading the whole file in now,
+// and kHugePages to back the mapping with transparent huge pages where
+// supported, which reduces TLB misses on large files.
+//
+// This header requires POSIX mmap(). A MappedVarstructFile is not thread-safe,
+// but the records of an open file may be read by any number of threads.
+
+#ifndef VARSTRUCT_VARSTRUCT_MAPPED_FILE_H_
+#define VARSTRUCT_VARSTRUCT_MAPPED_FILE_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "varstruct.h"
+
+template <typename Varstruct>
+class MappedVarstructFile {
+ public:
+  // The type of the range returned by records().
+  using Range = decltype(Varstruct::CreateRange(
+      static_cast<const void*>(nullptr), 0,
+      std::declval<varstruct_internal::ArraySizes>()));
+
+  // The type of the records returned by record().
+  using Record = decltype(Varstruct::Create(
+      static_cast<const void*>(nullptr),
+      std::declval<varstruct_internal::ArraySizes>()));
+
+  // Flags for Open(), which may be combined with |.
+  enum Advice : unsigned {
+    kNormal = 0,
+    kSequential = 1 << 0,
+    kWillNeed = 1 << 1,
+    kHugePages = 1 << 2,
+  };
+
+  MappedVarstructFile() : data_(nullptr), size_(0), index_end_(0) {}
+
+  ~MappedVarstructFile() { Close(); }
+
+  MappedVarstructFile(MappedVarstructFile&& other)
+      : data_(other.data_),
+        size_(other.size_),
+        index_(std::move(other.index_)),
+        index_sizes_(std::move(other.index_sizes_)),
+        index_end_(other.index_end_) {
+    other.data_ = nullptr;
+    other.size_ = 0;
+    other.index_end_ = 0;
+  }
+
+  MappedVarstructFile& operator=(MappedVarstructFile&& other) {
+    if (this != &other) {
+      Close();
+      std::swap(data_, other.data_);
+      std::swap(size_, other.size_);
+      index_.swap(other.index_);
+      index_sizes_.swap(other.index_sizes_);
+      std::swap(index_end_, other.index_end_);
+    }
+    return *this;
+  }
+
+  MappedVarstructFile(const MappedVarstructFile&) = delete;
+  MappedVarstructFile& operator=(const MappedVarstructFile&) = delete;
+
+  // Maps the file at path, closing any file mapped before. Returns false,
+  // leaving errno set, if the file cannot be opened or mapped. The advice is
+  // only a hint, so failures to apply it are ignored.
+  bool Open(const char* path, unsigned advice = kSequential) {
+    Close();
+    const int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+      ::close(fd);
+      return false;
+    }
+    const std::size_t size = static_cast<std::size_t>(st.st_size);
+    // mmap() fails for empty files, which simply hold no records.
+    void* data = nullptr;
+    if (size != 0) {
+      data = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+      if (data == MAP_FAILED) {
+        ::close(fd);
+        return false;
+      }
+    }
+    // The mapping keeps the file open.
+    ::close(fd);
+    data_ = data;
+    size_ = size;
+    if (data_ != nullptr) {
+      Advise(advice);
+    }
+    return true;
+  }
+
+  // Unmaps the file, if any. Records of the file must no longer be used.
+  void Close() {
+    if (data_ != nullptr) {
+      ::munmap(data_, size_);
+    }
+    data_ = nullptr;
+    size_ = 0;
+    index_.clear();
+    index_sizes_.clear();
+    index_end_ = 0;
+  }
+
+  // The mapped bytes of the file.
+  const void* data() const { return data_; }
+  std::size_t size() const { return size_; }
+
+  // A range over the records of the file, each with the given array sizes, as
+  // returned by CreateRange().
+  Range records(varstruct_internal::ArraySizes array_sizes,
+                std::size_t prefetch_bytes = 0) const {
+    return Varstruct::CreateRange(static_cast<const void*>(data_), size_,
+                                  array_sizes, prefetch_bytes);
+  }
+
+  // Scans the records of the file, like records(), keeping the offset of each
+  // for record(). Returns the number of records.
+  std::size_t BuildIndex(varstruct_internal::ArraySizes array_sizes) {
+    index_.clear();
+    index_sizes_.clear();
+    const Range range = records(array_sizes);
+    auto it = range.begin();
+    for (; it != range.end(); ++it) {
+      index_.push_back(it.offset());
+    }
+    index_end_ = it.offset();
+    // The array sizes are kept for record(), as a brace list does not outlive
+    // this call.
+    for (; !array_sizes.empty(); array_sizes.pop_front()) {
+      index_sizes_.push_back(array_sizes.front());
+    }
+    return index_.size();
+  }
+
+  // The number of records found by BuildIndex().
+  std::size_t num_records() const { return index_.size(); }
+
+  // Returns the record with the given 0-based index, with the same layout as
+  // in records(). BuildIndex() must have been called.
+  Record record(std::size_t index) const {
+    assert(index < index_.size());
+    const std::size_t end =
+        (index + 1 < index_.size()) ? index_[index + 1] : index_end_;
+    return CreateRecord(index_[index], end,
+                        std::integral_constant<bool, kFixedLayout>());
+  }
+
+ private:
+  using Table = varstruct_internal::FieldTable<Varstruct>;
+
+  // Whether the layout of every record is given by the array sizes alone, in
+  // which case a VARSTRUCT_TRAILING_ARRAY() is sized by them rather than by
+  // the rest of the file, as in CreateRange().
+  static constexpr bool kFixedLayout =
+      varstruct_internal::CountSizedArrays(Table::kFields, Table::kNumFields) ==
+      0;
+
+  Record CreateRecord(std::size_t offset, std::size_t /* end */,
+                      std::true_type /* fixed_layout */) const {
+    return Varstruct::Create(static_cast<const char*>(data_) + offset,
+                             varstruct_internal::ArraySizes(index_sizes_));
+  }
+
+  Record CreateRecord(std::size_t offset, std::size_t end,
+                      std::false_type /* fixed_layout */) const {
+    // The sizes read from the file are only those BuildIndex() read, so the
+    // record is only missing if the file changed since.
+    auto record = Varstruct::Create(
+        static_cast<const char*>(data_) + offset, end - offset,
+        varstruct_internal::ArraySizes(index_sizes_));
+    if (!record) {
+      std::fputs("MappedVarstructFile: the file changed since BuildIndex()\n",
+                 stderr);
+      std::abort();
+    }
+    return *record;
+  }
+
+  void Advise(unsigned advice) {
+    if (advice & kSequential) {
+      ::madvise(data_, size_, MADV_SEQUENTIAL);
+    }
+    if (advice & kWillNeed) {
+      ::madvise(data_, size_, MADV_WILLNEED);
+    }
+#if defined(MADV_HUGEPAGE)
+    if (advice & kHugePages) {
+      ::madvise(data_, size_, MADV_HUGEPAGE);
+    }
+#endif
+  }
+
+  void* data_;
+  std::size_t size_;
+  // The offset of each record, the array sizes passed to BuildIndex(), and
+  // the end of the last record.
+  std::vector<std::size_t> index_;
+  std::vector<std::size_t> index_sizes_;
+  std::size_t index_end_;
+};
+
+#endif  // VARSTRUCT_VARSTRUCT_MAPPED_FILE_H_
@@ -0,0 +1,168 @@
+// Copyright 2017 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Parallel scans over buffers of varstructs stored back to back, as returned
+// by CreateRange().
+//
+// The boundaries of variable-length records are only found by reading each
+// record in turn, so a buffer is first split into chunks at record boundaries,
+// which are kept in a boundary index: a vector of ascending offsets, starting
+// with 0 and ending with the number of bytes covered by records, so chunk i
+// spans [boundaries[i], boundaries[i + 1]). The index only depends on the
+// buffer, so it may be saved and reused by later scans.
+//
+// VarstructChunkBoundaries() builds the index by skipping over the records
+// without processing them. If the records carry sync markers, so that the next
+// record at or after any offset can be found directly, the index may instead
+// be built by VarstructChunkBoundariesAtSync() without reading every record.
+//
+// ParallelScanVarstructs() then passes a range over the records of each chunk
+// to the callback, on several threads, and returns the results in chunk order
+// to be merged:
+//
+// const auto boundaries =
+//     VarstructChunkBoundaries<SimpleStruct>(ptr, len, {5, 8}, 1 << 20);
+// std::vector<std::size_t> counts = ParallelScanVarstructs<SimpleStruct>(
+//     ptr, boundaries, {5, 8}, /*num_threads=*/0,
+//     [](const VarstructChunkRange<SimpleStruct>& records) {
+//       std::size_t count = 0;
+//       for (const auto& record : records) count += record.foo() > 0;
+//       return count;
+//     });
+// const std::size_t total =
+//     std::accumulate(counts.begin(), counts.end(), std::size_t{0});
+
+#ifndef VARSTRUCT_VARSTRUCT_PARALLEL_SCAN_H_
+#define VARSTRUCT_VARSTRUCT_PARALLEL_SCAN_H_
+
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "varstruct.h"
+
+// The type of the ranges passed to the callback of ParallelScanVarstructs().
+template <typename Varstruct>
+using VarstructChunkRange = decltype(Varstruct::CreateRange(
+    static_cast<const void*>(nullptr), 0,
+    std::declval<varstruct_internal::ArraySizes>()));
+
+namespace varstruct_internal {
+
+// The type of the result of ChunkFn for a chunk.
+template <typename Varstruct, typename ChunkFn>
+using ChunkResult = decltype(std::declval<ChunkFn&>()(
+    std::declval<const VarstructChunkRange<Varstruct>&>()));
+
+}  // namespace varstruct_internal
+
+// Builds the boundary index of the records with the given array sizes in the
+// len bytes at ptr, splitting them into chunks of at least chunk_bytes bytes
+// (except the last).
+template <typename Varstruct>
+std::vector<std::size_t> VarstructChunkBoundaries(
+    const void* ptr, std::size_t len,
+    varstruct_internal::ArraySizes array_sizes, std::size_t chunk_bytes) {
+  std::vector<std::size_t> boundaries(1, 0);
+  const auto records = Varstruct::CreateRange(ptr, len, array_sizes);
+  auto it = records.begin();
+  for (; it != records.end(); ++it) {
+    if (it.offset() - boundaries.back() >= chunk_bytes) {
+      boundaries.push_back(it.offset());
+    }
+  }
+  if (it.offset() != boundaries.back()) {
+    boundaries.push_back(it.offset());
+  }
+  return boundaries;
+}
+
+// Builds the boundary index of the records in the len bytes at ptr, splitting
+// them about every chunk_bytes bytes, where find_record(data, len, offset)
+// returns the offset of the first record at or after offset (or len if there
+// is none) in the len bytes at data.
+template <typename FindRecord>
+std::vector<std::size_t> VarstructChunkBoundariesAtSync(
+    const void* ptr, std::size_t len, std::size_t chunk_bytes,
+    FindRecord find_record) {
+  const char* data = static_cast<const char*>(ptr);
+  std::vector<std::size_t> boundaries(1, 0);
+  for (std::size_t offset = chunk_bytes; offset < len; offset += chunk_bytes) {
+    const std::size_t boundary = find_record(data, len, offset);
+    if (boundary > boundaries.back() && boundary < len) {
+      boundaries.push_back(boundary);
+    }
+  }
+  if (len != 0) {
+    boundaries.push_back(len);
+  }
+  return boundaries;
+}
+
+// Calls chunk_fn(records) with a range over the records with the given array
+// sizes in each chunk of the boundary index, and returns the results in chunk
+// order. Chunks are handed out one at a time to num_threads threads (including
+// the calling one, and one per core if num_threads is 0), so that threads
+// given quick chunks take on more of them. chunk_fn may be called
+// concurrently from any of the threads.
+//
+// The results are stored by each thread as it goes, so they may not be bool
+// (whose std::vector packs them into shared words).
+template <typename Varstruct, typename ChunkFn>
+std::vector<varstruct_internal::ChunkResult<Varstruct, ChunkFn>>
+ParallelScanVarstructs(const void* ptr,
+                       const std::vector<std::size_t>& boundaries,
+                       varstruct_internal::ArraySizes array_sizes,
+                       std::size_t num_threads, ChunkFn chunk_fn) {
+  static_assert(
+      !std::is_same<varstruct_internal::ChunkResult<Varstruct, ChunkFn>,
+                    bool>::value,
+      "Chunk results may not be bool");
+  const char* data = static_cast<const char*>(ptr);
+  const std::size_t num_chunks =
+      boundaries.empty() ? 0 : boundaries.size() - 1;
+  std::vector<varstruct_internal::ChunkResult<Varstruct, ChunkFn>> results(
+      num_chunks);
+  std::atomic<std::size_t> next_chunk(0);
+  auto work = [&] {
+    for (std::size_t i = next_chunk.fetch_add(1); i < num_chunks;
+         i = next_chunk.fetch_add(1)) {
+      // Each range computes its own layout, so threads share no offsets.
+      results[i] = chunk_fn(Varstruct::CreateRange(
+          data + boundaries[i], boundaries[i + 1] - boundaries[i],
+          array_sizes));
+    }
+  };
+
+  if (num_threads == 0) {
+    num_threads = std::thread::hardware_concurrency();
+  }
+  if (num_threads > num_chunks) {
+    num_threads = num_chunks;
+  }
+  std::vector<std::thread> threads;
+  for (std::size_t i = 1; i < num_threads; i++) {
+    threads.emplace_back(work);
+  }
+  work();
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  return results;
+}
+
+#endif  // VARSTRUCT_VARSTRUCT_PARALLEL_SCAN_H_
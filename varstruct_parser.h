@@ -0,0 +1,186 @@
+// Copyright 2017 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// VarstructParser computes the layout of a varstruct whose bytes arrive a
+// chunk at a time, as from a socket, resuming where it stopped on each call
+// rather than starting over:
+//
+// VarstructParser<Tlv> parser({1});  // The array sizes, as for Create().
+// ...
+// // Each time bytes are appended to buf:
+// if (parser.Parse(buf.data(), buf.size()) == 0) {
+//   auto tlv = parser.record(buf.data());
+//   Process(tlv.value_span());
+//   buf.erase(buf.begin(), buf.begin() + tlv.size_bytes());
+//   parser.Reset();
+// }
+//
+// Parse() is passed every byte received so far for the record, from its
+// start, and computes the offsets of the fields it has not yet computed until
+// it reaches the count field of a VARSTRUCT_ARRAY_SIZED_BY() array that has not
+// arrived. It returns the number of bytes still needed, past those passed in:
+// up to the end of that count field, or up to the end of the record once every
+// offset is computed, and 0 when the whole record has arrived. Each field is
+// computed once, so feeding a record a byte at a time costs no more than one
+// Create() in all, and callers may wait for the number of bytes returned
+// before calling Parse() again.
+//
+// If the record can never be valid, because an array size exceeds its
+// VARSTRUCT_MAX_COUNT() or the offsets would overflow, Parse() returns
+// kInvalidRecord instead, as it does on every call until Reset(), and
+// invalid() is true. The connection should then be dropped, as the end of
+// the record is not known.
+//
+// The buffer may move between calls, as when a std::vector grows, since only
+// offsets are kept. The varstruct returned by record() shares the offsets of
+// the parser, like bind(), so the parser must outlive it and not be Reset()
+// while it is used.
+//
+// Varstructs with a VARSTRUCT_TRAILING_ARRAY() are not supported, as the end
+// of the bytes received so far is not the end of the record.
+
+#ifndef VARSTRUCT_VARSTRUCT_PARSER_H_
+#define VARSTRUCT_VARSTRUCT_PARSER_H_
+
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <utility>
+
+#include "varstruct.h"
+
+template <typename Varstruct>
+class VarstructParser {
+  using Table = varstruct_internal::FieldTable<Varstruct>;
+  static constexpr std::size_t kNumSlots =
+      varstruct_internal::FieldAccess::NumSlots<Varstruct>();
+
+  static_assert(varstruct_internal::CountTrailingArrays(Table::kFields,
+                                                        Table::kNumFields) == 0,
+                "VarstructParser does not support VARSTRUCT_TRAILING_ARRAY()");
+
+ public:
+  // The type of the varstructs returned by record().
+  using Record = decltype(Varstruct::__varstruct_nested__(
+      std::declval<const void*>(), nullptr));
+  using MutableRecord = decltype(
+      Varstruct::__varstruct_nested__(std::declval<void*>(), nullptr));
+
+  // Starts parsing a record with the given array sizes, which are those
+  // passed to Create() with a pointer: the sizes of VARSTRUCT_ARRAY_SIZED_BY()
+  // arrays are read from the buffer. The array sizes are copied.
+  explicit VarstructParser(varstruct_internal::ArraySizes array_sizes = {})
+      : num_array_sizes_(array_sizes.size()) {
+    // There are never more array sizes than slots.
+    if (num_array_sizes_ > array_sizes_.size()) {
+      varstruct_internal::AbortInvalidLayout();
+    }
+    for (std::size_t i = 0; i < num_array_sizes_; i++) {
+      array_sizes_[i] = array_sizes.front();
+      array_sizes.pop_front();
+    }
+    Reset();
+  }
+
+  // Returned by Parse() for records that can never be valid.
+  static constexpr std::size_t kInvalidRecord =
+      std::numeric_limits<std::size_t>::max();
+
+  // Continues parsing the record whose first len bytes are at data, which
+  // must include every byte passed to earlier calls since Reset(). Returns the
+  // number of bytes still needed past len, 0 if the record is complete, or
+  // kInvalidRecord if it is invalid.
+  std::size_t Parse(const void* data, std::size_t len) {
+    assert(reinterpret_cast<std::uintptr_t>(data) % Varstruct::alignment() ==
+           0);
+    if (invalid_) {
+      return kInvalidRecord;
+    }
+    // No count field is read from an empty buffer, which may have no data.
+    const char* base = (len == 0) ? "" : static_cast<const char*>(data);
+    while (num_fields_ < Table::kNumFields) {
+      varstruct_internal::ArraySizes array_sizes(
+          array_sizes_.data() + next_array_size_,
+          num_array_sizes_ - next_array_size_);
+      // Only set if a count field has not arrived.
+      std::size_t needed_len = 0;
+      if (!varstruct_internal::ComputeFieldOffset<Varstruct>(
+              num_fields_, base, len, &array_sizes, offsets_.data(),
+              &needed_len)) {
+        if (needed_len == 0) {
+          invalid_ = true;
+          return kInvalidRecord;
+        }
+        return needed_len - len;
+      }
+      next_array_size_ = num_array_sizes_ - array_sizes.size();
+      num_fields_++;
+    }
+    // The number of array sizes should be the same as the number of
+    // VARSTRUCT_ARRAY() declarations.
+    assert(next_array_size_ == num_array_sizes_);
+    return (size_bytes() > len) ? size_bytes() - len : 0;
+  }
+
+  // Whether the offsets of every field have been computed. The record is
+  // complete once size_bytes() bytes have arrived.
+  bool has_layout() const { return num_fields_ == Table::kNumFields; }
+
+  // Whether Parse() found the record invalid. It then has no layout.
+  bool invalid() const { return invalid_; }
+
+  // The size of the record, as returned by its size_bytes(). Requires
+  // has_layout().
+  std::size_t size_bytes() const {
+    assert(has_layout());
+    return varstruct_internal::AlignUp(
+        (kNumSlots == 0) ? 0 : offsets_[kNumSlots - 1],
+        Varstruct::alignment());
+  }
+
+  // Returns a view of the complete record at data, the buffer last passed to
+  // Parse() or a copy of it, which must hold all of its size_bytes() bytes.
+  Record record(const void* data) const {
+    assert(has_layout());
+    return Varstruct::__varstruct_nested__(data, offsets_.data());
+  }
+  MutableRecord record(void* data) const {
+    assert(has_layout());
+    return Varstruct::__varstruct_nested__(data, offsets_.data());
+  }
+
+  // Starts parsing the next record, with the same array sizes.
+  void Reset() {
+    next_array_size_ = 0;
+    num_fields_ = 0;
+    invalid_ = false;
+  }
+
+ private:
+  std::array<std::size_t, kNumSlots> array_sizes_;
+  std::size_t num_array_sizes_;
+  // The number of array sizes used, and the number of fields whose offsets
+  // have been computed.
+  std::size_t next_array_size_;
+  std::size_t num_fields_;
+  bool invalid_;
+  std::array<std::size_t, kNumSlots> offsets_;
+};
+
+template <typename Varstruct>
+constexpr std::size_t VarstructParser<Varstruct>::kInvalidRecord;
+
+#endif  // VARSTRUCT_VARSTRUCT_PARSER_H_
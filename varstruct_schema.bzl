@@ -0,0 +1,55 @@
+# Copyright 2017 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Emits the schema() of varstructs as JSON at build time."""
+
+def varstruct_schema_json(name, hdr, types, deps = [], **kwargs):
+    """Writes name.json, the VarstructSchemaListJson() of types.
+
+    Args:
+      name: The name of the rule; the output is name.json.
+      hdr: The include path of the header defining the varstructs.
+      types: The names of the varstructs, as written in C++ with their
+        namespaces, in the order of the JSON array.
+      deps: The cc_library providing hdr.
+      **kwargs: Passed to the rule producing name.json. Its testonly value
+        also applies to the intermediate rules, so that deps may be testonly.
+    """
+    testonly = kwargs.get("testonly", False)
+    src = "\n".join([
+        "#include \"%s\"" % hdr,
+        "#include \"varstruct_schema.h\"",
+        "VARSTRUCT_SCHEMA_MAIN(%s)" % ", ".join(types),
+    ])
+    native.genrule(
+        name = name + "_main",
+        outs = [name + "_main.cc"],
+        cmd = "cat > $@ <<'EOF'\n%s\nEOF" % src,
+        testonly = testonly,
+        visibility = ["//visibility:private"],
+    )
+    native.cc_binary(
+        name = name + "_emitter",
+        srcs = [name + "_main.cc"],
+        deps = deps + [Label("//:varstruct_schema")],
+        testonly = testonly,
+        visibility = ["//visibility:private"],
+    )
+    native.genrule(
+        name = name,
+        outs = [name + ".json"],
+        cmd = "$(location :%s_emitter) > $@" % name,
+        tools = [":%s_emitter" % name],
+        **kwargs
+    )
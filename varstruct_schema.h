@@ -0,0 +1,227 @@
+// Copyright 2017 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// VarstructSchemaJson() writes the schema() of a varstruct as JSON, so that
+// readers in other languages can generate their decoders from the same
+// definition rather than reimplementing the layout by hand:
+//
+// std::string json = VarstructSchemaJson(Tlv::schema());
+//
+// The varstruct_schema_json() rule of varstruct_schema.bzl runs it at build
+// time, for the varstructs of a header:
+//
+// varstruct_schema_json(
+//     name = "tlv_schema",
+//     hdr = "tlv.h",
+//     types = ["Tlv"],
+//     deps = [":tlv"],
+// )
+//
+// Each schema is an object with the name and alignment of the varstruct, and
+// a "fields" array with one object per field in declaration order. Each field
+// has every member of FieldSchema, with "kind" and "value_kind" as strings,
+// "size_field" as the name of the count field (or null), "max_count" as null
+// when there is none, and "nested" as the schema of a nested varstruct (or
+// null):
+//
+// {"name": "Tlv", "alignment": 1, "fields": [
+//   {"name": "name_len", "type": "uint8_t", "kind": "scalar",
+//    "value_kind": "unsigned", "elem_size": 1, "alignment": 1,
+//    "big_endian": false, "bit_shift": 0, "bit_width": 0,
+//    "shares_word": false, "size_field": null, "max_count": null,
+//    "hashed": true, "nested": null},
+//   ...]}
+//
+// The offsets of the fields are not part of the schema: as for Create(),
+// readers compute them in declaration order, aligning each field up to its
+// alignment, with every VARSTRUCT_BITS() field that shares_word at the offset
+// of the previous field.
+
+#ifndef VARSTRUCT_VARSTRUCT_SCHEMA_H_
+#define VARSTRUCT_VARSTRUCT_SCHEMA_H_
+
+#include <cstddef>
+#include <cstdio>
+#include <string>
+
+#include "varstruct.h"
+
+namespace varstruct_internal {
+
+inline const char* FieldKindName(FieldKind kind) {
+  switch (kind) {
+    case FieldKind::kScalar:
+      return "scalar";
+    case FieldKind::kBits:
+      return "bits";
+    case FieldKind::kArray:
+      return "array";
+    case FieldKind::kSizedByArray:
+      return "sized_by_array";
+    case FieldKind::kTrailingArray:
+      return "trailing_array";
+    case FieldKind::kNested:
+      return "nested";
+    case FieldKind::kNestedArray:
+      return "nested_array";
+  }
+  return "";
+}
+
+inline const char* ValueKindName(ValueKind kind) {
+  switch (kind) {
+    case ValueKind::kUnsigned:
+      return "unsigned";
+    case ValueKind::kSigned:
+      return "signed";
+    case ValueKind::kFloat:
+      return "float";
+    case ValueKind::kOther:
+      return "other";
+  }
+  return "";
+}
+
+inline void AppendJsonString(const char* value, std::string* json) {
+  json->push_back('"');
+  for (; *value != '\0'; value++) {
+    const unsigned char c = static_cast<unsigned char>(*value);
+    if (c < 0x20) {
+      // Control characters are not allowed in JSON strings.
+      char escape[sizeof("\\u0000")];
+      std::snprintf(escape, sizeof(escape), "\\u%04x", c);
+      json->append(escape);
+      continue;
+    }
+    if (c == '"' || c == '\\') {
+      json->push_back('\\');
+    }
+    json->push_back(*value);
+  }
+  json->push_back('"');
+}
+
+inline void AppendJsonMember(const char* name, std::string* json) {
+  AppendJsonString(name, json);
+  json->append(": ");
+}
+
+inline void AppendSchemaJson(const Schema& schema, std::string* json) {
+  json->push_back('{');
+  AppendJsonMember("name", json);
+  AppendJsonString(schema.name, json);
+  json->append(", ");
+  AppendJsonMember("alignment", json);
+  json->append(std::to_string(schema.alignment));
+  json->append(", ");
+  AppendJsonMember("fields", json);
+  json->push_back('[');
+  for (std::size_t i = 0; i < schema.num_fields; i++) {
+    const FieldSchema& field = schema.fields[i];
+    json->append(i == 0 ? "{" : ", {");
+    AppendJsonMember("name", json);
+    AppendJsonString(field.name, json);
+    json->append(", ");
+    AppendJsonMember("type", json);
+    AppendJsonString(field.type, json);
+    json->append(", ");
+    AppendJsonMember("kind", json);
+    AppendJsonString(FieldKindName(field.kind), json);
+    json->append(", ");
+    AppendJsonMember("value_kind", json);
+    AppendJsonString(ValueKindName(field.value_kind), json);
+    json->append(", ");
+    AppendJsonMember("elem_size", json);
+    json->append(std::to_string(field.elem_size));
+    json->append(", ");
+    AppendJsonMember("alignment", json);
+    json->append(std::to_string(field.alignment));
+    json->append(", ");
+    AppendJsonMember("big_endian", json);
+    json->append(field.big_endian ? "true" : "false");
+    json->append(", ");
+    AppendJsonMember("bit_shift", json);
+    json->append(std::to_string(field.bit_shift));
+    json->append(", ");
+    AppendJsonMember("bit_width", json);
+    json->append(std::to_string(field.bit_width));
+    json->append(", ");
+    AppendJsonMember("shares_word", json);
+    json->append(field.shares_word ? "true" : "false");
+    json->append(", ");
+    AppendJsonMember("size_field", json);
+    if (field.size_field == kNoSizeField) {
+      json->append("null");
+    } else {
+      AppendJsonString(schema.fields[field.size_field].name, json);
+    }
+    json->append(", ");
+    AppendJsonMember("max_count", json);
+    if (field.max_count == kNoMaxCount) {
+      json->append("null");
+    } else {
+      json->append(std::to_string(field.max_count));
+    }
+    json->append(", ");
+    AppendJsonMember("hashed", json);
+    json->append(field.hashed ? "true" : "false");
+    json->append(", ");
+    AppendJsonMember("nested", json);
+    if (field.nested == nullptr) {
+      json->append("null");
+    } else {
+      AppendSchemaJson(*field.nested, json);
+    }
+    json->push_back('}');
+  }
+  json->append("]}");
+}
+
+}  // namespace varstruct_internal
+
+// Returns the JSON object describing schema, as returned by the schema() of a
+// varstruct. The schemas of nested varstructs are written inline.
+inline std::string VarstructSchemaJson(
+    const varstruct_internal::Schema& schema) {
+  std::string json;
+  varstruct_internal::AppendSchemaJson(schema, &json);
+  return json;
+}
+
+// Returns a JSON array of the schema of each of the Varstructs, one per line.
+template <typename... Varstructs>
+std::string VarstructSchemaListJson() {
+  // With a leading null so that the array is not empty.
+  const varstruct_internal::Schema* const schemas[] = {
+      nullptr, &Varstructs::schema()...};
+  std::string json = "[";
+  for (std::size_t i = 1; i <= sizeof...(Varstructs); i++) {
+    if (i != 1) {
+      json.append(",\n");
+    }
+    varstruct_internal::AppendSchemaJson(*schemas[i], &json);
+  }
+  json.append("]\n");
+  return json;
+}
+
+// Defines a main() printing VarstructSchemaListJson() of the varstructs passed
+// in, as used by varstruct_schema_json().
+#define VARSTRUCT_SCHEMA_MAIN(...)                                      \
+  int main() {                                                          \
+    std::fputs(VarstructSchemaListJson<__VA_ARGS__>().c_str(), stdout); \
+    return 0;                                                           \
+  }
+
+#endif  // VARSTRUCT_VARSTRUCT_SCHEMA_H_
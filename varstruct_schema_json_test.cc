@@ -0,0 +1,42 @@
+// Copyright 2017 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the varstruct_schema_json() rule of varstruct_schema.bzl: the JSON it
+// emits at build time for the varstructs of varstruct_schema_testdata.h must
+// match varstruct_schema_testdata_expected.json.
+
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+// Returns the contents of the file at path, relative to the runfiles of the
+// test.
+std::string ReadFile(const std::string& path) {
+  std::ifstream file(path.c_str(), std::ios::binary);
+  EXPECT_TRUE(file.is_open()) << path;
+  std::ostringstream contents;
+  contents << file.rdbuf();
+  return contents.str();
+}
+
+TEST(VarstructSchemaJsonTest, MatchesExpectedJson) {
+  EXPECT_EQ(ReadFile("varstruct_schema_testdata_expected.json"),
+            ReadFile("varstruct_schema_testdata_schema.json"));
+}
+
+}  // namespace
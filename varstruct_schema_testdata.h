@@ -0,0 +1,44 @@
+// Copyright 2017 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Varstructs whose schemas varstruct_schema_json_test checks, as emitted at
+// build time by the varstruct_schema_json() rule of varstruct_schema.bzl.
+
+#ifndef VARSTRUCT_VARSTRUCT_SCHEMA_TESTDATA_H_
+#define VARSTRUCT_VARSTRUCT_SCHEMA_TESTDATA_H_
+
+#include <cstdint>
+
+#include "varstruct.h"
+
+namespace varstruct_schema_testdata {
+
+DEFINE_VARSTRUCT(Name) {
+  VARSTRUCT_SCALAR(uint8_t, len);
+  VARSTRUCT_ARRAY_SIZED_BY(char, data, len);
+  VARSTRUCT_MAX_COUNT(data, 16);
+};
+
+DEFINE_VARSTRUCT_ALIGNED(Sample) {
+  VARSTRUCT_BITS_BE(uint16_t, version, 4);
+  VARSTRUCT_BITS_BE(uint16_t, flags, 12);
+  VARSTRUCT_SCALAR(uint32_t, timestamp);
+  VARSTRUCT_EXCLUDE_FROM_HASH(timestamp);
+  VARSTRUCT_NESTED(Name, name);
+  VARSTRUCT_TRAILING_ARRAY(int16_t, values);
+};
+
+}  // namespace varstruct_schema_testdata
+
+#endif  // VARSTRUCT_VARSTRUCT_SCHEMA_TESTDATA_H_
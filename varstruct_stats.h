@@ -0,0 +1,285 @@
+// Copyright 2017 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Usage counters for each varstruct type, to find the types and fields worth
+// optimizing in a running program:
+//
+// for (const VarstructTypeStats& stats : VarstructStatsSnapshot()) {
+//   LOG(INFO) << stats.name << ": " << stats.creates << " creates";
+// }
+//
+// The counters are only updated when VARSTRUCT_STATS is defined, which must be
+// the same in every translation unit of the program. Otherwise no code is
+// generated for them, and VarstructStatsSnapshot() returns no types.
+//
+// Each thread updates counters of its own for each type, without atomic
+// read-modify-writes or locks, so that threads using the same types do not
+// contend. A snapshot sums the counters of every thread, including those that
+// have exited; as it runs while other threads keep counting, counters updated
+// at the same time as the snapshot may or may not be included.
+
+#ifndef VARSTRUCT_VARSTRUCT_STATS_H_
+#define VARSTRUCT_VARSTRUCT_STATS_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// The counters of one varstruct type, summed over every thread.
+struct VarstructTypeStats {
+  // The name given to DEFINE_VARSTRUCT().
+  std::string name;
+
+  // The number of calls to Create() and its variants, including CreateLazy()
+  // and those made by VarstructLayoutCache, and the number of these that
+  // returned no varstruct because it did not fit in the buffer.
+  std::uint64_t creates;
+  std::uint64_t create_failures;
+
+  // The number of VarstructLayoutCache::Lookup() calls that found the layout
+  // in the cache, and of those that did not.
+  std::uint64_t cache_hits;
+  std::uint64_t cache_misses;
+
+  // The number of array accesses out of bounds, as caught by the bounds checks
+  // of the accessors (before they assert, in debug builds).
+  std::uint64_t bounds_check_failures;
+
+  // The size_bytes() of the varstructs returned by Create(): element 0 counts
+  // those of 0 bytes, and element i those of 2^(i-1) up to 2^i - 1 bytes. The
+  // last element also counts every larger size.
+  std::vector<std::uint64_t> size_histogram;
+
+  // The name of each field in declaration order, and the number of bytes read
+  // or written through its accessors.
+  std::vector<std::pair<std::string, std::uint64_t>> field_bytes;
+};
+
+namespace varstruct_internal {
+
+// The number of elements of VarstructTypeStats::size_histogram.
+constexpr std::size_t kStatsSizeBuckets = 33;
+
+// Returns the element of VarstructTypeStats::size_histogram counting size.
+inline std::size_t StatsSizeBucket(std::size_t size) {
+  std::size_t bucket = 0;
+  for (; size != 0 && bucket < kStatsSizeBuckets - 1; size >>= 1) {
+    bucket++;
+  }
+  return bucket;
+}
+
+// The counters of one varstruct type for one thread. Only the thread that owns
+// them writes them, so adding to a counter is a relaxed load and store rather
+// than an atomic read-modify-write; they are atomic so that snapshots may read
+// them at any time.
+class ThreadStats {
+ public:
+  explicit ThreadStats(std::size_t num_fields)
+      : num_fields_(num_fields),
+        field_bytes_(new std::atomic<std::uint64_t>[num_fields]) {
+    creates_.store(0, std::memory_order_relaxed);
+    create_failures_.store(0, std::memory_order_relaxed);
+    cache_hits_.store(0, std::memory_order_relaxed);
+    cache_misses_.store(0, std::memory_order_relaxed);
+    bounds_check_failures_.store(0, std::memory_order_relaxed);
+    for (std::atomic<std::uint64_t>& count : size_histogram_) {
+      count.store(0, std::memory_order_relaxed);
+    }
+    for (std::size_t i = 0; i < num_fields; i++) {
+      field_bytes_[i].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  ThreadStats(const ThreadStats&) = delete;
+  ThreadStats& operator=(const ThreadStats&) = delete;
+
+  // Counts a call to Create(), which returned a varstruct of size_bytes bytes
+  // if ok is true.
+  void AddCreate(bool ok, std::size_t size_bytes) {
+    Add(&creates_, 1);
+    if (ok) {
+      Add(&size_histogram_[StatsSizeBucket(size_bytes)], 1);
+    } else {
+      Add(&create_failures_, 1);
+    }
+  }
+
+  // Counts a call to CreateLazy(), whose size is not known yet.
+  void AddLazyCreate() { Add(&creates_, 1); }
+
+  void AddCacheLookup(bool hit) { Add(hit ? &cache_hits_ : &cache_misses_, 1); }
+
+  void AddBoundsCheckFailure() { Add(&bounds_check_failures_, 1); }
+
+  void AddFieldBytes(std::size_t field, std::size_t bytes) {
+    Add(&field_bytes_[field], bytes);
+  }
+
+  // Adds these counters to stats, whose field_bytes must already hold an
+  // element for each field.
+  void AddTo(VarstructTypeStats* stats) const {
+    stats->creates += creates_.load(std::memory_order_relaxed);
+    stats->create_failures += create_failures_.load(std::memory_order_relaxed);
+    stats->cache_hits += cache_hits_.load(std::memory_order_relaxed);
+    stats->cache_misses += cache_misses_.load(std::memory_order_relaxed);
+    stats->bounds_check_failures +=
+        bounds_check_failures_.load(std::memory_order_relaxed);
+    for (std::size_t i = 0; i < kStatsSizeBuckets; i++) {
+      stats->size_histogram[i] +=
+          size_histogram_[i].load(std::memory_order_relaxed);
+    }
+    for (std::size_t i = 0; i < num_fields_; i++) {
+      stats->field_bytes[i].second +=
+          field_bytes_[i].load(std::memory_order_relaxed);
+    }
+  }
+
+ private:
+  static void Add(std::atomic<std::uint64_t>* counter, std::uint64_t n) {
+    counter->store(counter->load(std::memory_order_relaxed) + n,
+                   std::memory_order_relaxed);
+  }
+
+  const std::size_t num_fields_;
+  std::atomic<std::uint64_t> creates_;
+  std::atomic<std::uint64_t> create_failures_;
+  std::atomic<std::uint64_t> cache_hits_;
+  std::atomic<std::uint64_t> cache_misses_;
+  std::atomic<std::uint64_t> bounds_check_failures_;
+  std::atomic<std::uint64_t> size_histogram_[kStatsSizeBuckets];
+  std::unique_ptr<std::atomic<std::uint64_t>[]> field_bytes_;
+};
+
+// The counters of one varstruct type for every thread that has used it. The
+// counters of a thread are handed to a new thread once it exits, since
+// snapshots only report their sums.
+class TypeStats {
+ public:
+  TypeStats(const char* name, std::vector<const char*> field_names)
+      : name_(name), field_names_(std::move(field_names)) {}
+
+  TypeStats(const TypeStats&) = delete;
+  TypeStats& operator=(const TypeStats&) = delete;
+
+  // Returns counters for the calling thread, until it passes them to
+  // Release().
+  ThreadStats* Acquire() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!free_.empty()) {
+      ThreadStats* stats = free_.back();
+      free_.pop_back();
+      return stats;
+    }
+    threads_.emplace_back(new ThreadStats(field_names_.size()));
+    return threads_.back().get();
+  }
+
+  void Release(ThreadStats* stats) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_.push_back(stats);
+  }
+
+  VarstructTypeStats Snapshot() const {
+    VarstructTypeStats snapshot;
+    snapshot.name = name_;
+    snapshot.creates = 0;
+    snapshot.create_failures = 0;
+    snapshot.cache_hits = 0;
+    snapshot.cache_misses = 0;
+    snapshot.bounds_check_failures = 0;
+    snapshot.size_histogram.assign(kStatsSizeBuckets, 0);
+    for (const char* field_name : field_names_) {
+      snapshot.field_bytes.emplace_back(field_name, 0);
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const std::unique_ptr<ThreadStats>& stats : threads_) {
+      stats->AddTo(&snapshot);
+    }
+    return snapshot;
+  }
+
+ private:
+  const char* const name_;
+  const std::vector<const char*> field_names_;
+  mutable std::mutex mutex_;
+  std::vector<std::unique_ptr<ThreadStats>> threads_;
+  std::vector<ThreadStats*> free_;
+};
+
+// Every varstruct type used so far, in the order they were first used.
+struct StatsRegistry {
+  std::mutex mutex;
+  std::vector<TypeStats*> types;
+};
+
+// The registry is never destroyed, and so neither are the types it holds, as
+// threads may still use them after static destructors have run.
+inline StatsRegistry& GlobalStatsRegistry() {
+  static StatsRegistry* const registry = new StatsRegistry;
+  return *registry;
+}
+
+inline TypeStats* RegisterTypeStats(const char* name,
+                                    std::vector<const char*> field_names) {
+  TypeStats* const type = new TypeStats(name, std::move(field_names));
+  StatsRegistry& registry = GlobalStatsRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  registry.types.push_back(type);
+  return type;
+}
+
+// Holds the counters of a type for a thread, and releases them when the thread
+// exits.
+class ThreadStatsHandle {
+ public:
+  explicit ThreadStatsHandle(TypeStats* type)
+      : type_(type), stats_(type->Acquire()) {}
+  ~ThreadStatsHandle() { type_->Release(stats_); }
+
+  ThreadStatsHandle(const ThreadStatsHandle&) = delete;
+  ThreadStatsHandle& operator=(const ThreadStatsHandle&) = delete;
+
+  ThreadStats* get() const { return stats_; }
+
+ private:
+  TypeStats* const type_;
+  ThreadStats* const stats_;
+};
+
+}  // namespace varstruct_internal
+
+// Returns the counters of every varstruct type used so far by any thread, in
+// the order the types were first used.
+inline std::vector<VarstructTypeStats> VarstructStatsSnapshot() {
+  varstruct_internal::StatsRegistry& registry =
+      varstruct_internal::GlobalStatsRegistry();
+  std::vector<varstruct_internal::TypeStats*> types;
+  {
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    types = registry.types;
+  }
+  std::vector<VarstructTypeStats> snapshot;
+  for (const varstruct_internal::TypeStats* type : types) {
+    snapshot.push_back(type->Snapshot());
+  }
+  return snapshot;
+}
+
+#endif  // VARSTRUCT_VARSTRUCT_STATS_H_
@@ -0,0 +1,90 @@
+// Copyright 2017 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests of the usage counters, built with VARSTRUCT_STATS defined.
+
+#include "varstruct_stats.h"
+
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "varstruct.h"
+#include "varstruct_layout_cache.h"
+
+namespace {
+
+DEFINE_VARSTRUCT(CountedStruct) {
+  VARSTRUCT_SCALAR(std::uint32_t, id);
+  VARSTRUCT_ARRAY(std::uint16_t, values);
+};
+
+DEFINE_VARSTRUCT(CachedStruct) { VARSTRUCT_ARRAY(char, name); };
+
+VarstructTypeStats StatsOf(const std::string& name) {
+  for (const VarstructTypeStats& stats : VarstructStatsSnapshot()) {
+    if (stats.name == name) {
+      return stats;
+    }
+  }
+  ADD_FAILURE() << "No stats for " << name;
+  return VarstructTypeStats();
+}
+
+TEST(VarstructStatsTest, CountsCreatesAndFieldBytes) {
+  alignas(8) char buf[16] = {};
+  auto counted = CountedStruct::Create(buf, sizeof(buf), {4});
+  ASSERT_TRUE(counted);
+  EXPECT_FALSE(CountedStruct::Create(buf, sizeof(buf), {8}));
+  counted->set_id(7);
+  EXPECT_EQ(7u, counted->id());
+  counted->set_values(0, 1);
+  std::uint16_t values[3];
+  counted->values_copy_to(values, 1, 3);
+
+  const VarstructTypeStats stats = StatsOf("CountedStruct");
+  EXPECT_EQ(2u, stats.creates);
+  EXPECT_EQ(1u, stats.create_failures);
+  // The record of 12 bytes is in the bucket for 8 to 15 bytes.
+  ASSERT_EQ(33u, stats.size_histogram.size());
+  EXPECT_EQ(1u, stats.size_histogram[4]);
+  ASSERT_EQ(2u, stats.field_bytes.size());
+  EXPECT_EQ("id", stats.field_bytes[0].first);
+  EXPECT_EQ(8u, stats.field_bytes[0].second);
+  EXPECT_EQ("values", stats.field_bytes[1].first);
+  EXPECT_EQ(8u, stats.field_bytes[1].second);
+  EXPECT_EQ(0u, stats.bounds_check_failures);
+}
+
+TEST(VarstructStatsTest, SumsThreadsAndCacheLookups) {
+  VarstructLayoutCache<CachedStruct> cache;
+  std::thread thread([&cache] {
+    cache.Lookup({3});
+    cache.Lookup({3});
+  });
+  thread.join();
+  cache.Lookup({3});
+  cache.Lookup({5});
+
+  // The counters of the thread outlive it.
+  const VarstructTypeStats stats = StatsOf("CachedStruct");
+  EXPECT_EQ(2u, stats.cache_hits);
+  EXPECT_EQ(2u, stats.cache_misses);
+  // Each miss creates the layout.
+  EXPECT_EQ(2u, stats.creates);
+}
+
+}  // namespace
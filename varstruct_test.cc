@@ -14,11 +14,27 @@
 
 #include "varstruct.h"
 
+#include <array>
+#include <cstddef>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
 #include <string>
+#include <thread>
 #include <type_traits>
+#include <vector>
 
 #include "gtest/gtest.h"
+#include "varstruct_arena.h"
+#include "varstruct_iovec.h"
+#include "varstruct_layout_cache.h"
+#include "varstruct_mapped_file.h"
+#include "varstruct_parallel_scan.h"
+#include "varstruct_parser.h"
+#include "varstruct_schema.h"
+#include "varstruct_validate.h"
 
 namespace {
 
@@ -60,6 +76,94 @@ TEST(VarstructTest, ComputesOffsets) {
   // Attempts to perform pointer operations should result in compile errors.
 }
 
+TEST(VarstructTest, NumMembersIsStatic) {
+  static_assert(SimpleStruct::num_members() == 3,
+                "num_members() should be known at compile time");
+  static_assert(EmptyStruct::num_members() == 0,
+                "num_members() should be known at compile time");
+}
+
+TEST(VarstructTest, ArraySizesFromContainers) {
+  const std::array<std::size_t, 2> array_sizes = {{5, 8}};
+  auto from_array = SimpleStruct::Create(array_sizes);
+  EXPECT_EQ(from_array.baz_offset(), 9);
+  EXPECT_EQ(from_array.size_bytes(), 4 + 5 + 8);
+
+  const std::vector<std::size_t> vector_sizes = {5, 8};
+  auto from_vector = SimpleStruct::Create(vector_sizes);
+  EXPECT_EQ(from_vector.baz_offset(), 9);
+  EXPECT_EQ(from_vector.size_bytes(), 4 + 5 + 8);
+
+  auto from_pointer = SimpleStruct::Create({array_sizes.data(), 2});
+  EXPECT_EQ(from_pointer.baz_offset(), 9);
+  EXPECT_EQ(from_pointer.size_bytes(), 4 + 5 + 8);
+}
+
+TEST(VarstructTest, StaticOffsetsAreConstexpr) {
+  constexpr auto simple_struct = SimpleStruct::CreateStatic<5, 8>();
+  static_assert(simple_struct.foo_offset() == 0, "foo_offset() not constexpr");
+  static_assert(simple_struct.bar_offset() == 4, "bar_offset() not constexpr");
+  static_assert(simple_struct.baz_offset() == 9, "baz_offset() not constexpr");
+  static_assert(simple_struct.bar_size() == 5, "bar_size() not constexpr");
+  static_assert(simple_struct.size_bytes() == 4 + 5 + 8,
+                "size_bytes() not constexpr");
+
+  constexpr auto empty = EmptyStruct::CreateStatic<>();
+  static_assert(empty.size_bytes() == 0, "size_bytes() not constexpr");
+}
+
+TEST(VarstructTest, StaticAccessMembers) {
+  struct SimpleStructSource {
+    int32_t foo = 3;
+    char bar[4] = "abc";
+    char baz[5] = "wxyz";
+  } simple_struct_source;
+
+  auto simple_struct =
+      SimpleStruct::CreateStatic<sizeof(SimpleStructSource::bar),
+                                 sizeof(SimpleStructSource::baz)>(
+          &simple_struct_source);
+  static_assert(simple_struct.baz_offset() == 8, "baz_offset() not constexpr");
+
+  EXPECT_EQ(simple_struct.foo(), simple_struct_source.foo);
+  EXPECT_EQ(simple_struct.baz(2), simple_struct_source.baz[2]);
+  simple_struct.set_baz(3, 'a');
+  EXPECT_EQ(string(simple_struct_source.baz), "wxya");
+  EXPECT_DEATH_IF_SUPPORTED(simple_struct.baz(5),
+                            "array_index >= 0 && array_index < array_elems");
+
+  const auto& const_source = simple_struct_source;
+  auto const_struct =
+      SimpleStruct::CreateStatic<4, 5>(&const_source).bind(&const_source);
+  EXPECT_EQ(const_struct.bar(1), 'b');
+}
+
+TEST(VarstructTest, BoundVarstructFootprint) {
+  // Field indices are compile-time constants, so a varstruct only stores its
+  // base pointer and its layout.
+  char buf[4 + 5 + 8];
+  static_assert(sizeof(SimpleStruct::CreateStatic<5, 8>(&buf)) == sizeof(void*),
+                "A static varstruct should only hold its pointer");
+
+  const auto layout = SimpleStruct::Create({5, 8});
+  static_assert(sizeof(layout.bind(&buf)) == 2 * sizeof(void*),
+                "A bound varstruct should only hold two pointers");
+
+  // Varstructs may be passed by value, as through a queue, without allocating.
+  static_assert(std::is_trivially_copyable<decltype(layout.bind(&buf))>::value,
+                "A bound varstruct should be trivially copyable");
+  static_assert(std::is_trivially_copyable<decltype(layout)>::value,
+                "A varstruct should be trivially copyable");
+  static_assert(
+      std::is_trivially_copyable<decltype(SimpleStruct::CreateLazy(
+          static_cast<void*>(&buf), {5, 8}))>::value,
+      "A lazy varstruct should be trivially copyable");
+  static_assert(
+      std::is_trivially_copyable<decltype(
+          layout.bind(&buf).bar_bytes())>::value,
+      "A view should be trivially copyable");
+}
+
 TEST(VarstructTest, NotEnoughArraySizes) {
   EXPECT_DEATH_IF_SUPPORTED(SimpleStruct::Create({}),
                             "!array_sizes\\.empty\\(\\)");
@@ -97,6 +201,101 @@ TEST(VarstructTest, ConstPointer) {
   // Modification is not allowed -- it is a compile error.
 }
 
+TEST(VarstructTest, BindLayout) {
+  const auto layout = SimpleStruct::Create({3, 2});
+
+  char first_buf[] = {'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i'};
+  char second_buf[] = {'j', 'k', 'l', 'm', 'n', 'o', 'p', 'q', 'r'};
+
+  auto first = layout.bind(&first_buf);
+  auto second = layout.bind(&second_buf);
+  EXPECT_EQ(first.bar_offset(), 4);
+  EXPECT_EQ(first.baz_offset(), 7);
+  EXPECT_EQ(first.size_bytes(), 9);
+  EXPECT_EQ(first.bar(0), 'e');
+  EXPECT_EQ(second.bar(0), 'n');
+
+  second.set_baz(1, 'z');
+  EXPECT_EQ(second_buf[8], 'z');
+  EXPECT_EQ(first_buf[8], 'i');
+
+  // Binding a const pointer produces a read-only varstruct.
+  const char* const_buf = first_buf;
+  auto const_view = layout.bind(const_buf);
+  EXPECT_EQ(const_view.baz(0), 'h');
+
+  // A bound varstruct may itself be rebound, sharing the same offsets.
+  auto rebound = first.bind(&second_buf);
+  EXPECT_EQ(rebound.baz(1), 'z');
+}
+
+TEST(VarstructTest, ArrayViews) {
+  char buf[] = {'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i'};
+  auto simple_struct = SimpleStruct::Create(&buf, {3, 2});
+
+  auto bar_bytes = simple_struct.bar_bytes();
+  EXPECT_EQ(bar_bytes.data(), &buf[4]);
+  EXPECT_EQ(bar_bytes.size(), 3);
+  EXPECT_EQ(string(bar_bytes.begin(), bar_bytes.end()), "efg");
+
+  auto baz_span = simple_struct.baz_span();
+  baz_span[1] = 'z';
+  EXPECT_EQ(buf[8], 'z');
+
+  const char* const_buf = buf;
+  auto const_struct = SimpleStruct::Create(const_buf, {3, 2});
+  static_assert(std::is_same<decltype(const_struct.baz_span().data()),
+                             const char*>::value,
+                "Views of const varstructs should be const");
+  EXPECT_EQ(string(const_struct.baz_bytes().data(), 2), "hz");
+}
+
+TEST(VarstructTest, BulkCopy) {
+  char buf[] = {'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i'};
+  auto simple_struct = SimpleStruct::Create(&buf, {3, 2});
+
+  char out[3] = {};
+  simple_struct.bar_copy_to(out, 1, 2);
+  EXPECT_EQ(string(out, 2), "fg");
+
+  simple_struct.set_bar_from("xyz", 0, 3);
+  EXPECT_EQ(string(&buf[4], 3), "xyz");
+
+  // Empty ranges at the end of the array are allowed.
+  simple_struct.bar_copy_to(out, 3, 0);
+
+  EXPECT_DEATH_IF_SUPPORTED(
+      simple_struct.bar_copy_to(out, 2, 2),
+      "first <= array_elems && count <= array_elems - first");
+  EXPECT_DEATH_IF_SUPPORTED(
+      simple_struct.set_baz_from("xyz", 0, 3),
+      "first <= array_elems && count <= array_elems - first");
+
+  // This runs past the end of bar, but not past the end of buf.
+  simple_struct.set_bar_from</*bounds_check=*/false>("12", 2, 2);
+  EXPECT_EQ(buf[7], '2');
+}
+
+DEFINE_VARSTRUCT(AlignedArray) {
+  VARSTRUCT_SCALAR(uint32_t, count);
+  VARSTRUCT_ARRAY(uint32_t, values);
+};
+
+TEST(VarstructTest, AlignedArraySpan) {
+  uint32_t buf[] = {3, 10, 20, 30};
+  auto aligned_array = AlignedArray::Create(&buf, {3});
+
+  auto values = aligned_array.values_span</*assume_aligned=*/true>();
+  EXPECT_EQ(values.size(), 3);
+  EXPECT_EQ(values[2], 30);
+  EXPECT_EQ(aligned_array.values_bytes().size(), 3 * sizeof(uint32_t));
+
+  auto misaligned_array =
+      AlignedArray::Create(reinterpret_cast<char*>(&buf) + 1, {2});
+  EXPECT_DEATH_IF_SUPPORTED(
+      misaligned_array.values_span</*assume_aligned=*/true>(), "alignof");
+}
+
 DEFINE_VARSTRUCT(NonstandardAlignment) {
   VARSTRUCT_SCALAR(char, first);
   VARSTRUCT_SCALAR(uint32_t, second);
@@ -115,6 +314,119 @@ TEST(VarstructTest, NonstandardAlignment) {
 }
 
 
+DEFINE_VARSTRUCT(MixedEndian) {
+  VARSTRUCT_SCALAR_BE(uint32_t, be_scalar);
+  VARSTRUCT_SCALAR_LE(uint16_t, le_scalar);
+  VARSTRUCT_ARRAY_BE(uint16_t, be_array);
+  VARSTRUCT_SCALAR_BE(uint16_t, be_len);
+  VARSTRUCT_ARRAY_SIZED_BY(char, sized, be_len);
+};
+
+TEST(VarstructTest, ByteOrder) {
+  unsigned char buf[] = {0x01, 0x02, 0x03, 0x04,  // be_scalar
+                         0x05, 0x06,              // le_scalar
+                         0x00, 0x07, 0x00, 0x08,  // be_array
+                         0x00, 0x02,              // be_len
+                         'h',  'i'};
+  auto mixed_endian = MixedEndian::Create(&buf, {2});
+  EXPECT_EQ(mixed_endian.be_scalar(), 0x01020304);
+  EXPECT_EQ(mixed_endian.le_scalar(), 0x0605);
+  EXPECT_EQ(mixed_endian.be_array(1), 0x0008);
+  EXPECT_EQ(mixed_endian.sized_size(), 2);
+  EXPECT_EQ(mixed_endian.sized(1), 'i');
+
+  uint16_t be_array[2];
+  mixed_endian.be_array_copy_to(be_array, 0, 2);
+  EXPECT_EQ(be_array[0], 0x0007);
+  EXPECT_EQ(be_array[1], 0x0008);
+
+  mixed_endian.set_be_scalar(0x0a0b0c0d);
+  EXPECT_EQ(buf[0], 0x0a);
+  EXPECT_EQ(buf[3], 0x0d);
+  mixed_endian.set_le_scalar(0x0e0f);
+  EXPECT_EQ(buf[4], 0x0f);
+  EXPECT_EQ(buf[5], 0x0e);
+
+  const uint16_t new_array[] = {0x1112, 0x1314};
+  mixed_endian.set_be_array_from(new_array, 0, 2);
+  EXPECT_EQ(buf[6], 0x11);
+  EXPECT_EQ(buf[9], 0x14);
+  mixed_endian.set_be_array(0, 0x1516);
+  EXPECT_EQ(buf[6], 0x15);
+  EXPECT_EQ(buf[7], 0x16);
+}
+
+DEFINE_VARSTRUCT(PackedHeader) {
+  VARSTRUCT_BITS(uint8_t, version, 4);
+  VARSTRUCT_BITS(uint8_t, options_len, 4);
+  VARSTRUCT_BITS_BE(uint16_t, flags, 3);
+  VARSTRUCT_BITS_BE(uint16_t, fragment_offset, 13);
+  VARSTRUCT_BITS_BE(uint16_t, ttl, 8);
+  VARSTRUCT_ARRAY_SIZED_BY(char, options, options_len);
+};
+
+TEST(VarstructTest, BitFields) {
+  unsigned char buf[] = {0x42,        // version = 4, options_len = 2
+                         0xa1, 0x23,  // flags = 5, fragment_offset = 0x123
+                         0x07, 0x00,  // ttl = 7, 8 unused bits
+                         'o',  'p'};
+  auto header = PackedHeader::Create(&buf, sizeof(buf), {});
+  ASSERT_TRUE(header);
+  EXPECT_EQ(header->version(), 4);
+  EXPECT_EQ(header->options_len(), 2);
+  EXPECT_EQ(header->flags(), 5);
+  EXPECT_EQ(header->fragment_offset(), 0x123);
+  EXPECT_EQ(header->ttl(), 7);
+  EXPECT_EQ(header->options(1), 'p');
+  EXPECT_EQ(header->size_bytes(), sizeof(buf));
+
+  // Fields in the same word share its offset and size. ttl does not fit in
+  // the word of fragment_offset, so it starts another.
+  EXPECT_EQ(header->options_len_offset(), 0);
+  EXPECT_EQ(header->flags_offset(), 1);
+  EXPECT_EQ(header->fragment_offset_offset(), 1);
+  EXPECT_EQ(header->ttl_offset(), 3);
+  EXPECT_EQ(header->fragment_offset_size(), 2);
+  EXPECT_EQ(header->fragment_offset_width(), 13);
+  constexpr auto kLayout = PackedHeader::CreateStatic<2>();
+  static_assert(kLayout.options_offset() == 5, "");
+
+  // Setters leave the other fields of the word unchanged.
+  header->set_flags(2);
+  EXPECT_EQ(buf[1], 0x41);
+  EXPECT_EQ(buf[2], 0x23);
+  header->set_fragment_offset(0x1fff);
+  EXPECT_EQ(header->flags(), 2);
+  EXPECT_EQ(header->fragment_offset(), 0x1fff);
+  EXPECT_DEATH_IF_SUPPORTED(header->set_version(16), "BitMask");
+
+  // Build() zeroes the unused bits.
+  unsigned char built[sizeof(buf)];
+  std::memset(built, 0xff, sizeof(built));
+  auto copy = PackedHeader::Build(&built, sizeof(built), 4, 2, 2, 0x1fff, 7,
+                                  std::string("op"));
+  ASSERT_TRUE(copy);
+  EXPECT_EQ(std::memcmp(built, buf, sizeof(buf)), 0);
+  EXPECT_TRUE(copy->Equals(*header));
+}
+
+DEFINE_VARSTRUCT(Nibbles) {
+  VARSTRUCT_BITS(uint8_t, hi, 4);
+  VARSTRUCT_BITS(uint8_t, lo, 4);
+};
+
+TEST(VarstructTest, BitFieldsOutOfWidth) {
+  // A value wider than its field asserts, and is otherwise truncated without
+  // touching the other field of the word.
+  unsigned char buf[1] = {};
+  auto nibbles = Nibbles::Create(&buf);
+  nibbles.set_hi(2);
+  EXPECT_DEBUG_DEATH(nibbles.set_lo(0x1f), "BitMask");
+  EXPECT_EQ(nibbles.hi(), 2);
+  EXPECT_DEBUG_DEATH(Nibbles::Build(&buf, sizeof(buf), 2, 0x1f), "BitMask");
+  EXPECT_EQ(nibbles.hi(), 2);
+}
+
 struct InternalStruct {
   int a;
   char b;
@@ -171,6 +483,1100 @@ TEST(VarstructTest, OutOfBoundsChecks) {
   EXPECT_EQ(the_source_array[kTheArraySize], 'a');
 }
 
+DEFINE_VARSTRUCT(Tlv) {
+  VARSTRUCT_SCALAR(uint8_t, name_len);
+  VARSTRUCT_ARRAY_SIZED_BY(char, name, name_len);
+  VARSTRUCT_ARRAY(char, tag);
+  VARSTRUCT_SCALAR(uint16_t, value_len);
+  VARSTRUCT_ARRAY_SIZED_BY(char, value, value_len);
+};
+
+TEST(VarstructTest, ArraySizedByField) {
+  // name_len = 3, name = "abc", tag = "t", value_len = 2, value = "xy".
+  char buf[] = {3, 'a', 'b', 'c', 't', 0, 0, 'x', 'y'};
+  const uint16_t value_len = 2;
+  std::memcpy(&buf[5], &value_len, sizeof(value_len));
+
+  // Only the size of tag is passed in; the others are read from buf.
+  auto tlv = Tlv::Create(&buf, {1});
+  EXPECT_EQ(tlv.name_size(), 3);
+  EXPECT_EQ(tlv.tag_offset(), 4);
+  EXPECT_EQ(tlv.value_len_offset(), 5);
+  EXPECT_EQ(tlv.value_offset(), 7);
+  EXPECT_EQ(tlv.size_bytes(), sizeof(buf));
+  EXPECT_EQ(tlv.name(2), 'c');
+  EXPECT_EQ(tlv.value(1), 'y');
+  EXPECT_DEATH_IF_SUPPORTED(tlv.value(2),
+                            "array_index >= 0 && array_index < array_elems");
+
+  // Without a pointer, every array size is passed in.
+  auto layout = Tlv::Create({3, 1, 2});
+  EXPECT_EQ(layout.value_offset(), 7);
+  EXPECT_EQ(layout.size_bytes(), sizeof(buf));
+}
+
+TEST(VarstructTest, LazyOffsets) {
+  char buf[] = {3, 'a', 'b', 'c', 't', 0, 0, 'x', 'y'};
+  const uint16_t value_len = 2;
+  std::memcpy(&buf[5], &value_len, sizeof(value_len));
+
+  auto tlv = Tlv::CreateLazy(&buf, {1});
+  EXPECT_EQ(tlv.name(2), 'c');
+  EXPECT_EQ(tlv.value_offset(), 7);
+  EXPECT_EQ(tlv.value(1), 'y');
+  EXPECT_EQ(tlv.size_bytes(), sizeof(buf));
+
+  // Only the offsets up to the member accessed are computed, so a prefix may
+  // be read without the sizes of the arrays after it.
+  const char* const_buf = buf;
+  auto prefix = Tlv::CreateLazy(const_buf, {});
+  EXPECT_EQ(prefix.name_len(), 3);
+  EXPECT_EQ(prefix.name(0), 'a');
+  EXPECT_DEATH_IF_SUPPORTED(prefix.size_bytes(), "!array_sizes.empty()");
+
+  // Binding shares the offsets, all of which are computed first.
+  const auto layout = SimpleStruct::CreateLazy(const_buf, {3, 2});
+  auto bound = layout.bind(&buf);
+  EXPECT_EQ(bound.baz_offset(), 7);
+  EXPECT_EQ(bound.size_bytes(), 9);
+}
+
+TEST(VarstructTest, ValidatesBufferLength) {
+  char buf[4 + 5 + 8] = {};
+  auto fits = SimpleStruct::Create(&buf, sizeof(buf), {5, 8});
+  ASSERT_TRUE(fits);
+  EXPECT_EQ(fits->baz_offset(), 9);
+  fits->set_baz</*bounds_check=*/false>(7, 'a');
+  EXPECT_EQ(buf[16], 'a');
+
+  EXPECT_FALSE(SimpleStruct::Create(&buf, sizeof(buf) - 1, {5, 8}));
+
+  const char* const_buf = buf;
+  auto const_fits = SimpleStruct::Create(const_buf, sizeof(buf), {5, 8});
+  ASSERT_TRUE(const_fits);
+  EXPECT_EQ((*const_fits).baz(7), 'a');
+}
+
+TEST(VarstructTest, ValidatesBufferLengthBeforeReadingSizes) {
+  char buf[] = {3, 'a', 'b', 'c', 't', 2, 0, 'x', 'y'};
+
+  // Too short for value.
+  EXPECT_FALSE(Tlv::Create(&buf, sizeof(buf) - 1, {1}));
+
+  // Too short for value_len, which therefore must not be read.
+  EXPECT_FALSE(Tlv::Create(&buf, 6, {1}));
+
+  // Too short for name_len.
+  EXPECT_FALSE(Tlv::Create(&buf, 0, {1}));
+}
+
+DEFINE_VARSTRUCT(Frame) {
+  VARSTRUCT_SCALAR(uint8_t, tag_len);
+  VARSTRUCT_ARRAY_SIZED_BY(char, tag, tag_len);
+  VARSTRUCT_TRAILING_ARRAY(uint16_t, payload);
+};
+
+DEFINE_VARSTRUCT_ALIGNED(AlignedFrame) {
+  VARSTRUCT_SCALAR(uint32_t, type);
+  VARSTRUCT_TRAILING_ARRAY(char, payload);
+};
+
+TEST(VarstructTest, TrailingArray) {
+  // tag_len = 2, tag = "ab", payload = {1, 2} and one byte left over.
+  char buf[] = {2, 'a', 'b', 0, 0, 0, 0, 'x'};
+  const uint16_t payload[] = {1, 2};
+  std::memcpy(&buf[3], payload, sizeof(payload));
+
+  // The payload takes up the whole elements in the rest of the buffer.
+  auto frame = Frame::Create(&buf, sizeof(buf), {});
+  ASSERT_TRUE(frame);
+  EXPECT_EQ(frame->payload_offset(), 3);
+  EXPECT_EQ(frame->payload_size(), 4);
+  EXPECT_EQ(frame->payload(1), 2);
+  EXPECT_EQ(frame->size_bytes(), 7);
+  EXPECT_EQ(Frame::Create(&buf, 3, {})->payload_size(), 0);
+  EXPECT_FALSE(Frame::Create(&buf, 2, {}));
+
+  // Without the length of the buffer, its size is passed in.
+  EXPECT_EQ(Frame::Create(&buf, {1}).payload_size(), 2);
+  EXPECT_EQ(Frame::Create({2, 1}).size_bytes(), 5);
+  static_assert(Frame::CreateStatic<2, 1>().size_bytes() == 5, "");
+
+  // The padding at the end of an aligned varstruct is left out.
+  alignas(4) char aligned_buf[11] = {};
+  auto aligned_frame =
+      AlignedFrame::Create(&aligned_buf, sizeof(aligned_buf), {});
+  ASSERT_TRUE(aligned_frame);
+  EXPECT_EQ(aligned_frame->payload_size(), 4);
+  EXPECT_EQ(aligned_frame->size_bytes(), 8);
+}
+
+DEFINE_VARSTRUCT(OnlySizedBy) {
+  VARSTRUCT_SCALAR(uint8_t, len);
+  VARSTRUCT_ARRAY_SIZED_BY(char, data, len);
+};
+
+TEST(VarstructTest, CreateWithOnlyPointer) {
+  const char buf[] = {2, 'h', 'i'};
+  auto only_sized_by = OnlySizedBy::Create(&buf);
+  EXPECT_EQ(only_sized_by.size_bytes(), 3);
+  EXPECT_EQ(only_sized_by.data(1), 'i');
+}
+
+TEST(VarstructTest, RangeOfFixedLayout) {
+  // Three records of SimpleStruct::Create({1, 2}), which are 7 bytes each, and
+  // 3 trailing bytes.
+  char buf[3 * 7 + 3] = {};
+  for (int i = 0; i < 3; i++) {
+    SimpleStruct::Create(&buf[7 * i], {1, 2}).set_foo(i);
+  }
+
+  int expected_foo = 0;
+  for (const auto& record : SimpleStruct::CreateRange(&buf, sizeof(buf),
+                                                      {1, 2}, 64)) {
+    EXPECT_EQ(record.foo(), expected_foo++);
+    EXPECT_EQ(record.size_bytes(), 7);
+  }
+  EXPECT_EQ(expected_foo, 3);
+
+  const char* const_buf = buf;
+  const auto range = SimpleStruct::CreateRange(const_buf, sizeof(buf), {1, 2});
+  auto it = range.begin();
+  for (int i = 0; i < 3; i++) {
+    ASSERT_NE(it, range.end());
+    EXPECT_EQ(it.offset(), 7 * i);
+    ++it;
+  }
+  EXPECT_EQ(it, range.end());
+  EXPECT_EQ(it.offset(), 21);
+
+  auto empty = SimpleStruct::CreateRange(&buf, 6, {1, 2});
+  EXPECT_EQ(empty.begin(), empty.end());
+}
+
+DEFINE_VARSTRUCT_ALIGNED(AlignedStruct) {
+  VARSTRUCT_SCALAR(char, tag);
+  VARSTRUCT_SCALAR(uint32_t, id);
+  VARSTRUCT_ARRAY(char, name);
+  VARSTRUCT_ARRAY(uint64_t, values);
+  VARSTRUCT_SCALAR(uint16_t, flags);
+};
+
+DEFINE_VARSTRUCT_ALIGNED_TO(CacheLineStruct, 64) {
+  VARSTRUCT_SCALAR(uint32_t, producer);
+  VARSTRUCT_SCALAR(uint32_t, consumer);
+};
+
+TEST(VarstructTest, AlignedLayout) {
+  auto layout = AlignedStruct::Create({3, 2});
+  EXPECT_EQ(AlignedStruct::alignment(), 8);
+  EXPECT_EQ(layout.id_offset(), 4);
+  EXPECT_EQ(layout.name_offset(), 8);
+  EXPECT_EQ(layout.name_size(), 3);
+  EXPECT_EQ(layout.values_offset(), 16);
+  EXPECT_EQ(layout.values_size(), 16);
+  EXPECT_EQ(layout.flags_offset(), 32);
+  // Padded for the next varstruct stored back to back.
+  EXPECT_EQ(layout.size_bytes(), 40);
+
+  constexpr auto static_layout = AlignedStruct::CreateStatic<3, 2>();
+  static_assert(static_layout.values_offset() == 16, "");
+  static_assert(static_layout.size_bytes() == 40, "");
+
+  alignas(8) char buf[40] = {};
+  auto aligned = AlignedStruct::Create(&buf, {3, 2});
+  aligned.set_values(1, 42);
+  // No assume_aligned is needed.
+  auto values = aligned.values_span();
+  EXPECT_EQ(values.data(), reinterpret_cast<uint64_t*>(&buf[16]));
+  EXPECT_EQ(values[1], 42);
+
+  auto built = AlignedStruct::Build(&buf, sizeof(buf), 'a', 7,
+                                    std::string("xyz"),
+                                    std::vector<uint64_t>{1, 2}, 9);
+  ASSERT_TRUE(built);
+  EXPECT_EQ(buf[8], 'x');
+  EXPECT_EQ(aligned.values(1), 2);
+  EXPECT_EQ(aligned.flags(), 9);
+
+  EXPECT_DEATH_IF_SUPPORTED(AlignedStruct::Create(&buf[1], {3, 2}),
+                            "alignment\\(\\) == 0");
+
+  constexpr auto cache_lines = CacheLineStruct::CreateStatic<>();
+  static_assert(cache_lines.consumer_offset() == 64, "");
+  static_assert(cache_lines.size_bytes() == 128, "");
+  static_assert(CacheLineStruct::alignment() == 64, "");
+
+  // Packed varstructs are unaffected.
+  static_assert(SimpleStruct::alignment() == 1, "");
+}
+
+DEFINE_VARSTRUCT(Envelope) {
+  VARSTRUCT_SCALAR(uint16_t, id);
+  VARSTRUCT_NESTED(SimpleStruct, header);
+  VARSTRUCT_NESTED_ARRAY(SimpleStruct, entries);
+  VARSTRUCT_NESTED(OnlySizedBy, trailer);
+};
+
+TEST(VarstructTest, NestedVarstructs) {
+  // header is SimpleStruct::Create({2, 1}), entries has 2 elements of
+  // SimpleStruct::Create({1, 0}), and trailer holds 2 bytes.
+  char buf[2 + 7 + 2 * 5 + 3] = {};
+  SimpleStruct::Create(&buf[2], {2, 1}).set_foo(1);
+  SimpleStruct::Create(&buf[9], {1, 0}).set_foo(2);
+  SimpleStruct::Create(&buf[14], {1, 0}).set_foo(3);
+  buf[19] = 2;
+  buf[21] = 'z';
+
+  auto envelope = Envelope::Create(&buf, {2, 1, 2, 1, 0});
+  EXPECT_EQ(envelope.num_members(), 4);
+  EXPECT_EQ(envelope.header_offset(), 2);
+  EXPECT_EQ(envelope.header_size(), 7);
+  EXPECT_EQ(envelope.entries_offset(), 9);
+  EXPECT_EQ(envelope.entries_size(), 10);
+  EXPECT_EQ(envelope.trailer_offset(), 19);
+  EXPECT_EQ(envelope.size_bytes(), sizeof(buf));
+
+  auto header = envelope.header();
+  EXPECT_EQ(header.baz_offset(), 6);
+  EXPECT_EQ(header.foo(), 1);
+  EXPECT_EQ(envelope.entries(0).foo(), 2);
+  EXPECT_EQ(envelope.entries(1).foo(), 3);
+  EXPECT_EQ(envelope.entries(1).size_bytes(), 5);
+  EXPECT_EQ(envelope.trailer().data(1), 'z');
+  EXPECT_DEATH_IF_SUPPORTED(envelope.entries(2),
+                            "array_index >= 0 && array_index < array_elems");
+
+  envelope.header().set_bar(1, 'b');
+  EXPECT_EQ(buf[7], 'b');
+
+  // Without a pointer, sizes of sized-by arrays of nested varstructs are
+  // passed in too.
+  auto layout = Envelope::Create({2, 1, 2, 1, 0, 2});
+  EXPECT_EQ(layout.trailer().data_offset(), 1);
+  EXPECT_EQ(layout.size_bytes(), sizeof(buf));
+
+  // The sized-by arrays of nested varstructs are validated as well.
+  EXPECT_TRUE(Envelope::Create(&buf, sizeof(buf), {2, 1, 2, 1, 0}));
+  EXPECT_FALSE(Envelope::Create(&buf, sizeof(buf) - 1, {2, 1, 2, 1, 0}));
+  EXPECT_FALSE(Envelope::Create(&buf, 19, {2, 1, 2, 1, 0}));
+}
+
+TEST(VarstructTest, Build) {
+  char buf[32] = {};
+  const std::string bar = "abcde";
+  const std::vector<char> baz = {'1', '2', '3'};
+  auto simple_struct = SimpleStruct::Build(&buf, sizeof(buf), 7, bar, baz);
+  ASSERT_TRUE(simple_struct);
+  EXPECT_EQ(simple_struct->size_bytes(), 4 + 5 + 3);
+  EXPECT_EQ(simple_struct->foo(), 7);
+  EXPECT_EQ(simple_struct->bar(4), 'e');
+  EXPECT_EQ(simple_struct->baz(2), '3');
+  EXPECT_EQ(std::memcmp(&buf[4], "abcde123", 8), 0);
+
+  // Empty arrays, whose data() may be null, write no bytes.
+  auto empty_arrays = SimpleStruct::Build(&buf, sizeof(buf), 8, std::string(),
+                                          std::vector<char>());
+  ASSERT_TRUE(empty_arrays);
+  EXPECT_EQ(empty_arrays->size_bytes(), 4);
+  EXPECT_EQ(empty_arrays->foo(), 8);
+  empty_arrays->set_bar_from(nullptr, 0, 0);
+
+  // Too short; nothing is written.
+  char short_buf[11] = {};
+  EXPECT_FALSE(SimpleStruct::Build(&short_buf, sizeof(short_buf), 7, bar, baz));
+  EXPECT_EQ(short_buf[0], 0);
+
+  // Values are written in the byte order of their fields.
+  auto mixed = MixedEndian::Build(&buf, sizeof(buf), 0x12345678, 0x9abc,
+                                  std::vector<uint16_t>{0x0102}, 2,
+                                  std::string("hi"));
+  ASSERT_TRUE(mixed);
+  EXPECT_EQ(static_cast<unsigned char>(buf[0]), 0x12);
+  EXPECT_EQ(mixed->le_scalar(), 0x9abc);
+  EXPECT_EQ(mixed->be_array(0), 0x0102);
+  EXPECT_EQ(static_cast<unsigned char>(buf[6]), 0x01);
+  EXPECT_EQ(mixed->sized(1), 'i');
+
+  // Values may be views of another varstruct.
+  char copy[32] = {};
+  auto tlv = Tlv::Build(&buf, sizeof(buf), 3, std::string("abc"),
+                        std::string("t"), 2, std::string("xy"));
+  ASSERT_TRUE(tlv);
+  auto name = tlv->name_bytes();
+  auto tlv_copy = Tlv::Build(&copy, sizeof(copy), 3, name, std::string("t"), 2,
+                             tlv->value_span());
+  ASSERT_TRUE(tlv_copy);
+  EXPECT_EQ(std::memcmp(buf, copy, tlv->size_bytes()), 0);
+  EXPECT_EQ(Tlv::Create(&copy, {1}).value(1), 'y');
+
+  // The count field of a sized-by array must match its size, as stored, or
+  // nothing is written.
+  char mismatched[32] = {};
+  EXPECT_FALSE(Tlv::Build(&mismatched, sizeof(mismatched), 2,
+                          std::string("abc"), std::string("t"), 2,
+                          std::string("xy")));
+  // A name_len of 256 is stored as 0.
+  EXPECT_FALSE(Tlv::Build(&mismatched, sizeof(mismatched), 256,
+                          std::string(256, 'a'), std::string("t"), 2,
+                          std::string("xy")));
+  EXPECT_EQ(std::memcmp(mismatched, std::string(32, '\0').data(), 32), 0);
+}
+
+TEST(VarstructTest, AllocateAndCreate) {
+  // A copy, as EXPECT_EQ() takes its arguments by reference.
+  const std::size_t kChunkSize = VarstructArena::kChunkSize;
+  VarstructArena arena;
+  auto first = SimpleStruct::AllocateAndCreate(&arena, {5, 8});
+  auto second = SimpleStruct::AllocateAndCreate(&arena, {5, 8});
+  EXPECT_EQ(first.size_bytes(), 4 + 5 + 8);
+  first.set_foo(1);
+  second.set_foo(2);
+  first.set_baz(7, 'a');
+  EXPECT_EQ(first.foo(), 1);
+  EXPECT_EQ(second.foo(), 2);
+  EXPECT_EQ(first.baz(7), 'a');
+  EXPECT_EQ(arena.capacity(), kChunkSize);
+
+  // Larger than a chunk.
+  auto large = SimpleStruct::AllocateAndCreate(&arena, {kChunkSize, 0});
+  large.set_bar(kChunkSize - 1, 'b');
+  EXPECT_EQ(large.bar(kChunkSize - 1), 'b');
+  const std::size_t capacity = arena.capacity();
+  EXPECT_GT(capacity, 2 * kChunkSize);
+
+  // Reset() reuses the chunks, starting over at the first.
+  arena.Reset();
+  auto reused = SimpleStruct::AllocateAndCreate(&arena, {5, 8});
+  EXPECT_EQ(reused.bar_bytes().data(), first.bar_bytes().data());
+  EXPECT_EQ(arena.capacity(), capacity);
+}
+
+TEST(VarstructArenaTest, Alignment) {
+  VarstructArena arena;
+  arena.Allocate(1);
+  void* aligned = arena.Allocate(8, 8);
+  EXPECT_EQ(reinterpret_cast<std::uintptr_t>(aligned) % 8, 0);
+}
+
+// Records the description of each field passed to it by ForEachField().
+struct FieldRecorder {
+  template <typename Field>
+  void operator()(const Field& field) {
+    names.push_back(field.name());
+    offsets.push_back(field.offset);
+    sizes.push_back(field.size);
+    type_sizes.push_back(sizeof(typename Field::type));
+    arrays.push_back(field.is_array());
+  }
+
+  std::vector<string> names;
+  std::vector<std::size_t> offsets;
+  std::vector<std::size_t> sizes;
+  std::vector<std::size_t> type_sizes;
+  std::vector<bool> arrays;
+};
+
+TEST(VarstructTest, ForEachField) {
+  FieldRecorder recorder;
+  SimpleStruct::Create({5, 8}).ForEachField(recorder);
+  EXPECT_EQ(recorder.names, (std::vector<string>{"foo", "bar", "baz"}));
+  EXPECT_EQ(recorder.offsets, (std::vector<std::size_t>{0, 4, 9}));
+  EXPECT_EQ(recorder.sizes, (std::vector<std::size_t>{4, 5, 8}));
+  EXPECT_EQ(recorder.type_sizes, (std::vector<std::size_t>{4, 1, 1}));
+  EXPECT_EQ(recorder.arrays, (std::vector<bool>{false, true, true}));
+
+  FieldRecorder empty;
+  EmptyStruct::Create({}).ForEachField(empty);
+  EXPECT_TRUE(empty.names.empty());
+}
+
+// Sums the scalars of a varstruct, whatever their fields.
+struct ScalarSum {
+  template <typename Field>
+  void operator()(const Field& field) {
+    if (!field.is_array()) {
+      typename Field::type value;
+      std::memcpy(&value, field.data, sizeof(value));
+      sum += value;
+    }
+  }
+
+  int sum;
+};
+
+TEST(VarstructTest, ForEachFieldData) {
+  char buf[4 + 2 + 4] = {};
+  auto aligned = AlignedArray::Create(&buf, {1});
+  aligned.set_count(3);
+  auto simple = SimpleStruct::CreateStatic<1, 1>(&buf);
+  ScalarSum sum = {0};
+  aligned.ForEachField(sum);
+  simple.ForEachField(sum);
+  EXPECT_EQ(sum.sum, 6);
+}
+
+DEFINE_VARSTRUCT(Record) {
+  VARSTRUCT_SCALAR(uint32_t, id);
+  VARSTRUCT_SCALAR(uint64_t, timestamp);
+  VARSTRUCT_EXCLUDE_FROM_HASH(timestamp);
+  VARSTRUCT_ARRAY(char, key);
+  VARSTRUCT_ARRAY(char, value);
+};
+
+TEST(VarstructTest, HashAndEquals) {
+  const string first_bytes = string(12, '\0') + "keyvalue";
+  string second_bytes = first_bytes;
+  const auto first = Record::Create(first_bytes.data(), {3, 5});
+  auto second = Record::Create(&second_bytes[0], {3, 5});
+  EXPECT_TRUE(first.Equals(second));
+  EXPECT_EQ(first.Hash(), second.Hash());
+  EXPECT_NE(first.Hash(), first.Hash(1));
+
+  // Excluded fields are ignored.
+  second.set_timestamp(1234);
+  EXPECT_TRUE(first.Equals(second));
+  EXPECT_EQ(first.Hash(), second.Hash());
+
+  second.set_value(4, 'x');
+  EXPECT_FALSE(first.Equals(second));
+  EXPECT_NE(first.Hash(), second.Hash());
+
+  // The same bytes split between the arrays differently are not equal.
+  const auto resized = Record::Create(first_bytes.data(), {4, 4});
+  EXPECT_FALSE(first.Equals(resized));
+
+  // Any views of the same type may be compared.
+  const auto layout = Record::Create({3, 5});
+  EXPECT_TRUE(layout.bind(first_bytes.data()).Equals(first));
+  const auto static_view = Record::CreateStatic<3, 5>(first_bytes.data());
+  EXPECT_TRUE(static_view.Equals(first));
+}
+
+TEST(VarstructTest, HashSkipsPadding) {
+  alignas(8) char first_buf[24];
+  alignas(8) char second_buf[24];
+  std::memset(first_buf, 0, sizeof(first_buf));
+  std::memset(second_buf, 0xff, sizeof(second_buf));
+  auto first = AlignedStruct::Create(&first_buf, {1, 0});
+  auto second = AlignedStruct::Create(&second_buf, {1, 0});
+  for (auto* varstruct : {&first, &second}) {
+    varstruct->set_tag('t');
+    varstruct->set_id(7);
+    varstruct->set_name(0, 'n');
+    varstruct->set_flags(3);
+  }
+  ASSERT_EQ(first.size_bytes(), sizeof(first_buf));
+
+  // Only the padding differs.
+  EXPECT_TRUE(first.Equals(second));
+  EXPECT_EQ(first.Hash(), second.Hash());
+  second.set_id(8);
+  EXPECT_FALSE(first.Equals(second));
+}
+
+// Writes contents to a new temporary file and returns its path.
+string WriteTempFile(const string& name, const string& contents) {
+  const char* dir = std::getenv("TEST_TMPDIR");
+  const string path = string(dir != nullptr ? dir : "/tmp") + "/" + name;
+  std::FILE* file = std::fopen(path.c_str(), "wb");
+  EXPECT_NE(file, nullptr);
+  EXPECT_EQ(std::fwrite(contents.data(), 1, contents.size(), file),
+            contents.size());
+  std::fclose(file);
+  return path;
+}
+
+TEST(MappedVarstructFileTest, ReadsRecords) {
+  // Three Tlv records, then a truncated one.
+  string contents;
+  for (char c : string("xyz")) {
+    contents += string{2, c, c, 't', 0, 0};
+  }
+  contents += string{5, 'a'};
+  const string path = WriteTempFile("tlv_records", contents);
+
+  MappedVarstructFile<Tlv> file;
+  ASSERT_TRUE(file.Open(path.c_str(), MappedVarstructFile<Tlv>::kSequential |
+                                          MappedVarstructFile<Tlv>::kWillNeed));
+  EXPECT_EQ(file.size(), contents.size());
+  string names;
+  for (const auto& record : file.records({1})) {
+    names += record.name(0);
+  }
+  EXPECT_EQ(names, "xyz");
+
+  EXPECT_EQ(file.BuildIndex({1}), 3);
+  EXPECT_EQ(file.record(2).name(1), 'z');
+  EXPECT_EQ(file.record(1).tag(0), 't');
+
+  // The mapping moves with the file.
+  MappedVarstructFile<Tlv> moved = std::move(file);
+  EXPECT_EQ(moved.num_records(), 3);
+  EXPECT_EQ(moved.record(0).name(0), 'x');
+  std::remove(path.c_str());
+}
+
+TEST(MappedVarstructFileTest, EmptyAndMissingFiles) {
+  const string path = WriteTempFile("empty_records", "");
+  MappedVarstructFile<SimpleStruct> file;
+  ASSERT_TRUE(file.Open(path.c_str()));
+  EXPECT_EQ(file.size(), 0);
+  EXPECT_EQ(file.BuildIndex({1, 1}), 0);
+  std::remove(path.c_str());
+
+  EXPECT_FALSE(file.Open("/nonexistent/records"));
+}
+
+TEST(MappedVarstructFileTest, IndexesTrailingArrays) {
+  // Three AlignedFrame records with a 3-byte payload, padded to 8 bytes.
+  string contents;
+  for (char i = 0; i < 3; i++) {
+    contents += string{i, 0, 0, 0, 'p', 'q', static_cast<char>('x' + i), 0};
+  }
+  const string path = WriteTempFile("aligned_frame_records", contents);
+
+  // Every record has the payload size passed in, rather than taking up the
+  // rest of the file.
+  MappedVarstructFile<AlignedFrame> file;
+  ASSERT_TRUE(file.Open(path.c_str()));
+  EXPECT_EQ(file.BuildIndex({3}), 3);
+  for (std::size_t i = 0; i < 3; i++) {
+    const auto record = file.record(i);
+    EXPECT_EQ(record.type(), i);
+    EXPECT_EQ(record.payload_size(), 3);
+    EXPECT_EQ(record.payload(2), 'x' + i);
+    EXPECT_EQ(record.size_bytes(), 8);
+  }
+  std::remove(path.c_str());
+}
+
+// Counts the records of a chunk and sums the sizes of their names.
+struct NameSizes {
+  std::pair<std::size_t, std::size_t> operator()(
+      const VarstructChunkRange<Tlv>& records) const {
+    std::pair<std::size_t, std::size_t> result(0, 0);
+    for (const auto& record : records) {
+      result.first++;
+      result.second += record.name_size();
+    }
+    return result;
+  }
+};
+
+TEST(ParallelScanTest, ScansChunks) {
+  // 100 Tlv records of 3 to 12 bytes, each starting with a 0xff tag.
+  string buf;
+  for (int i = 0; i < 100; i++) {
+    buf += static_cast<char>(i % 10);
+    buf += string(i % 10, 'n');
+    buf += string{'\xff', 0, 0};
+  }
+
+  const auto boundaries =
+      VarstructChunkBoundaries<Tlv>(buf.data(), buf.size(), {1}, 64);
+  EXPECT_EQ(boundaries.front(), 0);
+  EXPECT_EQ(boundaries.back(), buf.size());
+  EXPECT_GT(boundaries.size(), 2);
+
+  const auto results = ParallelScanVarstructs<Tlv>(buf.data(), boundaries,
+                                                   {1}, 4, NameSizes());
+  ASSERT_EQ(results.size(), boundaries.size() - 1);
+  std::size_t records = 0;
+  std::size_t name_bytes = 0;
+  for (const auto& result : results) {
+    records += result.first;
+    name_bytes += result.second;
+  }
+  EXPECT_EQ(records, 100);
+  EXPECT_EQ(name_bytes, 10 * 45);
+
+  // The same chunks are found from the sync markers, and give the same
+  // results.
+  const auto synced = VarstructChunkBoundariesAtSync(
+      buf.data(), buf.size(), 64,
+      [](const char* data, std::size_t len, std::size_t offset) {
+        const std::size_t tag = string(data, len).find('\xff', offset);
+        return (tag == string::npos) ? len : tag + 3;
+      });
+  EXPECT_EQ(synced.back(), buf.size());
+  EXPECT_EQ(ParallelScanVarstructs<Tlv>(buf.data(), synced, {1}, 0,
+                                        NameSizes())
+                .size(),
+            synced.size() - 1);
+
+  EXPECT_TRUE(ParallelScanVarstructs<Tlv>(buf.data(), {0}, {1}, 4,
+                                          NameSizes())
+                  .empty());
+}
+
+TEST(VarstructLayoutCacheTest, LooksUpLayouts) {
+  VarstructLayoutCache<SimpleStruct, 2> cache;
+  const auto* layout = cache.Lookup({3, 2});
+  ASSERT_NE(layout, nullptr);
+  EXPECT_EQ(layout->baz_offset(), 7);
+  EXPECT_EQ(cache.Lookup({3, 2}), layout);
+
+  char buf[] = {'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i'};
+  EXPECT_EQ(layout->bind(&buf).baz(1), 'i');
+
+  // Once the cache is full, sizes not in it are not cached.
+  EXPECT_NE(cache.Lookup({2, 3}), nullptr);
+  EXPECT_EQ(cache.size(), 2);
+  EXPECT_EQ(cache.Lookup({1, 1}), nullptr);
+  EXPECT_EQ(cache.Lookup({3, 2}), layout);
+}
+
+TEST(VarstructLayoutCacheTest, ConcurrentLookups) {
+  VarstructLayoutCache<SimpleStruct> cache;
+  std::vector<const void*> layouts(8 * 16);
+  std::vector<std::thread> threads;
+  for (std::size_t t = 0; t < 8; t++) {
+    threads.emplace_back([&cache, &layouts, t] {
+      for (std::size_t i = 0; i < 16; i++) {
+        layouts[t * 16 + i] = cache.Lookup({i, 1});
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  // Every thread got the same layout for the same sizes.
+  EXPECT_EQ(cache.size(), 16);
+  for (std::size_t t = 0; t < 8; t++) {
+    for (std::size_t i = 0; i < 16; i++) {
+      EXPECT_EQ(layouts[t * 16 + i], layouts[i]);
+    }
+  }
+  EXPECT_EQ(cache.Lookup({5, 1})->size_bytes(), 4 + 5 + 1);
+}
+
+DEFINE_VARSTRUCT(Message) {
+  VARSTRUCT_SCALAR_BE(uint16_t, type);
+  VARSTRUCT_ARRAY(char, payload);
+  VARSTRUCT_SCALAR(uint8_t, flags);
+  VARSTRUCT_ARRAY_BE(uint16_t, ids);
+};
+
+// Concatenates the bytes of the iovecs.
+std::string JoinIovecs(const struct iovec* iov, int iovcnt) {
+  std::string bytes;
+  for (int i = 0; i < iovcnt; i++) {
+    bytes.append(static_cast<const char*>(iov[i].iov_base), iov[i].iov_len);
+  }
+  return bytes;
+}
+
+TEST(VarstructIovecTest, ReferencesLargeArrays) {
+  const std::string payload(100, 'p');
+  const std::vector<uint16_t> ids = {1, 2};
+  char buf[128];
+  auto message = Message::Build(&buf, sizeof(buf), 7, payload, 3, ids);
+  ASSERT_TRUE(message);
+
+  // The payload is sent from its own memory, between runs of copied bytes.
+  VarstructIovec<Message> iovec;
+  ASSERT_TRUE(iovec.Build(7, payload, 3, ids));
+  ASSERT_EQ(iovec.iovcnt(), 3);
+  EXPECT_EQ(iovec.iov()[0].iov_len, 2);
+  EXPECT_EQ(iovec.iov()[1].iov_base, payload.data());
+  EXPECT_EQ(iovec.iov()[2].iov_len, 1 + 4);
+  EXPECT_EQ(iovec.size_bytes(), message->size_bytes());
+  EXPECT_EQ(JoinIovecs(iovec.iov(), iovec.iovcnt()),
+            std::string(buf, message->size_bytes()));
+
+  // Arrays smaller than min_ref_bytes, and those whose bytes are swapped, are
+  // copied.
+  VarstructIovec<Message> copied(/*min_ref_bytes=*/101);
+  ASSERT_TRUE(copied.Build(7, payload, 3, ids));
+  ASSERT_EQ(copied.iovcnt(), 1);
+  EXPECT_EQ(JoinIovecs(copied.iov(), copied.iovcnt()),
+            std::string(buf, message->size_bytes()));
+
+  // Records needing more inline bytes or iovecs than available fail.
+  VarstructIovec<Message, /*kInlineBytes=*/4> small_inline;
+  EXPECT_FALSE(small_inline.Build(7, payload, 3, ids));
+  EXPECT_EQ(small_inline.iovcnt(), 0);
+  VarstructIovec<Message, 256, /*kMaxIovecs=*/2> few_iovecs;
+  EXPECT_FALSE(few_iovecs.Build(7, payload, 3, ids));
+
+  // So do records whose count fields do not hold the sizes of their arrays.
+  VarstructIovec<Tlv> tlv;
+  EXPECT_FALSE(tlv.Build(2, std::string("abc"), std::string("t"), 2,
+                         std::string("xy")));
+  EXPECT_EQ(tlv.iovcnt(), 0);
+  EXPECT_TRUE(tlv.Build(3, std::string("abc"), std::string("t"), 2,
+                        std::string("xy")));
+}
+
+TEST(VarstructIovecTest, EmptyArrays) {
+  char buf[4];
+  auto simple_struct = SimpleStruct::Build(&buf, sizeof(buf), 8, std::string(),
+                                           std::vector<char>());
+  ASSERT_TRUE(simple_struct);
+  VarstructIovec<SimpleStruct> iovec;
+  ASSERT_TRUE(iovec.Build(8, std::string(), std::vector<char>()));
+  EXPECT_EQ(JoinIovecs(iovec.iov(), iovec.iovcnt()),
+            std::string(buf, sizeof(buf)));
+}
+
+TEST(VarstructIovecTest, PackedBitsAndPadding) {
+  unsigned char header_buf[] = {0x42, 0xa1, 0x23, 0x07, 0x00, 'o', 'p'};
+  VarstructIovec<PackedHeader> header;
+  ASSERT_TRUE(header.Build(4, 2, 5, 0x123, 7, std::string("op")));
+  EXPECT_EQ(JoinIovecs(header.iov(), header.iovcnt()),
+            std::string(reinterpret_cast<char*>(header_buf),
+                        sizeof(header_buf)));
+
+  // Padding between fields is zeroed.
+  alignas(8) char aligned_buf[32] = {};
+  const std::vector<uint64_t> values = {5};
+  auto aligned = AlignedStruct::Build(&aligned_buf, sizeof(aligned_buf), 'a', 9,
+                                      std::string("b"), values, 3);
+  ASSERT_TRUE(aligned);
+  VarstructIovec<AlignedStruct> aligned_iovec(/*min_ref_bytes=*/8);
+  ASSERT_TRUE(aligned_iovec.Build('a', 9, std::string("b"), values, 3));
+  EXPECT_EQ(aligned_iovec.iovcnt(), 3);
+  EXPECT_EQ(JoinIovecs(aligned_iovec.iov(), aligned_iovec.iovcnt()),
+            std::string(aligned_buf, aligned->size_bytes()));
+}
+
+TEST(VarstructParserTest, ParsesPartialRecords) {
+  char buf[] = {3, 'a', 'b', 'c', 't', 0, 0, 'x', 'y'};
+  const uint16_t value_len = 2;
+  std::memcpy(&buf[5], &value_len, sizeof(value_len));
+
+  // Each call stops at the next count field that has not arrived, and then
+  // at the end of the record.
+  VarstructParser<Tlv> parser({1});
+  EXPECT_EQ(parser.Parse(nullptr, 0), 1);
+  EXPECT_EQ(parser.Parse(&buf, 1), 6);
+  EXPECT_EQ(parser.Parse(&buf, 6), 1);
+  EXPECT_FALSE(parser.has_layout());
+  EXPECT_EQ(parser.Parse(&buf, 7), 2);
+  ASSERT_TRUE(parser.has_layout());
+  EXPECT_EQ(parser.size_bytes(), sizeof(buf));
+  EXPECT_EQ(parser.Parse(&buf, sizeof(buf)), 0);
+
+  auto tlv = parser.record(&buf);
+  EXPECT_EQ(tlv.name(2), 'c');
+  EXPECT_EQ(tlv.value_offset(), 7);
+  EXPECT_EQ(tlv.value(1), 'y');
+
+  // A byte at a time, from a buffer that moves, gives the same layout.
+  parser.Reset();
+  std::vector<char> received;
+  std::size_t needed = 1;
+  for (char byte : buf) {
+    ASSERT_NE(needed, 0);
+    received.push_back(byte);
+    needed = parser.Parse(received.data(), received.size());
+  }
+  EXPECT_EQ(needed, 0);
+  EXPECT_EQ(parser.record(received.data()).value(0), 'x');
+
+  // Varstructs without sized-by arrays only wait for the whole record.
+  VarstructParser<SimpleStruct> simple_parser({3, 2});
+  EXPECT_EQ(simple_parser.Parse(&buf, 2), 4 + 3 + 2 - 2);
+}
+
+DEFINE_VARSTRUCT(LimitedTlv) {
+  VARSTRUCT_SCALAR(uint8_t, type);
+  VARSTRUCT_ARRAY(char, tag);
+  VARSTRUCT_MAX_COUNT(tag, 2);
+  VARSTRUCT_SCALAR(uint8_t, len);
+  VARSTRUCT_ARRAY_SIZED_BY(char, data, len);
+  VARSTRUCT_MAX_COUNT(data, 4);
+};
+
+TEST(VarstructTest, MaxCount) {
+  const char buf[] = {1, 'a', 5, 'v', 'w', 'x', 'y', 'z'};
+  EXPECT_FALSE(LimitedTlv::Create(&buf, sizeof(buf), {1}));
+  EXPECT_FALSE(LimitedTlv::Create(&buf, sizeof(buf), {3}));
+  const char ok_buf[] = {1, 'a', 4, 'w', 'x', 'y', 'z'};
+  auto limited = LimitedTlv::Create(&ok_buf, sizeof(ok_buf), {1});
+  ASSERT_TRUE(limited);
+  EXPECT_EQ(limited->size_bytes(), sizeof(ok_buf));
+
+  char built[16];
+  EXPECT_TRUE(LimitedTlv::Build(&built, sizeof(built), 1, std::string("ab"),
+                                4, std::string("wxyz")));
+  EXPECT_FALSE(LimitedTlv::Build(&built, sizeof(built), 1, std::string("abc"),
+                                 0, std::string()));
+}
+
+DEFINE_VARSTRUCT(Words) {
+  VARSTRUCT_ARRAY(uint64_t, words);
+  VARSTRUCT_SCALAR(uint8_t, tail);
+};
+
+TEST(VarstructTest, SizesThatOverflow) {
+  // The size of the array in bytes wraps around to 0.
+  const std::size_t wraps = std::numeric_limits<std::size_t>::max() / 8 + 1;
+  char buf[16] = {};
+  EXPECT_FALSE(Words::Create(&buf, sizeof(buf), {wraps}));
+  // As do offsets past half the address space.
+  EXPECT_FALSE(Words::Create(&buf, sizeof(buf), {wraps / 2}));
+  EXPECT_TRUE(Words::Create(&buf, sizeof(buf), {1}));
+}
+
+DEFINE_VARSTRUCT(WideTlv) {
+  VARSTRUCT_SCALAR(uint64_t, len);
+  VARSTRUCT_ARRAY_SIZED_BY(uint64_t, data, len);
+};
+
+DEFINE_VARSTRUCT(NestedTlv) {
+  VARSTRUCT_SCALAR(uint16_t, kind);
+  VARSTRUCT_NESTED(OnlySizedBy, inner);
+};
+
+TEST(VarstructParserTest, RejectsInvalidRecords) {
+  // The count of data is over its max count once it has arrived.
+  const char over_max[] = {1, 'a', 10, 'b', 'c'};
+  VarstructParser<LimitedTlv> parser({1});
+  EXPECT_EQ(parser.Parse(&over_max, 2), 1);
+  EXPECT_FALSE(parser.invalid());
+  EXPECT_EQ(parser.Parse(&over_max, 3),
+            VarstructParser<LimitedTlv>::kInvalidRecord);
+  EXPECT_TRUE(parser.invalid());
+  EXPECT_FALSE(parser.has_layout());
+  EXPECT_EQ(parser.Parse(&over_max, sizeof(over_max)),
+            VarstructParser<LimitedTlv>::kInvalidRecord);
+  parser.Reset();
+  EXPECT_FALSE(parser.invalid());
+  EXPECT_EQ(parser.Parse(&over_max, 2), 1);
+
+  // The size of data in bytes wraps around.
+  alignas(8) char wraps[16] = {};
+  const uint64_t len = std::numeric_limits<uint64_t>::max() / 8 + 1;
+  std::memcpy(&wraps, &len, sizeof(len));
+  VarstructParser<WideTlv> wide_parser;
+  EXPECT_EQ(wide_parser.Parse(&wraps, 4), 4);
+  EXPECT_EQ(wide_parser.Parse(&wraps, sizeof(wraps)),
+            VarstructParser<WideTlv>::kInvalidRecord);
+
+  // Count fields inside nested varstructs are waited for exactly.
+  const char nested[] = {7, 0, 2, 'h', 'i'};
+  VarstructParser<NestedTlv> nested_parser;
+  EXPECT_EQ(nested_parser.Parse(nullptr, 0), 3);
+  EXPECT_EQ(nested_parser.Parse(&nested, 3), 2);
+  EXPECT_EQ(nested_parser.Parse(&nested, sizeof(nested)), 0);
+}
+
+TEST(VarstructTest, InvalidSizesWithoutBufferLength) {
+  // Without a buffer length, Create() cannot return failure, so it aborts,
+  // even with NDEBUG, rather than return indeterminate offsets.
+  const std::size_t wraps = std::numeric_limits<std::size_t>::max() / 8 + 1;
+  char buf[16] = {};
+  EXPECT_DEATH_IF_SUPPORTED(Words::Create({wraps}), "overflow");
+  EXPECT_DEATH_IF_SUPPORTED(Words::Create(&buf, {wraps / 2}), "overflow");
+  EXPECT_DEATH_IF_SUPPORTED(LimitedTlv::Create({3, 1}), "MAX_COUNT");
+  const char too_long[] = {1, 'a', 5, 'v', 'w', 'x', 'y', 'z'};
+  EXPECT_DEATH_IF_SUPPORTED(LimitedTlv::Create(&too_long, {1}), "MAX_COUNT");
+  VarstructArena arena;
+  EXPECT_DEATH_IF_SUPPORTED(Words::AllocateAndCreate(&arena, {wraps}),
+                            "overflow");
+  EXPECT_DEATH_IF_SUPPORTED(
+      Words::CreateLazy(static_cast<void*>(&buf), {wraps}).tail_offset(),
+      "overflow");
+
+  // Neither can the constructors that copy the array sizes.
+  const std::vector<std::size_t> too_many(8);
+  EXPECT_DEATH_IF_SUPPORTED(
+      Words::CreateLazy(static_cast<void*>(&buf), too_many),
+      "too many array sizes");
+  EXPECT_DEATH_IF_SUPPORTED(Words::CreateRange(&buf, sizeof(buf), too_many),
+                            "too many array sizes");
+  EXPECT_DEATH_IF_SUPPORTED(VarstructParser<Words>(too_many).Reset(),
+                            "too many array sizes");
+
+  // Lookup() returns null instead, without caching the sizes.
+  VarstructLayoutCache<LimitedTlv> cache;
+  EXPECT_EQ(nullptr, cache.Lookup({3, 1}));
+  EXPECT_EQ(0u, cache.size());
+  ASSERT_NE(nullptr, cache.Lookup({2, 4}));
+}
+
+TEST(VarstructTest, ValidateBatch) {
+  const char good[] = {1, 'a', 2, 'x', 'y'};
+  const char too_long[] = {1, 'a', 5, 'v', 'w', 'x', 'y', 'z'};
+  const char truncated[] = {1, 'a', 3, 'x'};
+  const char no_count[] = {1, 'a'};
+  const void* records[] = {good, too_long, truncated, no_count, good};
+  const std::size_t lens[] = {sizeof(good), sizeof(too_long),
+                              sizeof(truncated), sizeof(no_count),
+                              sizeof(good)};
+  bool valid[5];
+  EXPECT_EQ(ValidateVarstructs<LimitedTlv>(records, lens, 5, {1}, valid), 2);
+  EXPECT_TRUE(valid[0]);
+  EXPECT_FALSE(valid[1]);
+  EXPECT_FALSE(valid[2]);
+  EXPECT_FALSE(valid[3]);
+  EXPECT_TRUE(valid[4]);
+
+  // Sizes passed in beyond the max count make every record invalid.
+  EXPECT_EQ(ValidateVarstructs<LimitedTlv>(records, lens, 5, {3}, valid), 0);
+  EXPECT_FALSE(valid[0]);
+
+  // Records of fixed size are only checked by their lengths.
+  const std::size_t simple_lens[] = {4 + 2 + 3, 4 + 2 + 2};
+  EXPECT_EQ(
+      ValidateVarstructs<SimpleStruct>(records, simple_lens, 2, {2, 3}, valid),
+      1);
+  EXPECT_TRUE(valid[0]);
+  EXPECT_FALSE(valid[1]);
+}
+
+// The schema is known at compile time.
+static_assert(Tlv::schema().num_fields == 5, "Tlv has 5 fields");
+static_assert(Tlv::schema().fields[4].size_field == 3,
+              "Tlv::value is sized by value_len");
+
+TEST(VarstructTest, Schema) {
+  const varstruct_internal::Schema& tlv = Tlv::schema();
+  EXPECT_STREQ("Tlv", tlv.name);
+  EXPECT_EQ(1u, tlv.alignment);
+  EXPECT_STREQ("name", tlv.fields[1].name);
+  EXPECT_STREQ("char", tlv.fields[1].type);
+  EXPECT_EQ(varstruct_internal::FieldKind::kSizedByArray, tlv.fields[1].kind);
+  EXPECT_EQ(0u, tlv.fields[1].size_field);
+  EXPECT_EQ(varstruct_internal::FieldKind::kArray, tlv.fields[2].kind);
+  EXPECT_EQ(varstruct_internal::kNoSizeField, tlv.fields[2].size_field);
+  EXPECT_EQ(varstruct_internal::ValueKind::kUnsigned,
+            tlv.fields[3].value_kind);
+  EXPECT_EQ(2u, tlv.fields[3].elem_size);
+
+  const varstruct_internal::Schema& header = PackedHeader::schema();
+  EXPECT_EQ(varstruct_internal::FieldKind::kBits, header.fields[1].kind);
+  EXPECT_FALSE(header.fields[1].big_endian);
+  // Bits are assigned from the most significant bit down.
+  EXPECT_EQ(4u, header.fields[0].bit_shift);
+  EXPECT_EQ(0u, header.fields[1].bit_shift);
+  EXPECT_EQ(4u, header.fields[1].bit_width);
+  EXPECT_TRUE(header.fields[1].shares_word);
+  EXPECT_TRUE(header.fields[2].big_endian);
+  EXPECT_FALSE(header.fields[2].shares_word);
+
+  EXPECT_FALSE(Record::schema().fields[1].hashed);
+  EXPECT_EQ(2u, LimitedTlv::schema().fields[1].max_count);
+  EXPECT_EQ(varstruct_internal::kNoMaxCount,
+            LimitedTlv::schema().fields[0].max_count);
+
+  const varstruct_internal::Schema& envelope = Envelope::schema();
+  EXPECT_EQ(varstruct_internal::FieldKind::kNested, envelope.fields[1].kind);
+  EXPECT_EQ(varstruct_internal::FieldKind::kNestedArray,
+            envelope.fields[2].kind);
+  EXPECT_EQ(0u, envelope.fields[2].elem_size);
+  EXPECT_EQ(&SimpleStruct::schema(), envelope.fields[2].nested);
+  EXPECT_EQ(nullptr, envelope.fields[0].nested);
+}
+
+TEST(VarstructTest, SchemaJson) {
+  EXPECT_EQ(
+      "{\"name\": \"OnlySizedBy\", \"alignment\": 1, \"fields\": ["
+      "{\"name\": \"len\", \"type\": \"uint8_t\", \"kind\": \"scalar\", "
+      "\"value_kind\": \"unsigned\", \"elem_size\": 1, \"alignment\": 1, "
+      "\"big_endian\": false, \"bit_shift\": 0, \"bit_width\": 0, "
+      "\"shares_word\": false, \"size_field\": null, \"max_count\": null, "
+      "\"hashed\": true, \"nested\": null}, "
+      "{\"name\": \"data\", \"type\": \"char\", "
+      "\"kind\": \"sized_by_array\", \"value_kind\": \"signed\", "
+      "\"elem_size\": 1, \"alignment\": 1, \"big_endian\": false, "
+      "\"bit_shift\": 0, \"bit_width\": 0, \"shares_word\": false, "
+      "\"size_field\": \"len\", \"max_count\": null, \"hashed\": true, "
+      "\"nested\": null}]}",
+      VarstructSchemaJson(OnlySizedBy::schema()));
+
+  const string list = VarstructSchemaListJson<EmptyStruct, Envelope>();
+  EXPECT_EQ(0u, list.find("[{\"name\": \"EmptyStruct\", \"alignment\": 1, "
+                          "\"fields\": []},\n{\"name\": \"Envelope\""));
+  EXPECT_NE(string::npos, list.find("\"nested\": {\"name\": \"SimpleStruct\""));
+
+  // Quotes, backslashes and control characters in names are escaped.
+  const varstruct_internal::Schema escaped = {"a\"\\\n\x1f", 1, 0, nullptr};
+  EXPECT_EQ("{\"name\": \"a\\\"\\\\\\u000a\\u001f\", \"alignment\": 1, "
+            "\"fields\": []}",
+            VarstructSchemaJson(escaped));
+}
+
+TEST(VarstructTest, Slice) {
+  char buf[4 + 5 + 8] = {};
+  const auto simple_struct = SimpleStruct::Create(&buf, {5, 8});
+  static_assert(SimpleStruct::bar_index() == 1, "bar is the second field");
+
+  const auto arrays = simple_struct.slice<SimpleStruct::bar_index(),
+                                          SimpleStruct::baz_index()>();
+  EXPECT_EQ(arrays.data(), &buf[4]);
+  EXPECT_EQ(arrays.size(), 5 + 8);
+  const auto foo = simple_struct.slice<0, 0>();
+  EXPECT_EQ(foo.data(), &buf[0]);
+  EXPECT_EQ(foo.size(), 4);
+
+  const auto bar = simple_struct.bar_bytes().subspan(1, 3);
+  EXPECT_EQ(bar.data(), &buf[5]);
+  EXPECT_EQ(bar.size(), 3);
+  EXPECT_TRUE(simple_struct.baz_bytes().subspan(8, 0).empty());
+
+  // A slice of a bound varstruct, over a varstruct with padding between its
+  // fields and bits that share a word.
+  alignas(8) char aligned[32] = {};
+  const auto layout = AlignedStruct::Create({3, 1});
+  const auto middle = layout.bind(&aligned)
+                          .slice<AlignedStruct::id_index(),
+                                 AlignedStruct::values_index()>();
+  EXPECT_EQ(middle.data(), &aligned[4]);
+  EXPECT_EQ(middle.size(), 4 + 3 + 5 + 8);
+  const unsigned char header_buf[] = {0x42, 0xa1, 0x23, 0x07, 0x00, 'o', 'p'};
+  const auto word = PackedHeader::Create(&header_buf, {})
+                        .slice<PackedHeader::options_len_index(),
+                               PackedHeader::options_len_index()>();
+  EXPECT_EQ(word.data(), reinterpret_cast<const char*>(&header_buf[0]));
+  EXPECT_EQ(word.size(), 1);
+}
+
+TEST(VarstructTest, GatherScalar) {
+  char buf[3 * 7] = {};
+  for (int i = 0; i < 3; i++) {
+    SimpleStruct::Create(&buf[7 * i], {1, 2}).set_foo(10 * i);
+  }
+
+  int foos[3] = {};
+  SimpleStruct::Create({1, 2}).foo_gather(buf, 3, foos);
+  EXPECT_EQ(foos[0], 0);
+  EXPECT_EQ(foos[1], 10);
+  EXPECT_EQ(foos[2], 20);
+
+  // Every other record, with a layout known at compile time.
+  int every_other[2] = {};
+  constexpr auto layout = SimpleStruct::CreateStatic<1, 2>();
+  layout.foo_gather(buf, 2 * layout.size_bytes(), 2, every_other);
+  EXPECT_EQ(every_other[0], 0);
+  EXPECT_EQ(every_other[1], 20);
+}
+
+TEST(VarstructTest, RangeOfSizedByArrays) {
+  // len = 2, data = "hi", then len = 0, then len = 3, data = "abc", then a
+  // truncated record whose data would run past the end of the buffer.
+  const char buf[] = {2, 'h', 'i', 0, 3, 'a', 'b', 'c', 4, 'x'};
+
+  std::vector<std::size_t> sizes;
+  std::vector<std::size_t> offsets;
+  const auto range = OnlySizedBy::CreateRange(&buf, sizeof(buf), {});
+  auto it = range.begin();
+  for (; it != range.end(); ++it) {
+    sizes.push_back(it->data_size());
+    offsets.push_back(it.offset());
+  }
+  EXPECT_EQ(sizes, (std::vector<std::size_t>{2, 0, 3}));
+  EXPECT_EQ(offsets, (std::vector<std::size_t>{0, 3, 4}));
+  EXPECT_EQ(it.offset(), 8);
+
+  // The count of the last record is not inside the buffer at all.
+  auto truncated = OnlySizedBy::CreateRange(&buf, 0, {});
+  EXPECT_EQ(truncated.begin(), truncated.end());
+}
+
 namespace TestNamespace {
 DEFINE_VARSTRUCT(InNamespace) { VARSTRUCT_SCALAR(int, the_scalar); };
 }  // namespace TestNamespace
@@ -0,0 +1,127 @@
+// Copyright 2017 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// ValidateVarstructs() checks a batch of untrusted records, as received by a
+// server, before any of them is processed:
+//
+// bool valid[kBatchSize];
+// ValidateVarstructs<Tlv>(packets, packet_lens, num_packets, {}, valid);
+// for (std::size_t i = 0; i < num_packets; i++) {
+//   if (!valid[i]) continue;  // Drop the packet.
+//   auto tlv = Tlv::Create(packets[i], packet_lens[i], {});
+//   ...
+// }
+//
+// A record is valid if Create(record, len, array_sizes) would succeed: the
+// count fields of its VARSTRUCT_ARRAY_SIZED_BY() arrays lie within the record,
+// no array exceeds its VARSTRUCT_MAX_COUNT(), the offsets do not overflow, and
+// the whole varstruct fits in len bytes.
+//
+// The fields before the first VARSTRUCT_ARRAY_SIZED_BY() or
+// VARSTRUCT_TRAILING_ARRAY() field (or nested varstruct that has one) are at
+// the same offsets in every record, so they are computed once for the batch,
+// and every length is compared against their end in one loop, which the
+// compiler vectorizes. Only records long enough for them have the remaining
+// offsets computed, reading their count fields. Records of varstructs without
+// such fields all have the same size, and need no further work.
+
+#ifndef VARSTRUCT_VARSTRUCT_VALIDATE_H_
+#define VARSTRUCT_VARSTRUCT_VALIDATE_H_
+
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+#include "varstruct.h"
+
+// Sets valid[i] to whether the record of lens[i] bytes at records[i] is a
+// valid Varstruct with the given array sizes, for each of the count records,
+// and returns the number of valid records. The records must be aligned as for
+// Create().
+template <typename Varstruct>
+std::size_t ValidateVarstructs(const void* const* records,
+                               const std::size_t* lens, std::size_t count,
+                               varstruct_internal::ArraySizes array_sizes,
+                               bool* valid) {
+  using Table = varstruct_internal::FieldTable<Varstruct>;
+  constexpr std::size_t kNumSlots =
+      varstruct_internal::FieldAccess::NumSlots<Varstruct>();
+
+  // Compute the offsets of the fields that are the same in every record.
+  std::array<std::size_t, kNumSlots + 1> fixed_offsets;
+  std::size_t num_fixed = 0;
+  for (; num_fixed < Table::kNumFields; num_fixed++) {
+    const varstruct_internal::FieldSpec& field = Table::kFields[num_fixed];
+    if (field.reads_sizes || field.trailing) {
+      break;
+    }
+    if (!varstruct_internal::ComputeFieldOffset<Varstruct>(
+            num_fixed, nullptr, varstruct_internal::kUnknownBufferLen,
+            &array_sizes, fixed_offsets.data())) {
+      // The array sizes passed in exceed a VARSTRUCT_MAX_COUNT().
+      for (std::size_t i = 0; i < count; i++) {
+        valid[i] = false;
+      }
+      return 0;
+    }
+  }
+  std::size_t min_len =
+      (num_fixed == 0)
+          ? 0
+          : fixed_offsets[Table::kFields[num_fixed - 1].end_slot];
+  if (num_fixed == Table::kNumFields) {
+    // The number of array sizes should be the same as the number of
+    // VARSTRUCT_ARRAY() declarations.
+    assert(array_sizes.empty());
+    min_len = varstruct_internal::AlignUp(min_len, Varstruct::alignment());
+  }
+
+  std::size_t num_valid = 0;
+  for (std::size_t i = 0; i < count; i++) {
+    valid[i] = lens[i] >= min_len;
+    num_valid += valid[i];
+  }
+  if (num_fixed == Table::kNumFields) {
+    return num_valid;
+  }
+
+  std::array<std::size_t, kNumSlots + 1> offsets = fixed_offsets;
+  for (std::size_t i = 0; i < count; i++) {
+    if (!valid[i]) {
+      continue;
+    }
+    assert(reinterpret_cast<std::uintptr_t>(records[i]) %
+               Varstruct::alignment() ==
+           0);
+    // No count field is read from an empty record, which may have no data.
+    const char* base =
+        (lens[i] == 0) ? "" : static_cast<const char*>(records[i]);
+    varstruct_internal::ArraySizes remaining_sizes = array_sizes;
+    bool ok = true;
+    for (std::size_t j = num_fixed; ok && j < Table::kNumFields; j++) {
+      ok = varstruct_internal::ComputeFieldOffset<Varstruct>(
+          j, base, lens[i], &remaining_sizes, offsets.data());
+    }
+    // As for Create(), every array size should have been used.
+    assert(!ok || remaining_sizes.empty());
+    valid[i] = ok && varstruct_internal::AlignUp(offsets[kNumSlots - 1],
+                                                 Varstruct::alignment()) <=
+                         lens[i];
+    num_valid -= !valid[i];
+  }
+  return num_valid;
+}
+
+#endif  // VARSTRUCT_VARSTRUCT_VALIDATE_H_